@@ -9,41 +9,113 @@ declare namespace ParcelWatcher {
     | 'windows'
     | 'brute-force';
   export type EventType = 'create' | 'update' | 'delete';
+  export interface AbortSignalLike {
+    readonly aborted: boolean;
+    addEventListener(type: 'abort', listener: () => void): void;
+    removeEventListener?(type: 'abort', listener: () => void): void;
+  }
   export interface Options {
     ignore?: (FilePath|GlobPattern)[];
     backend?: BackendType;
+    signal?: AbortSignalLike;
+  }
+  export interface SubscribeOptions extends Options {
+    cache?: FilePath;
+    immediate?: GlobPattern[];
+    types?: EventType[];
+    include?: GlobPattern[];
+    directories?: boolean;
+  }
+  export interface QueryOptions extends Options {
+    subpath?: FilePath;
+  }
+  export interface WriteSnapshotOptions extends QueryOptions {
+    journal?: boolean | number;
+    compact?: boolean;
+    hash?: boolean;
   }
   export type SubscribeCallback = (
     err: Error | null,
     events: Event[]
   ) => unknown;
+  export interface UpdateOptions {
+    ignore?: (FilePath|GlobPattern)[];
+  }
   export interface AsyncSubscription {
     unsubscribe(): Promise<void>;
+    update(opts: UpdateOptions): Promise<void>;
+    pause(): void;
+    resume(): void;
+    flush(): Promise<void>;
   }
   export interface Event {
     path: FilePath;
     type: EventType;
   }
+  export interface EventsSince extends Array<Event> {
+    readonly live: boolean;
+  }
+  export interface Snapshot {
+    readonly dir: FilePath;
+    getEventsSince(snapshot: Snapshot): Promise<Event[]>;
+    write(snapshot: FilePath): Promise<void>;
+  }
   export function getEventsSince(
+    dir: FilePath,
+    snapshot: FilePath | Snapshot,
+    opts?: QueryOptions
+  ): Promise<EventsSince>;
+  export function updateSnapshot(
+    dir: FilePath,
+    snapshot: FilePath,
+    opts?: QueryOptions
+  ): Promise<EventsSince>;
+  export function hasChanged(
     dir: FilePath,
     snapshot: FilePath,
+    opts?: QueryOptions
+  ): Promise<boolean>;
+  export function diffSnapshots(
+    before: FilePath,
+    after: FilePath,
     opts?: Options
   ): Promise<Event[]>;
+  export function batchWriteSnapshot(
+    dirs: FilePath[],
+    snapshot: FilePath,
+    opts?: WriteSnapshotOptions
+  ): Promise<void>;
+  export function batchGetEventsSince(
+    dirs: FilePath[],
+    snapshot: FilePath,
+    opts?: Options
+  ): Promise<EventsSince[]>;
+  export function captureSnapshot(
+    dir: FilePath,
+    opts?: Options
+  ): Promise<Snapshot>;
   export function subscribe(
     dir: FilePath,
     fn: SubscribeCallback,
-    opts?: Options
+    opts?: SubscribeOptions
   ): Promise<AsyncSubscription>;
   export function unsubscribe(
     dir: FilePath,
     fn: SubscribeCallback,
     opts?: Options
   ): Promise<void>;
+  export function flush(
+    dir: FilePath,
+    opts?: Options
+  ): Promise<void>;
   export function writeSnapshot(
     dir: FilePath,
     snapshot: FilePath,
-    opts?: Options
+    opts?: WriteSnapshotOptions
   ): Promise<FilePath>;
+  export function setWorkerPoolSize(size: number): void;
+  export function setCrawlTTL(ms: number): void;
+  export function setTreeCacheSize(bytes: number): void;
 }
 
 export = ParcelWatcher;
\ No newline at end of file
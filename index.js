@@ -37,6 +37,26 @@ function normalizeOptions(dir, opts = {}) {
     }
   }
 
+  if (Array.isArray(opts.immediate)) {
+    const { immediate, ...rest } = opts;
+    opts = {
+      ...rest,
+      immediateGlobs: immediate.map((value) => micromatch.makeRe(value, { dot: true, lookbehinds: false }).source),
+    };
+  }
+
+  if (Array.isArray(opts.include)) {
+    const { include, ...rest } = opts;
+    opts = {
+      ...rest,
+      includeGlobs: include.map((value) => micromatch.makeRe(value, { dot: true, lookbehinds: false }).source),
+    };
+  }
+
+  if (typeof opts.subpath === 'string') {
+    opts = { ...opts, subpath: path.resolve(dir, opts.subpath) };
+  }
+
   return opts;
 }
 
@@ -51,20 +71,94 @@ exports.writeSnapshot = (dir, snapshot, opts) => {
 exports.getEventsSince = (dir, snapshot, opts) => {
   return binding.getEventsSince(
     path.resolve(dir),
+    typeof snapshot === 'string' ? path.resolve(snapshot) : snapshot,
+    normalizeOptions(dir, opts),
+  );
+};
+
+exports.updateSnapshot = (dir, snapshot, opts) => {
+  return binding.updateSnapshot(
+    path.resolve(dir),
+    path.resolve(snapshot),
+    normalizeOptions(dir, opts),
+  );
+};
+
+exports.hasChanged = (dir, snapshot, opts) => {
+  return binding.hasChanged(
+    path.resolve(dir),
+    path.resolve(snapshot),
+    normalizeOptions(dir, opts),
+  );
+};
+
+exports.diffSnapshots = (before, after, opts) => {
+  return binding.diffSnapshots(
+    path.resolve(before),
+    path.resolve(after),
+    normalizeOptions(process.cwd(), opts),
+  );
+};
+
+// Relative ignore paths are resolved against each of the directories, like for a single one.
+exports.batchWriteSnapshot = (dirs, snapshot, opts) => {
+  dirs = dirs.map((dir) => path.resolve(dir));
+  return binding.batchWriteSnapshot(
+    dirs,
     path.resolve(snapshot),
+    normalizeOptions(process.cwd(), opts),
+    dirs.map((dir) => normalizeOptions(dir, opts)),
+  );
+};
+
+exports.batchGetEventsSince = (dirs, snapshot, opts) => {
+  dirs = dirs.map((dir) => path.resolve(dir));
+  return binding.batchGetEventsSince(
+    dirs,
+    path.resolve(snapshot),
+    normalizeOptions(process.cwd(), opts),
+    dirs.map((dir) => normalizeOptions(dir, opts)),
+  );
+};
+
+exports.captureSnapshot = (dir, opts) => {
+  return binding.captureSnapshot(
+    path.resolve(dir),
     normalizeOptions(dir, opts),
   );
 };
 
 exports.subscribe = async (dir, fn, opts) => {
   dir = path.resolve(dir);
+  let rawOpts = opts;
   opts = normalizeOptions(dir, opts);
+  if (typeof opts.cache === 'string') {
+    opts = { ...opts, cache: path.resolve(opts.cache) };
+  }
+
   await binding.subscribe(dir, fn, opts);
 
   return {
     unsubscribe() {
       return binding.unsubscribe(dir, fn, opts);
     },
+    pause() {
+      binding.pause(dir, fn, opts);
+    },
+    resume() {
+      binding.resume(dir, fn, opts);
+    },
+    flush() {
+      return binding.flush(dir, opts);
+    },
+    async update(updateOpts) {
+      // Only the ignore option can be changed.
+      let nextRawOpts = { ...rawOpts, ignore: (updateOpts || {}).ignore };
+      let nextOpts = { ...normalizeOptions(dir, nextRawOpts), cache: opts.cache };
+      await binding.update(dir, fn, opts, nextOpts);
+      rawOpts = nextRawOpts;
+      opts = nextOpts;
+    },
   };
 };
 
@@ -75,3 +169,22 @@ exports.unsubscribe = (dir, fn, opts) => {
     normalizeOptions(dir, opts),
   );
 };
+
+exports.flush = (dir, opts) => {
+  return binding.flush(
+    path.resolve(dir),
+    normalizeOptions(dir, opts),
+  );
+};
+
+exports.setWorkerPoolSize = (size) => {
+  binding.setWorkerPoolSize(size);
+};
+
+exports.setCrawlTTL = (ms) => {
+  binding.setCrawlTTL(ms);
+};
+
+exports.setTreeCacheSize = (bytes) => {
+  binding.setTreeCacheSize(bytes);
+};
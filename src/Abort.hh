@@ -0,0 +1,63 @@
+#ifndef ABORT_H
+#define ABORT_H
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+
+class AbortError : public std::runtime_error {
+public:
+  AbortError() : std::runtime_error("The operation was aborted") {}
+};
+
+// Set from the JS thread when the AbortSignal of an operation fires. The flag of the operation
+// running on a thread is available through current(), so that long running loops such as crawls
+// and diffs can stop early by calling check(), without passing it through every function.
+class AbortFlag {
+public:
+  AbortFlag() : mAborted(false) {}
+
+  void abort() {
+    mAborted = true;
+  }
+
+  bool isAborted() {
+    return mAborted;
+  }
+
+  static std::shared_ptr<AbortFlag> &current() {
+    static thread_local std::shared_ptr<AbortFlag> flag;
+    return flag;
+  }
+
+  static bool aborted() {
+    auto &flag = current();
+    return flag && flag->isAborted();
+  }
+
+  static void check() {
+    if (aborted()) {
+      throw AbortError();
+    }
+  }
+
+private:
+  std::atomic<bool> mAborted;
+};
+
+// Makes a flag the current thread's for the lifetime of the scope.
+class AbortScope {
+public:
+  AbortScope(std::shared_ptr<AbortFlag> flag) : mPrevious(AbortFlag::current()) {
+    AbortFlag::current() = flag;
+  }
+
+  ~AbortScope() {
+    AbortFlag::current() = mPrevious;
+  }
+
+private:
+  std::shared_ptr<AbortFlag> mPrevious;
+};
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef ADDON_DATA_H
+#define ADDON_DATA_H
+
+#include <napi.h>
+#include <memory>
+#include <unordered_set>
+#include "Watcher.hh"
+
+using namespace Napi;
+
+// The state of the addon in one Node.js environment, i.e. the main thread or a worker thread,
+// kept as the environment's instance data. JS values are only valid in the environment they were
+// made in, so watchers, which hold callbacks, aren't shared between environments. Backends, with
+// their threads and trees, are shared by the whole process.
+struct AddonData {
+  std::unordered_set<std::shared_ptr<Watcher>, WatcherHash, WatcherCompare> watchers;
+  FunctionReference snapshotConstructor;
+
+  static AddonData *get(Env env) {
+    return env.GetInstanceData<AddonData>();
+  }
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include <fstream>
+#include <atomic>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include "AtomicFile.hh"
+
+#ifdef _WIN32
+#include <process.h>
+#include "windows/win_utils.hh"
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static std::atomic<unsigned int> tmpCounter(0);
+
+// Flushes a file's contents to disk.
+void syncFile(const std::string &path) {
+#ifdef _WIN32
+  HANDLE handle = CreateFileW(
+    utf8ToUtf16(path).data(),
+    GENERIC_WRITE,
+    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+    NULL,
+    OPEN_EXISTING,
+    FILE_ATTRIBUTE_NORMAL,
+    NULL
+  );
+
+  if (handle == INVALID_HANDLE_VALUE) {
+    throw std::runtime_error("Unable to open file: " + path);
+  }
+
+  bool success = FlushFileBuffers(handle);
+  CloseHandle(handle);
+  if (!success) {
+    throw std::runtime_error("Unable to flush file: " + path);
+  }
+#else
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    throw std::runtime_error("Unable to open file: " + path + ": " + strerror(errno));
+  }
+
+  int err = fsync(fd);
+  close(fd);
+  if (err == -1) {
+    throw std::runtime_error("Unable to flush file: " + path + ": " + strerror(errno));
+  }
+#endif
+}
+
+// Writes a file by writing a temporary file next to it, flushing it to disk, and renaming it over
+// the original. Readers see either the previous contents or the new ones, never a partial file.
+void writeFileAtomic(const std::string &path, std::function<void(std::ostream &)> write) {
+  std::string tmpPath = path + "." + std::to_string(getpid()) + "." + std::to_string(tmpCounter++) + ".tmp";
+
+  {
+    std::ofstream ofs(tmpPath, std::ios::binary);
+    if (ofs.fail()) {
+      throw std::runtime_error("Unable to open file: " + tmpPath);
+    }
+
+    write(ofs);
+    ofs.close();
+    if (ofs.fail()) {
+      remove(tmpPath.c_str());
+      throw std::runtime_error("Unable to write file: " + tmpPath);
+    }
+  }
+
+  try {
+    syncFile(tmpPath);
+  } catch (std::exception &err) {
+    remove(tmpPath.c_str());
+    throw;
+  }
+
+#ifdef _WIN32
+  bool success = MoveFileExW(
+    utf8ToUtf16(tmpPath).data(),
+    utf8ToUtf16(path).data(),
+    MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH
+  );
+
+  if (!success) {
+    DeleteFileW(utf8ToUtf16(tmpPath).data());
+    throw std::runtime_error("Unable to replace file: " + path);
+  }
+#else
+  if (rename(tmpPath.c_str(), path.c_str()) == -1) {
+    std::string err = strerror(errno);
+    remove(tmpPath.c_str());
+    throw std::runtime_error("Unable to replace file: " + path + ": " + err);
+  }
+
+  // Flush the directory entry too, so the rename itself survives a crash.
+  size_t sep = path.find_last_of('/');
+  std::string dir = sep == std::string::npos ? "." : sep == 0 ? "/" : path.substr(0, sep);
+  int fd = open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+#endif
+}
@@ -0,0 +1,11 @@
+#ifndef ATOMIC_FILE_H
+#define ATOMIC_FILE_H
+
+#include <string>
+#include <ostream>
+#include <functional>
+
+void syncFile(const std::string &path);
+void writeFileAtomic(const std::string &path, std::function<void(std::ostream &)> write);
+
+#endif
@@ -14,7 +14,16 @@
 
 #include "Backend.hh"
 #include <unordered_map>
+#include <fstream>
+#include <atomic>
+#include <cstdio>
 
+// How long flush waits for the backend to report its cookie, in milliseconds.
+#define FLUSH_TIMEOUT 5000
+
+// Backends are shared by every environment in the process, i.e. the main thread and worker
+// threads, so the table is guarded by a mutex.
+static std::mutex sharedBackendsMutex;
 static std::unordered_map<std::string, std::shared_ptr<Backend>> sharedBackends;
 
 std::shared_ptr<Backend> getBackend(std::string backend) {
@@ -49,6 +58,7 @@ std::shared_ptr<Backend> getBackend(std::string backend) {
 }
 
 std::shared_ptr<Backend> Backend::getShared(std::string backend) {
+  std::unique_lock<std::mutex> lock(sharedBackendsMutex);
   auto found = sharedBackends.find(backend);
   if (found != sharedBackends.end()) {
     return found->second;
@@ -56,6 +66,7 @@ std::shared_ptr<Backend> Backend::getShared(std::string backend) {
 
   auto result = getBackend(backend);
   if (!result) {
+    lock.unlock();
     return getShared("default");
   }
 
@@ -65,6 +76,7 @@ std::shared_ptr<Backend> Backend::getShared(std::string backend) {
 }
 
 void removeShared(Backend *backend) {
+  std::unique_lock<std::mutex> lock(sharedBackendsMutex);
   for (auto it = sharedBackends.begin(); it != sharedBackends.end(); it++) {
     if (it->second.get() == backend) {
       sharedBackends.erase(it);
@@ -107,36 +119,527 @@ Backend::~Backend() {
   }
 }
 
-void Backend::watch(Watcher &watcher) {
+// Backends that don't keep a directory tree of their own (e.g. watchman and FSEvents)
+// crawl the file system to capture an in-memory snapshot.
+std::shared_ptr<DirTree> Backend::getSnapshotTree(Watcher &watcher) {
+  BruteForceBackend bruteForce;
+  return bruteForce.getSnapshotTree(watcher);
+}
+
+std::vector<std::shared_ptr<DirTree>> Backend::getSnapshotTrees(std::vector<std::shared_ptr<Watcher>> &watchers) {
+  BruteForceBackend bruteForce;
+  return bruteForce.getSnapshotTrees(watchers);
+}
+
+// Backends without a directory tree have no digests, so this is answered from the events since
+// the snapshot instead.
+bool Backend::hasChanged(Watcher &watcher, std::string *snapshotPath) {
+  std::ifstream ifs(*snapshotPath);
+  if (ifs.fail()) {
+    throw std::runtime_error("Unable to open snapshot file: " + *snapshotPath);
+  }
+
+  ifs.close();
+  getEventsSince(watcher, snapshotPath);
+
+  std::string path = watcher.mSubpath.empty() ? watcher.mDir : watcher.mSubpath;
+  std::string pathStart = path + DIR_SEP;
+  std::vector<Event> events = watcher.mEvents.getEvents();
+  for (auto it = events.begin(); it != events.end(); it++) {
+    if (it->path == path || it->path.compare(0, pathStart.size(), pathStart) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Snapshots of backends that don't keep a directory tree are only a clock, so the encoding and
+// journaling options don't apply to them. Such a snapshot can't be updated for only part of the
+// directory either, as the clock covers all of it.
+void Backend::writeSnapshotFile(Watcher &watcher, std::string *snapshotPath, const SnapshotOptions &options) {
+  if (!watcher.mSubpath.empty()) {
+    throw WatcherError("The subpath option is not supported when writing snapshots with this backend", &watcher);
+  }
+
+  writeSnapshot(watcher, snapshotPath);
+}
+
+// Returns the mutex of a root directory. Roots are only kept in the map while their mutex is in
+// use, so it doesn't grow with every directory ever queried.
+std::shared_ptr<std::mutex> Backend::getRootMutex(const std::string &dir) {
   std::unique_lock<std::mutex> lock(mMutex);
-  auto res = mSubscriptions.find(&watcher);
-  if (res == mSubscriptions.end()) {
-    try {
-      this->subscribe(watcher);
-      mSubscriptions.insert(&watcher);
-    } catch (std::exception &err) {
-      unref();
-      throw;
+  auto &entry = mRootMutexes[dir];
+  auto mutex = entry.lock();
+  if (!mutex) {
+    mutex = std::make_shared<std::mutex>();
+    entry = mutex;
+
+    for (auto it = mRootMutexes.begin(); it != mRootMutexes.end();) {
+      if (it->second.expired()) {
+        it = mRootMutexes.erase(it);
+      } else {
+        it++;
+      }
     }
   }
+
+  return mutex;
 }
 
-void Backend::unwatch(Watcher &watcher) {
+// All subscriptions to a root share one core watcher, which the backend is subscribed with, so
+// the kernel watches are only set up once. The core ignores what all of its subscribers ignore,
+// and hands each of them the events it doesn't ignore (see Watcher::notify). A subscription to a
+// directory within a watched root is attached to that root's core too, if it watches all of it.
+// Subscribing is done with only the core's root mutex held, as it may crawl the whole directory.
+// The subscription is counted as pending meanwhile, so the backend isn't released by another
+// root being unwatched. A cache path only applies to the subscription that creates the core.
+void Backend::watch(Watcher &watcher, std::string *cachePath) {
+  std::shared_ptr<Watcher> core;
+  std::shared_ptr<std::mutex> rootMutex;
+  std::unique_lock<std::mutex> rootLock;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      core = findCore(watcher);
+    }
+
+    rootMutex = getRootMutex(core ? core->mDir : watcher.mDir);
+    rootLock = std::unique_lock<std::mutex>(*rootMutex);
+
+    // The cores may have changed while waiting for the root.
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (findCore(watcher) != core) {
+      rootLock.unlock();
+      continue;
+    }
+
+    if (core && core->hasSubscriber(&watcher)) {
+      return;
+    }
+
+    mPendingSubscriptions++;
+    break;
+  }
+
+  bool isNew = !core;
+  try {
+    if (isNew) {
+      core = std::make_shared<Watcher>(watcher.mDir, watcher.mIgnorePaths, watcher.mIgnoreGlobs);
+      core->mCachePath = cachePath ? *cachePath : std::string();
+      this->subscribe(*core);
+
+      std::unique_lock<std::mutex> lock(mMutex);
+      mCores.emplace(watcher.mDir, core);
+      mSubscriptions.insert(core.get());
+    }
+
+    core->addSubscriber(&watcher);
+    if (!isNew) {
+      updateCore(*core);
+    }
+  } catch (std::exception &err) {
+    // The other subscribers of a core that was dropped get the error.
+    if (!isNew) {
+      core->removeSubscriber(&watcher);
+      if (!isCore(core)) {
+        core->notifyError(err);
+      }
+    }
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    mPendingSubscriptions--;
+    unref();
+    throw;
+  }
+
+  // Hand the new subscriber the changes found since the cache was written, if any.
+  core->notify();
+
   std::unique_lock<std::mutex> lock(mMutex);
-  size_t deleted = mSubscriptions.erase(&watcher);
-  if (deleted > 0) {
-    this->unsubscribe(watcher);
+  mPendingSubscriptions--;
+}
+
+static bool isWithin(const std::string &path, const std::string &dir) {
+  return path == dir || path.compare(0, dir.size() + 1, dir + DIR_SEP) == 0;
+}
+
+template<typename T>
+static std::unordered_set<T> intersect(const std::unordered_set<T> &a, const std::unordered_set<T> &b) {
+  std::unordered_set<T> result;
+  for (auto it = a.begin(); it != a.end(); it++) {
+    if (b.find(*it) != b.end()) {
+      result.insert(*it);
+    }
+  }
+
+  return result;
+}
+
+// Returns the core the watcher is subscribed with: the core of its own directory if there is one,
+// or else that of an ancestor directory.
+// This function must be called with mMutex held.
+std::shared_ptr<Watcher> Backend::findCore(Watcher &watcher) {
+  auto found = mCores.find(watcher.mDir);
+  if (found != mCores.end()) {
+    return found->second;
+  }
+
+  return getAncestorCore(watcher, false);
+}
+
+// Returns the core of the closest ancestor of the watcher's directory that watches all of it,
+// i.e. doesn't ignore the directory itself and has no ignore globs, as those are relative to
+// the ancestor. With sameIgnores, the core must also ignore exactly the paths within the
+// directory that the watcher does, so that its tree has the same entries as the watcher's.
+// This function must be called with mMutex held.
+std::shared_ptr<Watcher> Backend::getAncestorCore(Watcher &watcher, bool sameIgnores) {
+  std::shared_ptr<Watcher> result;
+  for (auto it = mCores.begin(); it != mCores.end(); it++) {
+    auto &core = it->second;
+    if (core->mDir == watcher.mDir || !isWithin(watcher.mDir, core->mDir) || !core->mIgnoreGlobs.empty()) {
+      continue;
+    }
+
+    if (result && result->mDir.size() > core->mDir.size()) {
+      continue;
+    }
+
+    bool watchesAll = true;
+    std::unordered_set<std::string> ignorePaths;
+    for (auto path = core->mIgnorePaths.begin(); path != core->mIgnorePaths.end(); path++) {
+      if (isWithin(watcher.mDir, *path)) {
+        watchesAll = false;
+        break;
+      }
+
+      if (isWithin(*path, watcher.mDir)) {
+        ignorePaths.insert(*path);
+      }
+    }
+
+    if (!watchesAll) {
+      continue;
+    }
+
+    if (sameIgnores && (!watcher.mIgnoreGlobs.empty() || ignorePaths != watcher.mIgnorePaths)) {
+      continue;
+    }
+
+    result = core;
+  }
+
+  return result;
+}
+
+// Returns the core that has the watcher as a subscriber, or that is the watcher itself.
+// This function must be called with mMutex held.
+std::shared_ptr<Watcher> Backend::getSubscribedCore(Watcher &watcher) {
+  for (auto it = mCores.begin(); it != mCores.end(); it++) {
+    if (it->second.get() == &watcher || it->second->hasSubscriber(&watcher)) {
+      return it->second;
+    }
+  }
+
+  return nullptr;
+}
+
+// Whether the watcher is still the core of its directory, i.e. it hasn't been dropped.
+bool Backend::isCore(std::shared_ptr<Watcher> core) {
+  std::unique_lock<std::mutex> lock(mMutex);
+  auto found = mCores.find(core->mDir);
+  return found != mCores.end() && found->second == core;
+}
+
+// Recomputes what a core watcher may ignore from its subscribers: what all the subscribers of its
+// own directory ignore, less what the subscribers of directories within it need. Backends update
+// the subscription in place, without missing the events of its existing subscribers meanwhile
+// (see the updateIgnores overrides). One that can't is subscribed again, which recrawls the root,
+// but only when the core ignores something that a subscriber needs; a core that could ignore more
+// is left as is. If the update fails, the core is dropped and the error is thrown for the caller
+// to notify its subscribers.
+// This function must be called with the core's root mutex held.
+void Backend::updateCore(Watcher &core) {
+  std::unordered_set<std::string> ignorePaths = core.mIgnorePaths;
+  std::unordered_set<Glob> ignoreGlobs = core.mIgnoreGlobs;
+  auto subscribers = core.getSubscribers();
+  bool isFirst = true;
+  for (auto it = subscribers.begin(); it != subscribers.end(); it++) {
+    if ((*it)->mDir != core.mDir) {
+      continue;
+    }
+
+    if (isFirst) {
+      ignorePaths = (*it)->mIgnorePaths;
+      ignoreGlobs = (*it)->mIgnoreGlobs;
+      isFirst = false;
+    } else {
+      ignorePaths = intersect(ignorePaths, (*it)->mIgnorePaths);
+      ignoreGlobs = intersect(ignoreGlobs, (*it)->mIgnoreGlobs);
+    }
+  }
+
+  for (auto sub = subscribers.begin(); sub != subscribers.end(); sub++) {
+    if ((*sub)->mDir == core.mDir) {
+      continue;
+    }
+
+    ignoreGlobs.clear();
+    for (auto it = ignorePaths.begin(); it != ignorePaths.end();) {
+      bool isNeeded = isWithin((*sub)->mDir, *it) || (isWithin(*it, (*sub)->mDir) && (*sub)->mIgnorePaths.count(*it) == 0);
+      it = isNeeded ? ignorePaths.erase(it) : std::next(it);
+    }
+  }
+
+  if (ignorePaths == core.mIgnorePaths && ignoreGlobs == core.mIgnoreGlobs) {
+    return;
+  }
+
+  bool isWider = false;
+  for (auto it = core.mIgnorePaths.begin(); it != core.mIgnorePaths.end(); it++) {
+    isWider = isWider || ignorePaths.count(*it) == 0;
+  }
+
+  for (auto it = core.mIgnoreGlobs.begin(); it != core.mIgnoreGlobs.end(); it++) {
+    isWider = isWider || ignoreGlobs.count(*it) == 0;
+  }
+
+  bool isSubscribed = true;
+  try {
+    if (this->updateIgnores(core, ignorePaths, ignoreGlobs) || !isWider) {
+      return;
+    }
+
+    this->unsubscribe(core);
+    isSubscribed = false;
+    core.mIgnorePaths = ignorePaths;
+    core.mIgnoreGlobs = ignoreGlobs;
+    this->subscribe(core);
+  } catch (std::exception &err) {
+    if (isSubscribed) {
+      try {
+        this->unsubscribe(core);
+      } catch (...) {}
+    }
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    mCores.erase(core.mDir);
+    mSubscriptions.erase(&core);
+    throw;
+  }
+}
+
+// Backends update subscriptions in place if they can (see e.g. InotifyBackend::updateIgnores).
+bool Backend::updateIgnores(Watcher &watcher, std::unordered_set<std::string> ignorePaths, std::unordered_set<Glob> ignoreGlobs) {
+  return false;
+}
+
+// Unwatching a subscriber only unsubscribes the backend once the core has none left. Otherwise
+// the core stops watching what only that subscriber needed, if the backend can do so in place.
+// The core itself is unwatched when the backend reports an error for it.
+void Backend::unwatch(Watcher &watcher) {
+  while (true) {
+    std::shared_ptr<Watcher> core;
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      core = getSubscribedCore(watcher);
+      if (!core) {
+        return;
+      }
+    }
+
+    auto rootMutex = getRootMutex(core->mDir);
+    std::unique_lock<std::mutex> rootLock(*rootMutex);
+    bool isLast = true;
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      auto found = mCores.find(core->mDir);
+      if (found == mCores.end() || found->second != core) {
+        continue;
+      }
+
+      if (core.get() != &watcher) {
+        if (!core->removeSubscriber(&watcher)) {
+          return;
+        }
+
+        isLast = !core->hasSubscribers();
+      }
+
+      if (isLast) {
+        mCores.erase(found);
+        mSubscriptions.erase(core.get());
+      }
+    }
+
+    if (!isLast) {
+      try {
+        updateCore(*core);
+      } catch (std::exception &err) {
+        core->notifyError(err);
+        std::unique_lock<std::mutex> lock(mMutex);
+        unref();
+        throw;
+      }
+
+      return;
+    }
+
+    this->unsubscribe(*core);
+
+    std::unique_lock<std::mutex> lock(mMutex);
     unref();
+    return;
+  }
+}
+
+// Reports the paths whose visibility differs between two watchers of the same directory to the
+// second one, as created if only it sees them and deleted if only the first one did. This is how
+// a subscription whose ignore sets are updated learns of the paths it starts or stops seeing.
+// Both watchers must be subscribed, so that their core's tree has every path either of them sees.
+void Backend::getIgnoreChanges(Watcher &from, Watcher &to) {
+  std::unique_ptr<Watcher> snapshot;
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    auto core = getSubscribedCore(to);
+    if (!core) {
+      return;
+    }
+
+    snapshot.reset(new Watcher(core->mDir, core->mIgnorePaths, core->mIgnoreGlobs));
+  }
+
+  // Taken from the live tree when the core is unchanged since, and crawled otherwise.
+  auto tree = getSnapshotTree(*snapshot);
+  std::unordered_set<std::string> hiddenBefore;
+  std::unordered_set<std::string> hiddenAfter;
+  std::string dirStart = to.mDir + DIR_SEP;
+  for (auto it = tree->entries->begin(); it != tree->entries->end(); it++) {
+    const DirEntry &entry = it->second;
+    if (entry.path.compare(0, dirStart.size(), dirStart) != 0) {
+      continue;
+    }
+
+    // A path is seen if it isn't ignored and neither is any directory above it.
+    std::string parent = entry.path.substr(0, entry.path.rfind(DIR_SEP));
+    bool isSeenBefore = hiddenBefore.count(parent) == 0 && !from.isIgnored(entry.path);
+    bool isSeenAfter = hiddenAfter.count(parent) == 0 && !to.isIgnored(entry.path);
+    if (!isSeenBefore) {
+      hiddenBefore.insert(entry.path);
+    }
+
+    if (!isSeenAfter) {
+      hiddenAfter.insert(entry.path);
+    }
+
+    if (isSeenAfter && !isSeenBefore) {
+      to.mEvents.create(entry.path, entry.isDir);
+    } else if (isSeenBefore && !isSeenAfter) {
+      to.mEvents.remove(entry.path, entry.isDir);
+    }
+  }
+}
+
+// Delivers every change made in the watcher's directory before the call to the subscribers of
+// the directory. A cookie file is written into it, and once the backend has reported the cookie,
+// the events of the earlier changes have been handed to the subscribers too, since events are
+// reported in order. The subscribers' callbacks are then called without waiting for the
+// debounce. If the core ignores the cookie, or it isn't reported in time, only the events
+// received so far are delivered.
+void Backend::flush(Watcher &watcher) {
+  static std::atomic<uint64_t> cookieCount(0);
+
+  std::shared_ptr<Watcher> core;
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    core = getSubscribedCore(watcher);
+    if (!core) {
+      core = findCore(watcher);
+    }
+
+    if (!core) {
+      return;
+    }
+  }
+
+  std::string cookie = watcher.mDir + DIR_SEP + COOKIE_PREFIX
+    + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count())
+    + "-" + std::to_string(cookieCount++);
+
+  if (!core->isIgnored(cookie)) {
+    core->addCookie(cookie);
+    std::ofstream ofs(cookie);
+    bool isWritten = ofs.good();
+    ofs.close();
+
+    core->waitForCookie(cookie, std::chrono::milliseconds(isWritten ? FLUSH_TIMEOUT : 0));
+    if (isWritten) {
+      std::remove(cookie.c_str());
+    }
+  }
+
+  // Subscribers are only removed with the root locked, so they are alive while it's held. They
+  // are flushed once it's released though, since that waits for their callbacks to be called on
+  // the threads of their environments, which may need the root meanwhile, e.g. to unsubscribe.
+  std::vector<std::shared_ptr<Watcher>> subscribers;
+  {
+    auto rootMutex = getRootMutex(core->mDir);
+    std::unique_lock<std::mutex> rootLock(*rootMutex);
+    if (!isCore(core)) {
+      return;
+    }
+
+    std::vector<Watcher *> all = core->getSubscribers();
+    for (auto it = all.begin(); it != all.end(); it++) {
+      if (isWithin((*it)->mDir, watcher.mDir)) {
+        subscribers.push_back((*it)->shared_from_this());
+      }
+    }
+  }
+
+  for (auto it = subscribers.begin(); it != subscribers.end(); it++) {
+    (*it)->flush();
+  }
+}
+
+// Unsubscribes the watcher from whichever backends it is subscribed with, e.g. when the
+// environment it belongs to is torn down.
+void Backend::unwatchAll(Watcher &watcher) {
+  std::vector<std::shared_ptr<Backend>> backends;
+  {
+    std::unique_lock<std::mutex> lock(sharedBackendsMutex);
+    for (auto it = sharedBackends.begin(); it != sharedBackends.end(); it++) {
+      backends.push_back(it->second);
+    }
+  }
+
+  for (auto it = backends.begin(); it != backends.end(); it++) {
+    try {
+      (*it)->unwatch(watcher);
+    } catch (std::exception &err) {
+      // The watcher is gone either way.
+    }
   }
 }
 
 void Backend::unref() {
-  if (mSubscriptions.size() == 0) {
+  if (mSubscriptions.size() == 0 && mPendingSubscriptions == 0) {
     removeShared(this);
   }
 }
 
+// Errors are reported for core watchers, which are kept alive until their subscribers have been
+// notified.
 void Backend::handleWatcherError(WatcherError &err) {
+  std::shared_ptr<Watcher> core;
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    auto found = mCores.find(err.mWatcher->mDir);
+    if (found != mCores.end() && found->second.get() == err.mWatcher) {
+      core = found->second;
+    }
+  }
+
   unwatch(*err.mWatcher);
   err.mWatcher->notifyError(err);
 }
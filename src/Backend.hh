@@ -5,6 +5,8 @@
 #include "Watcher.hh"
 #include "Signal.hh"
 #include <thread>
+#include <memory>
+#include <unordered_map>
 
 class Backend {
 public:
@@ -15,22 +17,46 @@ public:
   virtual void start();
   virtual void writeSnapshot(Watcher &watcher, std::string *snapshotPath) = 0;
   virtual void getEventsSince(Watcher &watcher, std::string *snapshotPath) = 0;
+  virtual void updateSnapshot(Watcher &watcher, std::string *snapshotPath) = 0;
+  virtual void writeSnapshotFile(Watcher &watcher, std::string *snapshotPath, const SnapshotOptions &options);
+  virtual bool hasChanged(Watcher &watcher, std::string *snapshotPath);
+  virtual std::shared_ptr<DirTree> getSnapshotTree(Watcher &watcher);
+  virtual std::vector<std::shared_ptr<DirTree>> getSnapshotTrees(std::vector<std::shared_ptr<Watcher>> &watchers);
   virtual void subscribe(Watcher &watcher) = 0;
   virtual void unsubscribe(Watcher &watcher) = 0;
+  virtual bool updateIgnores(Watcher &watcher, std::unordered_set<std::string> ignorePaths, std::unordered_set<Glob> ignoreGlobs);
 
   static std::shared_ptr<Backend> getShared(std::string backend);
+  static void unwatchAll(Watcher &watcher);
 
-  void watch(Watcher &watcher);
+  void watch(Watcher &watcher, std::string *cachePath = nullptr);
   void unwatch(Watcher &watcher);
+  void getIgnoreChanges(Watcher &from, Watcher &to);
+  void flush(Watcher &watcher);
   void unref();
   void handleWatcherError(WatcherError &err);
 
+  // mMutex guards the state shared by all roots, and is only held briefly. Slow operations on a
+  // root, e.g. crawling it to subscribe or snapshot it, hold that root's mutex instead, so they
+  // don't delay events or operations on other roots.
   std::mutex mMutex;
   std::thread mThread;
-private:
+protected:
+  // The core watchers the backend is subscribed with, see Backend::watch.
   std::unordered_set<Watcher *> mSubscriptions;
-  Signal mStartedSignal;
 
+  std::shared_ptr<std::mutex> getRootMutex(const std::string &dir);
+  std::shared_ptr<Watcher> getAncestorCore(Watcher &watcher, bool sameIgnores);
+private:
+  Signal mStartedSignal;
+  std::unordered_map<std::string, std::weak_ptr<std::mutex>> mRootMutexes;
+  size_t mPendingSubscriptions = 0;
+  std::unordered_map<std::string, std::shared_ptr<Watcher>> mCores;
+
+  std::shared_ptr<Watcher> findCore(Watcher &watcher);
+  std::shared_ptr<Watcher> getSubscribedCore(Watcher &watcher);
+  bool isCore(std::shared_ptr<Watcher> core);
+  void updateCore(Watcher &core);
   void handleError(std::exception &err);
 };
 
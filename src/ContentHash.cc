@@ -0,0 +1,160 @@
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include "ContentHash.hh"
+#include "Parallel.hh"
+
+#define PRIME1 11400714785074694791ULL
+#define PRIME2 14029467366897019727ULL
+#define PRIME3 1609587929392839161ULL
+#define PRIME4 9650029242287828579ULL
+#define PRIME5 2870177450012600261ULL
+
+// Each thread hashes at least this many files, so that small batches don't pay for starting threads.
+#define MIN_FILES_PER_THREAD 16
+
+static inline uint64_t rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input) {
+  acc += input * PRIME2;
+  acc = rotl(acc, 31);
+  return acc * PRIME1;
+}
+
+static inline uint64_t mergeRound(uint64_t acc, uint64_t val) {
+  acc ^= xxhRound(0, val);
+  return acc * PRIME1 + PRIME4;
+}
+
+XXH64::XXH64(uint64_t seed) : mSeed(seed), mTotal(0), mBuffered(0) {
+  mAcc[0] = seed + PRIME1 + PRIME2;
+  mAcc[1] = seed + PRIME2;
+  mAcc[2] = seed;
+  mAcc[3] = seed - PRIME1;
+}
+
+void XXH64::update(const char *data, size_t size) {
+  const unsigned char *p = (const unsigned char *)data;
+  const unsigned char *end = p + size;
+  mTotal += size;
+
+  if (mBuffered + size < 32) {
+    memcpy(mBuffer + mBuffered, p, size);
+    mBuffered += size;
+    return;
+  }
+
+  if (mBuffered > 0) {
+    size_t fill = 32 - mBuffered;
+    memcpy(mBuffer + mBuffered, p, fill);
+    for (int i = 0; i < 4; i++) {
+      mAcc[i] = xxhRound(mAcc[i], read64(mBuffer + i * 8));
+    }
+
+    p += fill;
+    mBuffered = 0;
+  }
+
+  while (p + 32 <= end) {
+    for (int i = 0; i < 4; i++) {
+      mAcc[i] = xxhRound(mAcc[i], read64(p + i * 8));
+    }
+
+    p += 32;
+  }
+
+  mBuffered = end - p;
+  memcpy(mBuffer, p, mBuffered);
+}
+
+uint64_t XXH64::digest() const {
+  uint64_t h;
+  if (mTotal >= 32) {
+    h = rotl(mAcc[0], 1) + rotl(mAcc[1], 7) + rotl(mAcc[2], 12) + rotl(mAcc[3], 18);
+    for (int i = 0; i < 4; i++) {
+      h = mergeRound(h, mAcc[i]);
+    }
+  } else {
+    h = mSeed + PRIME5;
+  }
+
+  h += mTotal;
+
+  const unsigned char *p = mBuffer;
+  const unsigned char *end = mBuffer + mBuffered;
+  while (p + 8 <= end) {
+    h ^= xxhRound(0, read64(p));
+    h = rotl(h, 27) * PRIME1 + PRIME4;
+    p += 8;
+  }
+
+  if (p + 4 <= end) {
+    h ^= (uint64_t)read32(p) * PRIME1;
+    h = rotl(h, 23) * PRIME2 + PRIME3;
+    p += 4;
+  }
+
+  while (p < end) {
+    h ^= (*p) * PRIME5;
+    h = rotl(h, 11) * PRIME1;
+    p++;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME2;
+  h ^= h >> 29;
+  h *= PRIME3;
+  h ^= h >> 32;
+  return h;
+}
+
+// Reads a file to compute its size and content hash. Returns false if it could not be read.
+bool hashFile(const std::string &path, uint64_t &size, uint64_t &hash) {
+  std::ifstream ifs(path, std::ios::binary);
+  if (ifs.fail()) {
+    return false;
+  }
+
+  XXH64 state;
+  char buffer[65536];
+  size = 0;
+  while (ifs.read(buffer, sizeof(buffer)) || ifs.gcount() > 0) {
+    state.update(buffer, ifs.gcount());
+    size += ifs.gcount();
+  }
+
+  if (ifs.bad()) {
+    return false;
+  }
+
+  // 0 is reserved for files that haven't been hashed.
+  hash = state.digest();
+  if (hash == 0) {
+    hash = 1;
+  }
+
+  return true;
+}
+
+// Hashes the given files, spreading them over as many threads as there are cores.
+void hashFiles(std::vector<ContentHash> &files) {
+  parallelFor(files.size(), MIN_FILES_PER_THREAD, [&files] (size_t i) {
+    if (!hashFile(files[i].path, files[i].size, files[i].hash)) {
+      files[i].hash = 0;
+    }
+  });
+}
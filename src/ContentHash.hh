@@ -0,0 +1,36 @@
+#ifndef CONTENT_HASH_H
+#define CONTENT_HASH_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Streaming XXH64 (https://github.com/Cyan4973/xxHash), used to fingerprint file contents.
+class XXH64 {
+public:
+  XXH64(uint64_t seed = 0);
+  void update(const char *data, size_t size);
+  uint64_t digest() const;
+
+private:
+  uint64_t mAcc[4];
+  uint64_t mSeed;
+  uint64_t mTotal;
+  unsigned char mBuffer[32];
+  size_t mBuffered;
+};
+
+// A file to fingerprint, along with the resulting size and hash. A hash of 0 means the file
+// could not be read.
+struct ContentHash {
+  std::string path;
+  uint64_t size;
+  uint64_t hash;
+
+  ContentHash(std::string path) : path(path), size(0), hash(0) {}
+};
+
+bool hashFile(const std::string &path, uint64_t &size, uint64_t &hash);
+void hashFiles(std::vector<ContentHash> &files);
+
+#endif
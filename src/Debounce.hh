@@ -11,6 +11,9 @@
 class Debounce {
 public:
   static std::shared_ptr<Debounce> getShared() {
+    // Watchers are made on the threads of all environments.
+    static std::mutex sharedMutex;
+    std::lock_guard<std::mutex> lock(sharedMutex);
     static std::weak_ptr<Debounce> sharedInstance;
     std::shared_ptr<Debounce> shared = sharedInstance.lock();
     if (!shared) {
@@ -1,72 +1,527 @@
+#include <sstream>
+#include <algorithm>
+#include <list>
 #include "DirTree.hh"
+#include "ContentHash.hh"
+#include "Abort.hh"
+
+#define SNAPSHOT_VERSION 2
+#define COMPACT_SNAPSHOT_VERSION 3
+#define SNAPSHOT_HASHED 1
+#define SNAPSHOT_DIGESTS 2
+#define CONTAINER_VERSION 1
+// The number of entries a chunk of a DirEntryMap is split at.
+#define MAX_CHUNK_SIZE 1024
+
+// Trees are shared by everything that uses the same root, and are kept for a while once nothing
+// uses them anymore, so that subscribing to a directory again soon after doesn't need a full
+// crawl. Retained trees are evicted least recently used first, once their estimated size is over
+// the cache size. The cache owns the trees, and hands out pointers that tell it when their last
+// user is done with them.
+struct CachedTree {
+  std::shared_ptr<DirTree> tree;
+  // The number of pointers handed out that are still in use.
+  size_t users = 0;
+  bool isRetained = false;
+  size_t size = 0;
+  std::list<std::string>::iterator retainedIt;
+};
 
 static std::mutex mDirCacheMutex;
-static std::unordered_map<std::string, std::weak_ptr<DirTree>> dirTreeCache;
+static std::unordered_map<std::string, CachedTree> dirTreeCache;
+// The roots of the retained trees, most recently used first.
+static std::list<std::string> retainedTrees;
+static size_t retainedSize = 0;
+static size_t cacheSize = DEFAULT_TREE_CACHE_SIZE;
+
+// Evicts retained trees until they fit in the cache size. The trees are returned rather than
+// destroyed, so that the cache isn't locked while they are. Must be called with mDirCacheMutex held.
+static void evictTrees(std::vector<std::shared_ptr<DirTree>> &evicted) {
+  while (retainedSize > cacheSize && !retainedTrees.empty()) {
+    auto found = dirTreeCache.find(retainedTrees.back());
+    retainedSize -= found->second.size;
+    evicted.push_back(found->second.tree);
+    dirTreeCache.erase(found);
+    retainedTrees.pop_back();
+  }
+}
 
-struct DirTreeDeleter {
-  void operator()(DirTree *tree) {
+// Called once a pointer handed out by getCached is no longer used. Once a tree has no users left,
+// it is retained if it is complete and fits in the cache, and destroyed otherwise.
+static void releaseTree(const std::string &root) {
+  std::shared_ptr<DirTree> tree;
+  {
     std::lock_guard<std::mutex> lock(mDirCacheMutex);
-    dirTreeCache.erase(tree->root);
-    delete tree;
+    CachedTree &cached = dirTreeCache.find(root)->second;
+    if (--cached.users > 0) {
+      return;
+    }
+
+    tree = cached.tree;
   }
-};
+
+  // Measured without locking the cache, as it takes a pass over the entries.
+  size_t size = tree->isComplete ? tree->memoryUsage() : 0;
+
+  std::vector<std::shared_ptr<DirTree>> evicted;
+  std::lock_guard<std::mutex> lock(mDirCacheMutex);
+
+  // The tree may have been used again in the meantime.
+  auto found = dirTreeCache.find(root);
+  if (found == dirTreeCache.end() || found->second.tree != tree || found->second.users > 0 || found->second.isRetained) {
+    return;
+  }
+
+  if (size == 0 || size > cacheSize) {
+    evicted.push_back(found->second.tree);
+    dirTreeCache.erase(found);
+    return;
+  }
+
+  CachedTree &cached = found->second;
+  cached.isRetained = true;
+  cached.size = size;
+  retainedTrees.push_front(root);
+  cached.retainedIt = retainedTrees.begin();
+  retainedSize += size;
+  evictTrees(evicted);
+}
+
+// Must be called with mDirCacheMutex held.
+static std::shared_ptr<DirTree> createHandle(CachedTree &cached) {
+  std::string root = cached.tree->root;
+  cached.users++;
+  return std::shared_ptr<DirTree>(cached.tree.get(), [root] (DirTree *tree) {
+    releaseTree(root);
+  });
+}
 
 std::shared_ptr<DirTree> DirTree::getCached(std::string root) {
   std::lock_guard<std::mutex> lock(mDirCacheMutex);
 
   auto found = dirTreeCache.find(root);
-  std::shared_ptr<DirTree> tree;
+  if (found == dirTreeCache.end()) {
+    CachedTree cached;
+    cached.tree = std::make_shared<DirTree>(root);
+    found = dirTreeCache.emplace(root, cached).first;
+  }
+
+  // Use a retained tree again. It may be out of date by now.
+  CachedTree &cached = found->second;
+  if (cached.isRetained) {
+    retainedTrees.erase(cached.retainedIt);
+    retainedSize -= cached.size;
+    cached.isRetained = false;
+    cached.tree->isStale = true;
+  }
+
+  return createHandle(cached);
+}
+
+void DirTree::setCacheSize(size_t size) {
+  std::vector<std::shared_ptr<DirTree>> evicted;
+  std::lock_guard<std::mutex> lock(mDirCacheMutex);
+  cacheSize = size;
+  evictTrees(evicted);
+}
+
+DirTree::DirTree(std::string root, std::istream &stream) : DirTree(root) {
+  SnapshotReader reader(stream);
+  while (reader.next()) {
+    AbortFlag::check();
+    entries->emplace(reader.entry().path, reader.entry());
+  }
+
+  isComplete = true;
+}
+
+DirTree::DirTree(std::string root, SnapshotReader &reader) : DirTree(root) {
+  while (reader.next()) {
+    AbortFlag::check();
+    entries->emplace(reader.entry().path, reader.entry());
+  }
+
+  isComplete = true;
+  mHasDigests = reader.hasDigests;
+  mDigest = reader.digest;
+}
+
+// The index of the chunk a path is in, or would be added to, i.e. the last one starting before
+// it, or the first one. Must only be called when there are chunks.
+size_t DirEntryMap::chunkIndex(const std::string &path) const {
+  auto it = std::upper_bound(mChunks.begin(), mChunks.end(), path, [] (const std::string &path, const std::shared_ptr<Chunk> &chunk) {
+    return path < chunk->begin()->first;
+  });
+
+  return it == mChunks.begin() ? 0 : it - mChunks.begin() - 1;
+}
+
+DirEntryMap::const_iterator DirEntryMap::find(const std::string &path) const {
+  if (mChunks.empty()) {
+    return end();
+  }
+
+  size_t index = chunkIndex(path);
+  auto found = mChunks[index]->find(path);
+  if (found == mChunks[index]->end()) {
+    return end();
+  }
+
+  return const_iterator(&mChunks, index, found);
+}
+
+DirEntryMap::const_iterator DirEntryMap::lower_bound(const std::string &path) const {
+  if (mChunks.empty()) {
+    return end();
+  }
+
+  // Past the end of its chunk, the next entry is the first of the next chunk.
+  size_t index = chunkIndex(path);
+  auto found = mChunks[index]->lower_bound(path);
+  if (found == mChunks[index]->end()) {
+    return ++index < mChunks.size() ? const_iterator(&mChunks, index, mChunks[index]->begin()) : end();
+  }
+
+  return const_iterator(&mChunks, index, found);
+}
 
-  // Use cached tree, or create an empty one.
-  if (found != dirTreeCache.end()) {
-    tree = found->second.lock();
+// Takes ownership of a chunk before it is modified, copying it if it is still shared with a copy
+// of the map.
+DirEntryMap::Chunk &DirEntryMap::own(size_t index) {
+  if (mChunks[index].use_count() > 1) {
+    mChunks[index] = std::make_shared<Chunk>(*mChunks[index]);
+  }
+
+  return *mChunks[index];
+}
+
+// Adds an entry unless there is one with the path already. Returns the entry with the path, and
+// whether it was added.
+std::pair<DirEntry *, bool> DirEntryMap::emplace(const std::string &path, const DirEntry &entry) {
+  size_t index = 0;
+  if (mChunks.empty()) {
+    mChunks.push_back(std::make_shared<Chunk>());
   } else {
-    tree = std::shared_ptr<DirTree>(new DirTree(root), DirTreeDeleter());
-    dirTreeCache.emplace(root, tree);
+    index = chunkIndex(path);
+  }
+
+  Chunk &chunk = own(index);
+  auto res = chunk.emplace(path, entry);
+  if (!res.second) {
+    return std::make_pair(&res.first->second, false);
+  }
+
+  mSize++;
+  if (chunk.size() <= MAX_CHUNK_SIZE) {
+    return std::make_pair(&res.first->second, true);
+  }
+
+  // Full chunks are split in half. Entries added in path order, e.g. when reading a snapshot,
+  // start a new chunk instead, so that the chunks before it stay full.
+  bool isAppended = index + 1 == mChunks.size() && std::next(res.first) == chunk.end();
+  auto split = isAppended ? res.first : std::next(chunk.begin(), chunk.size() / 2);
+  auto rest = std::make_shared<Chunk>(split, chunk.end());
+  chunk.erase(split, chunk.end());
+  mChunks.insert(mChunks.begin() + index + 1, rest);
+
+  Chunk &added = path < rest->begin()->first ? chunk : *rest;
+  return std::make_pair(&added.find(path)->second, true);
+}
+
+// Returns the entry with the path so that it can be modified, or NULL if there is none.
+DirEntry *DirEntryMap::modify(const std::string &path) {
+  if (mChunks.empty()) {
+    return NULL;
   }
 
-  return tree;
+  size_t index = chunkIndex(path);
+  if (mChunks[index]->count(path) == 0) {
+    return NULL;
+  }
+
+  return &own(index).find(path)->second;
 }
 
-DirTree::DirTree(std::string root, std::istream &stream) : root(root), isComplete(true) {
-  size_t size;
-  if (stream >> size) {
-    for (size_t i = 0; i < size; i++) {
-      DirEntry entry(stream);
-      entries.emplace(entry.path, entry);
+// Calls fn with every entry so that it can be modified. This takes ownership of every chunk.
+void DirEntryMap::modifyAll(const std::function<void(DirEntry &)> &fn) {
+  for (size_t i = 0; i < mChunks.size(); i++) {
+    Chunk &chunk = own(i);
+    for (auto it = chunk.begin(); it != chunk.end(); it++) {
+      fn(it->second);
     }
   }
 }
 
-// Internal find method that has no lock
-DirEntry *DirTree::_find(std::string path) {
-  auto found = entries.find(path);
-  if (found == entries.end()) {
-    return NULL;
+void DirEntryMap::erase(const std::string &path) {
+  if (mChunks.empty()) {
+    return;
+  }
+
+  size_t index = chunkIndex(path);
+  if (mChunks[index]->count(path) == 0) {
+    return;
+  }
+
+  Chunk &chunk = own(index);
+  chunk.erase(path);
+  mSize--;
+  if (chunk.empty()) {
+    mChunks.erase(mChunks.begin() + index);
+  }
+}
+
+// Removes every entry whose path starts with the prefix, e.g. all entries below a directory.
+// They follow each other in path order, so chunks in the middle of the range only hold such
+// entries, and are dropped without being copied.
+void DirEntryMap::erasePrefix(const std::string &prefix) {
+  if (mChunks.empty()) {
+    return;
+  }
+
+  auto hasPrefix = [&prefix] (const std::string &path) {
+    return path.compare(0, prefix.size(), prefix) == 0;
+  };
+
+  size_t index = chunkIndex(prefix);
+  while (index < mChunks.size()) {
+    const Chunk &shared = *mChunks[index];
+    auto first = shared.lower_bound(prefix);
+    if (first == shared.end()) {
+      index++;
+      continue;
+    }
+
+    if (!hasPrefix(first->first)) {
+      break;
+    }
+
+    if (first == shared.begin() && hasPrefix(shared.rbegin()->first)) {
+      mSize -= shared.size();
+      mChunks.erase(mChunks.begin() + index);
+      continue;
+    }
+
+    // Chunks that also hold other entries keep them, and end the range unless they come first.
+    Chunk &chunk = own(index);
+    auto it = chunk.lower_bound(prefix);
+    while (it != chunk.end() && hasPrefix(it->first)) {
+      it = chunk.erase(it);
+      mSize--;
+    }
+
+    if (it != chunk.end()) {
+      break;
+    }
+
+    index++;
+  }
+}
+
+// Returns a read-only copy of the tree in its current state. The entries are shared with this
+// tree rather than copied, and are only duplicated once either tree is modified afterwards.
+std::shared_ptr<DirTree> DirTree::freeze() {
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  auto frozen = std::make_shared<DirTree>(root);
+  frozen->isComplete = isComplete;
+  frozen->entries = entries;
+  frozen->mHasDigests = mHasDigests;
+  frozen->mDigest = mDigest;
+  return frozen;
+}
+
+// Replaces the entries with those of another tree. Like a frozen copy, the entries are shared
+// until either tree is modified.
+void DirTree::replace(DirTree &tree) {
+  std::lock(mMutex, tree.mMutex);
+  std::lock_guard<std::mutex> lock(mMutex, std::adopt_lock);
+  std::lock_guard<std::mutex> treeLock(tree.mMutex, std::adopt_lock);
+  isComplete = tree.isComplete;
+  entries = tree.entries;
+  mHasDigests = tree.mHasDigests;
+  mDigest = tree.mDigest;
+}
+
+// Removes all entries, so that the tree is read again from scratch.
+void DirTree::clear() {
+  std::lock_guard<std::mutex> lock(mMutex);
+  entries = std::make_shared<DirEntryMap>();
+  isComplete = false;
+  mHasDigests = false;
+  mDigest = 0;
+}
+
+// An estimate of the memory used by the tree, for the cache size.
+size_t DirTree::memoryUsage() {
+  std::lock_guard<std::mutex> lock(mMutex);
+  size_t size = sizeof(DirTree);
+  for (auto it = entries->begin(); it != entries->end(); it++) {
+    // Map nodes also hold the links to their parent and children, and a color.
+    size += sizeof(DirEntryMap::value_type) + 4 * sizeof(void *) + it->first.capacity() + it->second.path.capacity();
+  }
+
+  return size;
+}
+
+// Internal method that takes ownership of the entries before they are modified, copying them if
+// they are still shared with a frozen tree. This only copies the list of chunks, and the chunks
+// are copied as they are modified. Must be called with mMutex held.
+void DirTree::detach() {
+  if (entries.use_count() > 1) {
+    entries = std::make_shared<DirEntryMap>(*entries);
   }
+}
 
-  return &found->second;
+// The digest of a single entry, covering its path, kind, and the mtime of files. Directory
+// mtimes are left out, as they change with their children, which are covered already.
+static uint64_t entryDigest(const DirEntry &entry) {
+  XXH64 state;
+  uint64_t fields[2] = {entry.isDir ? 0 : entry.mtime, entry.isDir};
+  state.update(entry.path.data(), entry.path.size());
+  state.update((const char *)fields, sizeof(fields));
+  return state.digest();
 }
 
-DirEntry *DirTree::add(std::string path, uint64_t mtime, bool isDir) {
+// Computes the digest of each directory, i.e. the sum of the digests of all entries below it,
+// and of the whole tree, if they are not known yet. Entries are visited in reverse path order,
+// so a directory is complete once it is reached, and can be added to its closest ancestor.
+// Afterwards, digests are kept up to date by add, update and remove, so two trees can be
+// compared by their digests, and identical directories skipped.
+void DirTree::ensureDigests() {
   std::lock_guard<std::mutex> lock(mMutex);
+  if (mHasDigests) {
+    return;
+  }
+
+  // Every entry is owned from here on, so entries can be modified while iterating.
+  detach();
+  entries->modifyAll([] (DirEntry &entry) {
+    entry.digest = 0;
+  });
+
+  mDigest = 0;
+  DirEntry *rootEntry = _find(root);
+  for (auto it = entries->rbegin(); it != entries->rend(); it++) {
+    const DirEntry &entry = it->second;
+    if (entry.path == root) {
+      continue;
+    }
+
+    uint64_t digest = entryDigest(entry) + (entry.isDir ? entry.digest : 0);
+    std::string dir = entry.path;
+    while (true) {
+      size_t pos = dir.rfind(DIR_SEP[0]);
+      if (pos == std::string::npos || pos <= root.size()) {
+        if (rootEntry) {
+          rootEntry->digest += digest;
+        }
+
+        mDigest += digest;
+        break;
+      }
+
+      dir.resize(pos);
+      DirEntry *parent = _find(dir);
+      if (parent && parent->isDir) {
+        parent->digest += digest;
+        break;
+      }
+    }
+  }
+
+  mHasDigests = true;
+}
+
+// Internal method that adds to the digests of the directories containing a path, and of the
+// whole tree. Must be called with mMutex held.
+void DirTree::addDigest(const std::string &path, uint64_t delta) {
+  std::string dir = path;
+  while (dir.size() > root.size()) {
+    size_t pos = dir.rfind(DIR_SEP[0]);
+    if (pos == std::string::npos) {
+      break;
+    }
+
+    dir = pos < root.size() ? root : dir.substr(0, pos);
+    DirEntry *entry = _find(dir);
+    if (entry && entry->isDir) {
+      entry->digest += delta;
+    }
+  }
+
+  if (path != root) {
+    mDigest += delta;
+  }
+}
+
+// Internal method that returns the digest of a path and everything below it, or 0 if it
+// doesn't exist. Must be called with mMutex held.
+uint64_t DirTree::subtreeDigest(const std::string &path) {
+  if (path == root) {
+    return mDigest;
+  }
 
-  DirEntry entry(path, mtime, isDir);
-  auto it = entries.emplace(entry.path, entry);
-  return &it.first->second;
+  auto found = entries->find(path);
+  if (found == entries->end()) {
+    return 0;
+  }
+
+  const DirEntry &entry = found->second;
+  return entryDigest(entry) + (entry.isDir ? entry.digest : 0);
+}
+
+// Internal find method that has no lock. The entry may be modified, so the tree must own the
+// entries (see detach).
+DirEntry *DirTree::_find(std::string path) {
+  return entries->modify(path);
+}
+
+DirEntry *DirTree::add(std::string path, uint64_t mtime, bool isDir, uint64_t size) {
+  std::lock_guard<std::mutex> lock(mMutex);
+  detach();
+
+  DirEntry entry(path, mtime, isDir, size);
+  auto it = entries->emplace(entry.path, entry);
+  if (it.second && mHasDigests) {
+    DirEntry &added = *it.first;
+    // Entries below a directory are normally added after it, but may already be there.
+    if (added.isDir) {
+      std::string pathStart = path + DIR_SEP;
+      auto child = entries->lower_bound(pathStart);
+      while (child != entries->end() && child->first.compare(0, pathStart.size(), pathStart) == 0) {
+        added.digest += entryDigest(child->second);
+        child++;
+      }
+    }
+
+    // The ancestors already include any entries below it.
+    if (path != root) {
+      addDigest(path, entryDigest(added));
+    }
+  }
+
+  return it.first;
 }
 
 DirEntry *DirTree::find(std::string path) {
   std::lock_guard<std::mutex> lock(mMutex);
+  detach();
   return _find(path);
 }
 
-DirEntry *DirTree::update(std::string path, uint64_t mtime) {
+DirEntry *DirTree::update(std::string path, uint64_t mtime, uint64_t size) {
   std::lock_guard<std::mutex> lock(mMutex);
+  detach();
 
   DirEntry *found = _find(path);
   if (found) {
+    uint64_t previous = entryDigest(*found);
     found->mtime = mtime;
+    found->size = size;
+    found->hash = 0;
+    if (mHasDigests && path != root) {
+      addDigest(path, entryDigest(*found) - previous);
+    }
   }
 
   return found;
@@ -74,73 +529,968 @@ DirEntry *DirTree::update(std::string path, uint64_t mtime) {
 
 void DirTree::remove(std::string path) {
   std::lock_guard<std::mutex> lock(mMutex);
+  detach();
 
-  DirEntry *found = _find(path);
+  auto found = entries->find(path);
+  if (found == entries->end()) {
+    return;
+  }
 
-  // Remove all sub-entries if this is a directory
-  if (found && found->isDir) {
-    std::string pathStart = path + DIR_SEP;
-    for (auto it = entries.begin(); it != entries.end();) {
-      if (it->first.rfind(pathStart, 0) == 0) {
-        it = entries.erase(it);
-      } else {
-        it++;
+  bool isDir = found->second.isDir;
+  if (mHasDigests) {
+    uint64_t removed = isDir ? found->second.digest : 0;
+    if (path == root) {
+      mDigest -= removed;
+    } else {
+      addDigest(path, 0 - removed - entryDigest(found->second));
+    }
+  }
+
+  // Remove all sub-entries if this is a directory. They directly follow it in path order.
+  if (isDir) {
+    entries->erasePrefix(path + DIR_SEP);
+  }
+
+  entries->erase(path);
+}
+
+// Computes the content hash of the files that don't have one yet. Files whose mtime and size are
+// the same as in the previous snapshot reuse its hash, so only files that changed are read.
+// The files are read in parallel, without holding the lock.
+void DirTree::computeHashes(SnapshotReader *previous) {
+  std::vector<ContentHash> files;
+  std::vector<uint64_t> mtimes;
+
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    detach();
+
+    // Reused hashes are set once the entries have been visited, as modifying them invalidates
+    // the iterator.
+    std::vector<std::pair<std::string, uint64_t>> reused;
+    bool hasPrevious = previous && previous->isHashed && previous->isSorted && previous->next();
+    for (auto it = entries->begin(); it != entries->end(); it++) {
+      const DirEntry &entry = it->second;
+      if (entry.isDir || entry.hash != 0) {
+        continue;
+      }
+
+      while (hasPrevious && previous->entry().path < entry.path) {
+        hasPrevious = previous->next();
       }
+
+      if (hasPrevious) {
+        const DirEntry &prev = previous->entry();
+        if (prev.path == entry.path && prev.hash != 0 && prev.mtime == entry.mtime && prev.size == entry.size) {
+          reused.emplace_back(entry.path, prev.hash);
+          continue;
+        }
+      }
+
+      files.emplace_back(entry.path);
+      mtimes.push_back(entry.mtime);
+    }
+
+    for (auto it = reused.begin(); it != reused.end(); it++) {
+      _find(it->first)->hash = it->second;
+    }
+  }
+
+  if (files.empty()) {
+    return;
+  }
+
+  hashFiles(files);
+
+  // Skip files that were modified or removed while they were being hashed.
+  std::lock_guard<std::mutex> lock(mMutex);
+  detach();
+  for (size_t i = 0; i < files.size(); i++) {
+    DirEntry *entry = _find(files[i].path);
+    if (entry && entry->mtime == mtimes[i] && files[i].hash != 0) {
+      entry->size = files[i].size;
+      entry->hash = files[i].hash;
+    }
+  }
+}
+
+static void writeVarint(std::ostream &stream, uint64_t value) {
+  while (value >= 0x80) {
+    stream.put((char)(value | 0x80));
+    value >>= 7;
+  }
+
+  stream.put((char)value);
+}
+
+static bool readVarint(std::istream &stream, uint64_t &value) {
+  value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int byte = stream.get();
+    if (byte == EOF) {
+      return false;
+    }
+
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
     }
   }
 
-  entries.erase(path);
+  return false;
+}
+
+static void writeHash(std::ostream &stream, uint64_t hash) {
+  for (int i = 0; i < 8; i++) {
+    stream.put((char)(hash >> (i * 8)));
+  }
 }
 
-void DirTree::write(std::ostream &stream) {
+static bool readHash(std::istream &stream, uint64_t &hash) {
+  hash = 0;
+  for (int i = 0; i < 8; i++) {
+    int byte = stream.get();
+    if (byte == EOF) {
+      return false;
+    }
+
+    hash |= (uint64_t)byte << (i * 8);
+  }
+
+  return true;
+}
+
+// Compact entries are the length of the prefix shared with the previous path (with the isDir flag
+// in the lowest bit), the rest of the path, and the difference from the previous mtime, zigzag
+// encoded so that small negative differences stay small. The first entry is compared with the
+// root, so paths are effectively stored relative to it. Hashed snapshots add the size and the
+// 8 byte content hash, and snapshots with digests add the 8 byte digest of directories.
+static void writeCompactEntry(std::ostream &stream, const DirEntry &entry, int flags, std::string &prevPath, uint64_t &prevMtime) {
+  size_t shared = 0;
+  size_t max = std::min(prevPath.size(), entry.path.size());
+  while (shared < max && prevPath[shared] == entry.path[shared]) {
+    shared++;
+  }
+
+  int64_t delta = (int64_t)(entry.mtime - prevMtime);
+  writeVarint(stream, (uint64_t)shared << 1 | entry.isDir);
+  writeVarint(stream, entry.path.size() - shared);
+  stream.write(entry.path.data() + shared, entry.path.size() - shared);
+  writeVarint(stream, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+  if (flags & SNAPSHOT_HASHED) {
+    writeVarint(stream, entry.size);
+    writeHash(stream, entry.hash);
+  }
+
+  if ((flags & SNAPSHOT_DIGESTS) && entry.isDir) {
+    writeHash(stream, entry.digest);
+  }
+
+  prevPath = entry.path;
+  prevMtime = entry.mtime;
+}
+
+static bool readCompactEntry(std::istream &stream, DirEntry &entry, int flags, std::string &prevPath, uint64_t &prevMtime) {
+  uint64_t shared, size, delta;
+  if (!readVarint(stream, shared) || !readVarint(stream, size) || (shared >> 1) > prevPath.size()) {
+    return false;
+  }
+
+  entry.path.assign(prevPath, 0, shared >> 1);
+  entry.path.resize((shared >> 1) + size);
+  if (!stream.read(&entry.path[shared >> 1], size) || !readVarint(stream, delta)) {
+    return false;
+  }
+
+  entry.mtime = prevMtime + (uint64_t)((int64_t)(delta >> 1) ^ -(int64_t)(delta & 1));
+  entry.isDir = shared & 1;
+  entry.state = NULL;
+  entry.size = 0;
+  entry.hash = 0;
+  entry.digest = 0;
+  if ((flags & SNAPSHOT_HASHED) && (!readVarint(stream, entry.size) || !readHash(stream, entry.hash))) {
+    return false;
+  }
+
+  if ((flags & SNAPSHOT_DIGESTS) && entry.isDir && !readHash(stream, entry.digest)) {
+    return false;
+  }
+
+  prevPath = entry.path;
+  prevMtime = entry.mtime;
+  return true;
+}
+
+// Snapshots start with a header containing the format version and the root directory,
+// followed by the number of entries and the entries themselves in path order. Snapshots that
+// are the base of a journal also have an id in their header, which the journal refers to,
+// followed by flags for optional fields (0 if there are none), and the digest of the whole
+// tree if directory digests are included.
+void DirTree::write(std::ostream &stream, uint64_t id, const SnapshotOptions &options) {
   std::lock_guard<std::mutex> lock(mMutex);
 
-  stream << entries.size() << "\n";
-  for (auto it = entries.begin(); it != entries.end(); it++) {
-    it->second.write(stream);
+  int flags = (options.hash ? SNAPSHOT_HASHED : 0) | (mHasDigests ? SNAPSHOT_DIGESTS : 0);
+  stream << "#snapshot " << (options.compact ? COMPACT_SNAPSHOT_VERSION : SNAPSHOT_VERSION);
+  if (id != 0 || flags != 0) {
+    stream << " " << id;
+  }
+
+  if (flags != 0) {
+    stream << " " << flags;
+  }
+
+  if (mHasDigests) {
+    stream << " " << mDigest;
+  }
+
+  stream << "\n";
+  stream << root.size() << root << "\n";
+  stream << entries->size() << "\n";
+
+  if (options.compact) {
+    std::string prevPath = root;
+    uint64_t prevMtime = 0;
+    for (auto it = entries->begin(); it != entries->end(); it++) {
+      writeCompactEntry(stream, it->second, flags, prevPath, prevMtime);
+    }
+
+    return;
+  }
+
+  for (auto it = entries->begin(); it != entries->end(); it++) {
+    it->second.write(stream, flags);
+  }
+}
+
+// A position in a sequence of entries sorted by path, from either a tree or a snapshot stream.
+class EntryCursor {
+public:
+  virtual ~EntryCursor() {}
+  virtual bool valid() = 0;
+  virtual const DirEntry &entry() = 0;
+  virtual void next() = 0;
+  // Whether directory entries have digests, so that identical directories can be skipped.
+  virtual bool hasDigests() = 0;
+  // Moves past the current entry and the ones following it that start with the given prefix.
+  virtual void skip(const std::string &prefix) = 0;
+  // Moves to the first entry not before the given path.
+  virtual void seek(const std::string &path) = 0;
+};
+
+class TreeCursor : public EntryCursor {
+public:
+  TreeCursor(DirEntryMap &entries, bool digests = false)
+    : mEntries(entries),
+      mIt(entries.begin()),
+      mEnd(entries.end()),
+      mDigests(digests) {}
+  bool valid() override { return mIt != mEnd; }
+  const DirEntry &entry() override { return mIt->second; }
+  void next() override { mIt++; }
+  bool hasDigests() override { return mDigests; }
+  void skip(const std::string &prefix) override {
+    std::string end = prefix;
+    end.back()++;
+    mIt = mEntries.lower_bound(end);
+  }
+
+  void seek(const std::string &path) override {
+    if (mIt != mEnd && mIt->first < path) {
+      mIt = mEntries.lower_bound(path);
+    }
+  }
+
+private:
+  DirEntryMap &mEntries;
+  DirEntryMap::const_iterator mIt;
+  DirEntryMap::const_iterator mEnd;
+  bool mDigests;
+};
+
+// Entries that are skipped still have to be read from the stream, but are not compared.
+class ReaderCursor : public EntryCursor {
+public:
+  ReaderCursor(SnapshotReader &reader) : mReader(reader), mValid(reader.next()) {}
+  bool valid() override { return mValid; }
+  const DirEntry &entry() override { return mReader.entry(); }
+  void next() override { mValid = mReader.next(); }
+  bool hasDigests() override { return mReader.hasDigests; }
+  void skip(const std::string &prefix) override {
+    do {
+      mValid = mReader.next();
+    } while (mValid && mReader.entry().path.compare(0, prefix.size(), prefix) == 0);
+  }
+
+  void seek(const std::string &path) override {
+    while (mValid && mReader.entry().path < path) {
+      mValid = mReader.next();
+    }
+  }
+
+private:
+  SnapshotReader &mReader;
+  bool mValid;
+};
+
+// Restricts a cursor to a path and the entries below it. Streams stop being read once the
+// range of the path has been passed.
+class SubtreeCursor : public EntryCursor {
+public:
+  SubtreeCursor(EntryCursor &cursor, const std::string &path)
+    : mCursor(cursor),
+      mPath(path),
+      mPrefix(path + DIR_SEP) {
+    mCursor.seek(path);
+    advance();
+  }
+
+  bool valid() override { return mValid; }
+  const DirEntry &entry() override { return mCursor.entry(); }
+  void next() override { mCursor.next(); advance(); }
+  bool hasDigests() override { return mCursor.hasDigests(); }
+  void skip(const std::string &prefix) override { mCursor.skip(prefix); advance(); }
+  void seek(const std::string &path) override { mCursor.seek(path); advance(); }
+
+private:
+  EntryCursor &mCursor;
+  std::string mPath;
+  std::string mPrefix;
+  bool mValid;
+
+  // Entries can sort between a directory and its children (e.g. "a-b" between "a" and "a/b"),
+  // so those are skipped too.
+  void advance() {
+    mValid = false;
+    while (mCursor.valid()) {
+      const std::string &path = mCursor.entry().path;
+      if (path == mPath || path.compare(0, mPrefix.size(), mPrefix) == 0) {
+        mValid = true;
+        return;
+      }
+
+      if (path > mPrefix) {
+        return;
+      }
+
+      mCursor.seek(mPrefix);
+    }
+  }
+};
+
+// A set of directories, checked against paths visited in path order. Since a directory's
+// descendants form a contiguous range, only the directories whose range has not ended are kept.
+class DirRanges {
+public:
+  void add(const std::string &dir) {
+    mDirs.push_back(dir + DIR_SEP);
+  }
+
+  // Returns the prefix of the directory containing the path, or NULL if there is none.
+  const std::string *find(const std::string &path) {
+    while (!mDirs.empty()) {
+      const std::string &dir = mDirs.back();
+      if (path.compare(0, dir.size(), dir) == 0) {
+        return &dir;
+      }
+
+      if (path < dir) {
+        break;
+      }
+
+      mDirs.pop_back();
+    }
+
+    return NULL;
+  }
+
+private:
+  std::vector<std::string> mDirs;
+};
+
+// Applies an ignore filter to entries visited in path order. Entries inside an ignored directory
+// are ignored too, as they would have been skipped when crawling.
+class EntryFilter {
+public:
+  EntryFilter(PathFilter isIgnored) : mIsIgnored(isIgnored) {}
+
+  bool isIgnored(const DirEntry &entry) {
+    if (!mIsIgnored) {
+      return false;
+    }
+
+    if (mIgnoredDirs.find(entry.path)) {
+      return true;
+    }
+
+    if (!mIsIgnored(entry.path)) {
+      return false;
+    }
+
+    if (entry.isDir) {
+      mIgnoredDirs.add(entry.path);
+    }
+
+    return true;
+  }
+
+private:
+  PathFilter mIsIgnored;
+  DirRanges mIgnoredDirs;
+};
+
+// Files whose mtime changed since a hashed snapshot, which are hashed once the comparison is done
+// to check whether their contents changed too.
+class HashChecks {
+public:
+  void add(const DirEntry &snapshotEntry) {
+    mFiles.emplace_back(snapshotEntry.path);
+    mExpected.push_back(std::make_pair(snapshotEntry.size, snapshotEntry.hash));
+  }
+
+  void emit(EventList &events) {
+    if (mFiles.empty()) {
+      return;
+    }
+
+    hashFiles(mFiles);
+    for (size_t i = 0; i < mFiles.size(); i++) {
+      if (mFiles[i].hash == 0 || mFiles[i].size != mExpected[i].first || mFiles[i].hash != mExpected[i].second) {
+        events.update(mFiles[i].path);
+      }
+    }
+  }
+
+private:
+  std::vector<ContentHash> mFiles;
+  std::vector<std::pair<uint64_t, uint64_t>> mExpected;
+};
+
+// Compares two sorted sequences of entries in a single pass, emitting the changes from before to after.
+// A file whose mtime changed is only reported as updated if its hash changed too, when known. If the
+// after side is the file system and its hash is not known, the file is added to hashChecks instead.
+// Directories with the same digest on both sides are skipped along with everything below them.
+static void diffEntries(EntryCursor &before, EntryCursor &after, EventList &events, PathFilter isIgnored, HashChecks *hashChecks = nullptr) {
+  EntryFilter filter(isIgnored);
+  DirRanges unchanged;
+  bool digests = before.hasDigests() && after.hasDigests();
+
+  while (before.valid() || after.valid()) {
+    AbortFlag::check();
+    int cmp = !before.valid() ? 1 : !after.valid() ? -1 : before.entry().path.compare(after.entry().path);
+    const std::string *skip = digests ? unchanged.find((cmp > 0 ? after : before).entry().path) : NULL;
+    if (skip) {
+      if (cmp <= 0) {
+        before.skip(*skip);
+      }
+
+      if (cmp >= 0) {
+        after.skip(*skip);
+      }
+    } else if (cmp < 0) {
+      if (!filter.isIgnored(before.entry())) {
+        events.remove(before.entry().path, before.entry().isDir);
+      }
+
+      before.next();
+    } else if (cmp > 0) {
+      if (!filter.isIgnored(after.entry())) {
+        events.create(after.entry().path, after.entry().isDir);
+      }
+
+      after.next();
+    } else {
+      const DirEntry &a = before.entry();
+      const DirEntry &b = after.entry();
+      if (digests && a.isDir && b.isDir && a.digest == b.digest) {
+        unchanged.add(b.path);
+      }
+
+      bool isIgnored = filter.isIgnored(b);
+      if (!isIgnored && a.mtime != b.mtime && !a.isDir && !b.isDir) {
+        if (a.hash != 0 && b.hash != 0) {
+          if (a.size != b.size || a.hash != b.hash) {
+            events.update(b.path);
+          }
+        } else if (a.hash != 0 && hashChecks && (b.size == 0 || b.size == a.size)) {
+          hashChecks->add(a);
+        } else {
+          events.update(b.path);
+        }
+      }
+
+      before.next();
+      after.next();
+    }
   }
 }
 
 void DirTree::getChanges(DirTree *snapshot, EventList &events) {
-  std::lock_guard<std::mutex> lock(mMutex);
-  std::lock_guard<std::mutex> snapshotLock(snapshot->mMutex);
-  
-  for (auto it = entries.begin(); it != entries.end(); it++) {
-    auto found = snapshot->entries.find(it->first);
-    if (found == snapshot->entries.end()) {
-      events.create(it->second.path);
-    } else if (found->second.mtime != it->second.mtime && !found->second.isDir && !it->second.isDir) {
-      events.update(it->second.path);
+  if (snapshot == this) {
+    return;
+  }
+
+  // Lock both trees without risking a deadlock against a concurrent diff in the other direction.
+  std::lock(mMutex, snapshot->mMutex);
+  std::lock_guard<std::mutex> lock(mMutex, std::adopt_lock);
+  std::lock_guard<std::mutex> snapshotLock(snapshot->mMutex, std::adopt_lock);
+
+  bool digests = mHasDigests && snapshot->mHasDigests;
+  if (digests && mDigest == snapshot->mDigest) {
+    return;
+  }
+
+  TreeCursor before(*snapshot->entries, digests);
+  TreeCursor after(*entries, digests);
+  diffEntries(before, after, events, nullptr);
+}
+
+// Compares the tree with a snapshot, optionally restricted to a path and the entries below it.
+// The tree may only contain that part of the directory in that case.
+void DirTree::getChanges(SnapshotReader &snapshot, EventList &events, const std::string &path) {
+  // Legacy snapshots are not sorted, so they need to be loaded into memory to be compared.
+  std::unique_ptr<DirTree> snapshotTree;
+  std::unique_ptr<EntryCursor> before;
+  if (snapshot.isSorted) {
+    before.reset(new ReaderCursor(snapshot));
+  } else {
+    snapshotTree.reset(new DirTree(root, snapshot));
+    before.reset(new TreeCursor(*snapshotTree->entries));
+  }
+
+  bool isWhole = path.empty() || path == root;
+  HashChecks hashChecks;
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (isWhole && mHasDigests && snapshot.hasDigests && mDigest == snapshot.digest) {
+      return;
     }
+
+    TreeCursor after(*entries, mHasDigests);
+    if (isWhole) {
+      diffEntries(*before, after, events, nullptr, &hashChecks);
+    } else {
+      SubtreeCursor subtreeBefore(*before, path);
+      SubtreeCursor subtreeAfter(after, path);
+      diffEntries(subtreeBefore, subtreeAfter, events, nullptr, &hashChecks);
+    }
+  }
+
+  hashChecks.emit(events);
+}
+
+// Returns whether a path or anything below it differs from the snapshot. When both sides have
+// digests, they are compared directly, only reading the snapshot up to the path. Otherwise, or if
+// the snapshot is hashed and mtimes alone are not conclusive, the path's entries are compared.
+bool DirTree::hasChanged(SnapshotReader &snapshot, const std::string &path) {
+  if (mHasDigests && snapshot.hasDigests && !snapshot.isHashed) {
+    uint64_t before = 0;
+    if (path == root) {
+      before = snapshot.digest;
+    } else {
+      while (snapshot.next()) {
+        const DirEntry &entry = snapshot.entry();
+        if (entry.path >= path) {
+          if (entry.path == path) {
+            before = entryDigest(entry) + (entry.isDir ? entry.digest : 0);
+          }
+
+          break;
+        }
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    return subtreeDigest(path) != before;
+  }
+
+  EventList events;
+  getChanges(snapshot, events, path);
+  return events.size() > 0;
+}
+
+// Compares two snapshots without touching the file system. Sorted snapshots are streamed,
+// so only the entries being compared are held in memory.
+void DirTree::getChanges(SnapshotReader &before, SnapshotReader &after, EventList &events, PathFilter isIgnored) {
+  std::unique_ptr<DirTree> beforeTree;
+  std::unique_ptr<EntryCursor> beforeCursor;
+  if (before.isSorted) {
+    beforeCursor.reset(new ReaderCursor(before));
+  } else {
+    beforeTree.reset(new DirTree(before.root, before));
+    beforeCursor.reset(new TreeCursor(*beforeTree->entries));
+  }
+
+  std::unique_ptr<DirTree> afterTree;
+  std::unique_ptr<EntryCursor> afterCursor;
+  if (after.isSorted) {
+    afterCursor.reset(new ReaderCursor(after));
+  } else {
+    afterTree.reset(new DirTree(after.root, after));
+    afterCursor.reset(new TreeCursor(*afterTree->entries));
+  }
+
+  if (before.hasDigests && after.hasDigests && before.digest == after.digest) {
+    return;
+  }
+
+  diffEntries(*beforeCursor, *afterCursor, events, isIgnored);
+}
+
+// Journals start with a header naming the snapshot they apply to, followed by blocks of records
+// appended over time. Each block is the number of records followed by the records themselves:
+// "+" and an entry for an added or modified entry, or "-" and a path for a removed one.
+void DirTree::writeJournalHeader(std::ostream &stream, uint64_t id) {
+  stream << "#journal " << id << "\n";
+}
+
+static void writeRecord(std::ostream &stream, const DirEntry &entry, bool isRemoved, bool hashed) {
+  if (isRemoved) {
+    stream << "-" << entry.path.size() << entry.path << "\n";
+  } else {
+    stream << "+";
+    entry.write(stream, hashed ? SNAPSHOT_HASHED : 0);
+  }
+}
+
+// Returns a journal block with the records that turn the snapshot into this tree, or an empty
+// string if they are identical. Unlike getChanges, directory mtimes are compared as well.
+// Records have the same fields as the snapshot's entries.
+std::string DirTree::getDelta(SnapshotReader &snapshot) {
+  std::unique_ptr<DirTree> snapshotTree;
+  std::unique_ptr<EntryCursor> before;
+  if (snapshot.isSorted) {
+    before.reset(new ReaderCursor(snapshot));
+  } else {
+    snapshotTree.reset(new DirTree(root, snapshot));
+    before.reset(new TreeCursor(*snapshotTree->entries));
   }
 
-  for (auto it = snapshot->entries.begin(); it != snapshot->entries.end(); it++) {
-    size_t count = entries.count(it->first);
-    if (count == 0) {
-      events.remove(it->second.path);
+  std::lock_guard<std::mutex> lock(mMutex);
+  TreeCursor after(*entries);
+  std::ostringstream records;
+  size_t count = 0;
+
+  while (before->valid() || after.valid()) {
+    AbortFlag::check();
+    int cmp = !before->valid() ? 1 : !after.valid() ? -1 : before->entry().path.compare(after.entry().path);
+    if (cmp < 0) {
+      writeRecord(records, before->entry(), true, snapshot.isHashed);
+      count++;
+      before->next();
+    } else {
+      const DirEntry &entry = after.entry();
+      if (
+        cmp > 0 ||
+        before->entry().mtime != entry.mtime ||
+        before->entry().isDir != entry.isDir ||
+        (snapshot.isHashed && (before->entry().size != entry.size || before->entry().hash != entry.hash))
+      ) {
+        writeRecord(records, entry, false, snapshot.isHashed);
+        count++;
+      }
+
+      if (cmp == 0) {
+        before->next();
+      }
+
+      after.next();
     }
   }
+
+  if (count == 0) {
+    return "";
+  }
+
+  std::ostringstream block;
+  block << count << "\n" << records.str();
+  return block.str();
 }
 
-DirEntry::DirEntry(std::string p, uint64_t t, bool d) {
+DirEntry::DirEntry(std::string p, uint64_t t, bool d, uint64_t s) {
   path = p;
   mtime = t;
   isDir = d;
+  size = s;
+  hash = 0;
+  digest = 0;
   state = NULL;
 }
 
-DirEntry::DirEntry(std::istream &stream) {
-  size_t size;
+DirEntry::DirEntry(std::istream &stream, int flags) {
+  size_t length;
+  size = 0;
+  hash = 0;
+  digest = 0;
+  state = NULL;
 
-  if (stream >> size) {
-    path.resize(size);
-    if (stream.read(&path[0], size)) {
+  if (stream >> length) {
+    path.resize(length);
+    if (stream.read(&path[0], length)) {
       stream >> mtime;
       stream >> isDir;
+      if (flags & SNAPSHOT_HASHED) {
+        stream >> size;
+        stream >> hash;
+      }
+
+      if ((flags & SNAPSHOT_DIGESTS) && isDir) {
+        stream >> digest;
+      }
+    }
+  }
+}
+
+void DirEntry::write(std::ostream &stream, int flags) const {
+  stream << path.size() << path << mtime << " " << isDir;
+  if (flags & SNAPSHOT_HASHED) {
+    stream << " " << size << " " << hash;
+  }
+
+  if ((flags & SNAPSHOT_DIGESTS) && isDir) {
+    stream << " " << digest;
+  }
+
+  stream << "\n";
+}
+
+SnapshotReader::SnapshotReader(std::istream &stream)
+  : isSorted(false),
+    isCompact(false),
+    isHashed(false),
+    id(0),
+    hasDigests(false),
+    digest(0),
+    mStream(stream),
+    mRemaining(0),
+    mIsJournaled(false),
+    mHasBase(false),
+    mPrevMtime(0),
+    mFlags(0) {
+  // Legacy snapshots start directly with the number of entries.
+  stream >> std::ws;
+  if (stream.peek() == '#') {
+    std::string header;
+    std::getline(stream, header);
+
+    std::istringstream words(header);
+    std::string magic;
+    int version;
+    if (
+      !(words >> magic >> version) ||
+      magic != "#snapshot" ||
+      (version != SNAPSHOT_VERSION && version != COMPACT_SNAPSHOT_VERSION)
+    ) {
+      throw std::runtime_error("Unsupported snapshot format");
+    }
+
+    if (!(words >> id)) {
+      id = 0;
+    } else if (!(words >> mFlags)) {
+      mFlags = 0;
+    }
+
+    if ((mFlags & SNAPSHOT_DIGESTS) && !(words >> digest)) {
+      mFlags &= ~SNAPSHOT_DIGESTS;
+      digest = 0;
+    }
+
+    size_t size;
+    if (stream >> size) {
+      root.resize(size);
+      stream.read(&root[0], size);
+    }
+
+    isSorted = true;
+    isCompact = version == COMPACT_SNAPSHOT_VERSION;
+    isHashed = mFlags & SNAPSHOT_HASHED;
+    hasDigests = mFlags & SNAPSHOT_DIGESTS;
+    mPrevPath = root;
+  }
+
+  if (!(stream >> mRemaining)) {
+    mRemaining = 0;
+  }
+
+  // Compact entries start right after the line with the number of entries.
+  if (isCompact && stream.get() != '\n') {
+    mRemaining = 0;
+  }
+}
+
+std::string SnapshotReader::journalPath(const std::string &snapshotPath) {
+  return snapshotPath + ".journal";
+}
+
+// Loads the records of a journal, so that they are applied to the entries as they are read.
+// Journals that belong to a different snapshot are ignored. Returns false if the journal was
+// ignored or ends with a truncated block, which is skipped, and the journal should be rewritten.
+// Must be called before reading any entries.
+bool SnapshotReader::applyJournal(std::istream &journal) {
+  std::string magic;
+  uint64_t journalId;
+  if (id == 0 || !(journal >> magic >> journalId) || magic != "#journal" || journalId != id) {
+    return false;
+  }
+
+  // Records in later blocks override the ones before them.
+  size_t count;
+  std::map<std::string, JournalRecord> block;
+  while (journal >> count) {
+    block.clear();
+    for (size_t i = 0; i < count; i++) {
+      char type = 0;
+      JournalRecord record;
+      journal >> type;
+      if (type == '+') {
+        record.entry = DirEntry(journal, mFlags & SNAPSHOT_HASHED);
+        record.isRemoved = false;
+      } else if (type == '-') {
+        size_t size;
+        if (journal >> size) {
+          record.entry.path.resize(size);
+          journal.read(&record.entry.path[0], size);
+        }
+
+        record.isRemoved = true;
+      } else {
+        journal.setstate(std::ios::failbit);
+      }
+
+      if (!journal) {
+        startJournal();
+        return false;
+      }
+
+      block[record.entry.path] = record;
+    }
+
+    for (auto it = block.begin(); it != block.end(); it++) {
+      mJournal[it->first] = it->second;
+    }
+  }
+
+  startJournal();
+  return journal.eof();
+}
+
+// Journal records don't update the digests of the directories containing them, so they can't be
+// used once any records are applied.
+void SnapshotReader::startJournal() {
+  mIsJournaled = !mJournal.empty();
+  mJournalIt = mJournal.begin();
+  if (mIsJournaled) {
+    hasDigests = false;
+    mHasBase = readEntry(mBase);
+  }
+}
+
+bool SnapshotReader::next() {
+  if (!mIsJournaled) {
+    return readEntry(mEntry);
+  }
+
+  // Merge the journal records into the snapshot's entries, as both are sorted by path.
+  while (mHasBase || mJournalIt != mJournal.end()) {
+    int cmp = !mHasBase ? 1 : mJournalIt == mJournal.end() ? -1 : mBase.path.compare(mJournalIt->first);
+    if (cmp < 0) {
+      mEntry = mBase;
+      mHasBase = readEntry(mBase);
+      return true;
+    }
+
+    const JournalRecord &record = mJournalIt->second;
+    mJournalIt++;
+    if (cmp == 0) {
+      mHasBase = readEntry(mBase);
+    }
+
+    if (!record.isRemoved) {
+      mEntry = record.entry;
+      return true;
     }
   }
+
+  return false;
 }
 
-void DirEntry::write(std::ostream &stream) const {
-  stream << path.size() << path << mtime << " " << isDir << "\n";
+bool SnapshotReader::readEntry(DirEntry &entry) {
+  if (mRemaining == 0) {
+    return false;
+  }
+
+  mRemaining--;
+  bool success;
+  if (isCompact) {
+    success = readCompactEntry(mStream, entry, mFlags, mPrevPath, mPrevMtime);
+  } else {
+    entry = DirEntry(mStream, mFlags);
+    success = (bool)mStream;
+  }
+
+  // Treat a truncated snapshot as ending early.
+  if (!success) {
+    mRemaining = 0;
+    return false;
+  }
+
+  return true;
+}
+
+// Containers start with a header containing the format version and the number of snapshots,
+// followed by the root and size of each snapshot, and then the snapshots themselves.
+void SnapshotContainer::write(std::ostream &stream, const std::vector<std::string> &roots, const std::vector<std::string> &snapshots) {
+  stream << "#snapshots " << CONTAINER_VERSION << "\n";
+  stream << roots.size() << "\n";
+  for (size_t i = 0; i < roots.size(); i++) {
+    stream << roots[i].size() << roots[i] << " " << snapshots[i].size() << "\n";
+  }
+
+  for (auto it = snapshots.begin(); it != snapshots.end(); it++) {
+    stream.write(it->data(), it->size());
+  }
+}
+
+SnapshotContainer::SnapshotContainer(std::istream &stream) {
+  std::string magic;
+  int version;
+  size_t count;
+  if (!(stream >> magic >> version >> count) || magic != "#snapshots" || version != CONTAINER_VERSION) {
+    throw std::runtime_error("Unsupported snapshot container format");
+  }
+
+  std::vector<std::pair<std::string, uint64_t>> sizes;
+  for (size_t i = 0; i < count; i++) {
+    size_t length;
+    uint64_t size;
+    std::string root;
+    if (stream >> length) {
+      root.resize(length);
+      stream.read(&root[0], length);
+    }
+
+    if (!(stream >> size)) {
+      throw std::runtime_error("Unsupported snapshot container format");
+    }
+
+    sizes.push_back(std::make_pair(root, size));
+  }
+
+  // The snapshots start right after the line of the last entry of the table.
+  stream.get();
+  uint64_t offset = (uint64_t)stream.tellg();
+  for (auto it = sizes.begin(); it != sizes.end(); it++) {
+    mOffsets.emplace(it->first, offset);
+    offset += it->second;
+  }
+}
+
+// Returns whether the container has a snapshot of the root, and where it starts if so.
+bool SnapshotContainer::find(const std::string &root, uint64_t &offset) {
+  auto found = mOffsets.find(root);
+  if (found == mOffsets.end()) {
+    return false;
+  }
+
+  offset = found->second;
+  return true;
 }
@@ -2,10 +2,15 @@
 #define DIR_TREE_H
 
 #include <string>
+#include <map>
 #include <unordered_map>
+#include <vector>
+#include <functional>
+#include <iterator>
 #include <ostream>
 #include <istream>
 #include <memory>
+#include <mutex>
 #include "Event.hh"
 
 #ifdef _WIN32
@@ -14,39 +19,248 @@
 #define DIR_SEP "/"
 #endif
 
+// The memory that trees no longer in use may keep using, in bytes (see DirTree::getCached).
+#define DEFAULT_TREE_CACHE_SIZE (64 * 1024 * 1024)
+
 struct DirEntry {
   std::string path;
   uint64_t mtime;
   bool isDir;
+  // The size and content hash of files, recorded in hashed snapshots. A hash of 0 means unknown.
+  uint64_t size;
+  uint64_t hash;
+  // For directories, the sum of the digests of all entries below it (see DirTree::ensureDigests).
+  uint64_t digest;
   mutable void *state;
 
-  DirEntry(std::string p, uint64_t t, bool d);
-  DirEntry(std::istream &stream);
-  void write(std::ostream &stream) const;
+  DirEntry() : mtime(0), isDir(false), size(0), hash(0), digest(0), state(NULL) {}
+  DirEntry(std::string p, uint64_t t, bool d, uint64_t s = 0);
+  DirEntry(std::istream &stream, int flags = 0);
+  void write(std::ostream &stream, int flags = 0) const;
   bool operator==(const DirEntry &other) const {
     return path == other.path;
   }
 };
 
+// Entries are kept sorted by path, so that a directory's descendants form a contiguous range
+// and trees can be compared with snapshots by merging rather than by lookups. They are stored in
+// chunks of consecutive paths, which copies of the map share until one of them modifies a chunk.
+// Modifying a tree still shared with a frozen copy (see DirTree::freeze) therefore duplicates the
+// list of chunks and the chunks it touches, rather than every entry. Entries are read through
+// the iterators, which are invalidated by any modification, and modified through the methods
+// below, which take ownership of the chunk first.
+class DirEntryMap {
+  typedef std::map<std::string, DirEntry> Chunk;
+  typedef std::vector<std::shared_ptr<Chunk>> ChunkList;
+
+public:
+  typedef Chunk::value_type value_type;
+
+  class const_iterator {
+  public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef DirEntryMap::value_type value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const value_type *pointer;
+    typedef const value_type &reference;
+
+    const_iterator() : mChunks(nullptr), mIndex(0) {}
+    const_iterator(const ChunkList *chunks, size_t index, Chunk::const_iterator it)
+      : mChunks(chunks), mIndex(index), mIt(it) {}
+
+    reference operator*() const { return *mIt; }
+    pointer operator->() const { return &*mIt; }
+    bool operator==(const const_iterator &other) const {
+      return mIndex == other.mIndex && (mIndex == mChunks->size() || mIt == other.mIt);
+    }
+
+    bool operator!=(const const_iterator &other) const { return !(*this == other); }
+
+    const_iterator &operator++() {
+      if (++mIt == (*mChunks)[mIndex]->end() && ++mIndex < mChunks->size()) {
+        mIt = (*mChunks)[mIndex]->begin();
+      }
+
+      return *this;
+    }
+
+    const_iterator operator++(int) {
+      const_iterator it = *this;
+      ++*this;
+      return it;
+    }
+
+    const_iterator &operator--() {
+      if (mIndex == mChunks->size() || mIt == (*mChunks)[mIndex]->begin()) {
+        mIt = (*mChunks)[--mIndex]->end();
+      }
+
+      --mIt;
+      return *this;
+    }
+
+    const_iterator operator--(int) {
+      const_iterator it = *this;
+      --*this;
+      return it;
+    }
+
+  private:
+    const ChunkList *mChunks;
+    size_t mIndex;
+    Chunk::const_iterator mIt;
+  };
+
+  typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+  DirEntryMap() : mSize(0) {}
+  size_t size() const { return mSize; }
+  const_iterator begin() const { return mChunks.empty() ? end() : const_iterator(&mChunks, 0, mChunks[0]->begin()); }
+  const_iterator end() const { return const_iterator(&mChunks, mChunks.size(), Chunk::const_iterator()); }
+  const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+  const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+  const_iterator find(const std::string &path) const;
+  const_iterator lower_bound(const std::string &path) const;
+  size_t count(const std::string &path) const { return find(path) != end(); }
+
+  std::pair<DirEntry *, bool> emplace(const std::string &path, const DirEntry &entry);
+  DirEntry *modify(const std::string &path);
+  void modifyAll(const std::function<void(DirEntry &)> &fn);
+  void erase(const std::string &path);
+  void erasePrefix(const std::string &prefix);
+
+private:
+  ChunkList mChunks;
+  size_t mSize;
+
+  size_t chunkIndex(const std::string &path) const;
+  Chunk &own(size_t index);
+};
+
+typedef std::function<bool(const std::string &)> PathFilter;
+
+// How a snapshot is written. Compact snapshots are binary, with paths front-coded against the
+// previous entry and mtimes stored as variable-length deltas. Hashed snapshots record the size
+// and content hash of files, so that files whose mtime changed but not their contents are not
+// reported as updated. A compaction ratio above 0 appends changes to a journal rather than
+// rewriting the snapshot (see BruteForceBackend::writeSnapshotFile).
+struct SnapshotOptions {
+  bool compact;
+  bool hash;
+  double compactionRatio;
+
+  SnapshotOptions() : compact(false), hash(false), compactionRatio(0) {}
+};
+
+// A change recorded in a snapshot journal: either the new state of an entry, or its removal.
+struct JournalRecord {
+  DirEntry entry;
+  bool isRemoved;
+};
+
+// Reads the entries of a snapshot one at a time, so that a snapshot doesn't need to be loaded
+// into memory to be compared. Legacy snapshots (without a header) are not sorted.
+class SnapshotReader {
+public:
+  SnapshotReader(std::istream &stream);
+  static std::string journalPath(const std::string &snapshotPath);
+  bool applyJournal(std::istream &journal);
+  bool next();
+  const DirEntry &entry() const {
+    return mEntry;
+  }
+
+  std::string root;
+  bool isSorted;
+  bool isCompact;
+  bool isHashed;
+  // Identifies a snapshot written as the base of a journal, or 0.
+  uint64_t id;
+  // Whether directories have digests, and the digest of the whole tree if so.
+  bool hasDigests;
+  uint64_t digest;
+
+private:
+  std::istream &mStream;
+  size_t mRemaining;
+  DirEntry mEntry;
+  std::map<std::string, JournalRecord> mJournal;
+  std::map<std::string, JournalRecord>::const_iterator mJournalIt;
+  bool mIsJournaled;
+  bool mHasBase;
+  DirEntry mBase;
+  std::string mPrevPath;
+  uint64_t mPrevMtime;
+  int mFlags;
+
+  bool readEntry(DirEntry &entry);
+  void startJournal();
+};
+
+// A file holding the snapshots of several directories, each in the usual format. The header is
+// followed by a table with the root and size of each snapshot, so a reader can seek to the one
+// it needs without parsing the others.
+class SnapshotContainer {
+public:
+  SnapshotContainer(std::istream &stream);
+  bool find(const std::string &root, uint64_t &offset);
+  static void write(std::ostream &stream, const std::vector<std::string> &roots, const std::vector<std::string> &snapshots);
+
+private:
+  // The offset of each snapshot from the start of the file.
+  std::unordered_map<std::string, uint64_t> mOffsets;
+};
+
 class DirTree {
 public:
   static std::shared_ptr<DirTree> getCached(std::string root);
-  DirTree(std::string root) : root(root), isComplete(false) {}
+  static void setCacheSize(size_t size);
+  static void getChanges(SnapshotReader &before, SnapshotReader &after, EventList &events, PathFilter isIgnored);
+  DirTree(std::string root)
+    : root(root),
+      isComplete(false),
+      isStale(false),
+      entries(std::make_shared<DirEntryMap>()),
+      mHasDigests(false),
+      mDigest(0) {}
   DirTree(std::string root, std::istream &stream);
-  DirEntry *add(std::string path, uint64_t mtime, bool isDir);
+  DirTree(std::string root, SnapshotReader &reader);
+  std::shared_ptr<DirTree> freeze();
+  void replace(DirTree &tree);
+  void clear();
+  size_t memoryUsage();
+  DirEntry *add(std::string path, uint64_t mtime, bool isDir, uint64_t size = 0);
   DirEntry *find(std::string path);
-  DirEntry *update(std::string path, uint64_t mtime);
+  DirEntry *update(std::string path, uint64_t mtime, uint64_t size = 0);
   void remove(std::string path);
-  void write(std::ostream &stream);
+  void computeHashes(SnapshotReader *previous);
+  void ensureDigests();
+  bool hasChanged(SnapshotReader &snapshot, const std::string &path);
+  void write(std::ostream &stream, uint64_t id = 0, const SnapshotOptions &options = SnapshotOptions());
+  std::string getDelta(SnapshotReader &snapshot);
+  static void writeJournalHeader(std::ostream &stream, uint64_t id);
   void getChanges(DirTree *snapshot, EventList &events);
+  void getChanges(SnapshotReader &snapshot, EventList &events, const std::string &path = "");
 
   std::mutex mMutex;
   std::string root;
   bool isComplete;
-  std::unordered_map<std::string, DirEntry> entries;
+  // Set when a tree retained after it was last used is used again. Nothing kept it up to date in
+  // the meantime, so it must be revalidated against the file system first.
+  bool isStale;
+  // Identifies the ignore sets the tree was read with (see BruteForceBackend::getTree).
+  std::string crawlKey;
+  // Shared with frozen copies of this tree until one of them is modified (copy-on-write).
+  std::shared_ptr<DirEntryMap> entries;
 
 private:
+  bool mHasDigests;
+  uint64_t mDigest;
+
   DirEntry *_find(std::string path);
+  void detach();
+  void addDigest(const std::string &path, uint64_t delta);
+  uint64_t subtreeDigest(const std::string &path);
 };
 
 #endif
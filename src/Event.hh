@@ -5,6 +5,7 @@
 #include <napi.h>
 #include <mutex>
 #include <map>
+#include <functional>
 
 using namespace Napi;
 
@@ -12,7 +13,8 @@ struct Event {
   std::string path;
   bool isCreated;
   bool isDeleted;
-  Event(std::string path) : path(path), isCreated(false), isDeleted(false) {}
+  bool isDir;
+  Event(std::string path) : path(path), isCreated(false), isDeleted(false), isDir(false) {}
 
   Value toJS(const Env& env) {
     EscapableHandleScope scope(env);
@@ -26,9 +28,9 @@ struct Event {
 
 class EventList {
 public:
-  void create(std::string path) {
+  void create(std::string path, bool isDir = false) {
     std::lock_guard<std::mutex> l(mMutex);
-    Event *event = internalUpdate(path);
+    Event *event = internalUpdate(path, isDir);
     if (event->isDeleted) {
       // Assume update event when rapidly removed and created
       // https://github.com/parcel-bundler/watcher/issues/72
@@ -38,14 +40,14 @@ public:
     }
   }
 
-  Event *update(std::string path) {
+  Event *update(std::string path, bool isDir = false) {
     std::lock_guard<std::mutex> l(mMutex);
-    return internalUpdate(path);
+    return internalUpdate(path, isDir);
   }
 
-  void remove(std::string path) {
+  void remove(std::string path, bool isDir = false) {
     std::lock_guard<std::mutex> l(mMutex);
-    Event *event = internalUpdate(path);
+    Event *event = internalUpdate(path, isDir);
     if (event->isCreated) {
       // Ignore event when rapidly created and removed
       mEvents.erase(path);
@@ -73,16 +75,68 @@ public:
     mEvents.clear();
   }
 
+  // Removes and returns all of the events at once, so that none added meanwhile are lost.
+  std::vector<Event> take() {
+    std::lock_guard<std::mutex> l(mMutex);
+    std::vector<Event> events;
+    for (auto it = mEvents.begin(); it != mEvents.end(); ++it) {
+      events.push_back(it->second);
+    }
+    mEvents.clear();
+    return events;
+  }
+
+  // Removes and returns the events that match the filter.
+  std::vector<Event> take(std::function<bool(const Event &)> filter) {
+    std::lock_guard<std::mutex> l(mMutex);
+    std::vector<Event> events;
+    for (auto it = mEvents.begin(); it != mEvents.end();) {
+      if (filter(it->second)) {
+        events.push_back(it->second);
+        it = mEvents.erase(it);
+      } else {
+        it++;
+      }
+    }
+    return events;
+  }
+
+  // Records an event taken from another list, coalescing it with this list's events.
+  void add(const Event &event) {
+    if (event.isCreated) {
+      create(event.path, event.isDir);
+    } else if (event.isDeleted) {
+      remove(event.path, event.isDir);
+    } else {
+      update(event.path, event.isDir);
+    }
+  }
+
+  Array toJS(const Env& env) {
+    std::lock_guard<std::mutex> l(mMutex);
+    EscapableHandleScope scope(env);
+    Array arr = Array::New(env, mEvents.size());
+    size_t i = 0;
+    for (auto it = mEvents.begin(); it != mEvents.end(); it++) {
+      arr.Set(i++, it->second.toJS(env));
+    }
+    return scope.Escape(arr).As<Array>();
+  }
+
 private:
   mutable std::mutex mMutex;
   std::map<std::string, Event> mEvents;
-  Event *internalUpdate(std::string path) {
+  // Backends that know whether the path is a directory pass isDir, which is kept for the later
+  // events of the path too.
+  Event *internalUpdate(std::string path, bool isDir = false) {
     auto found = mEvents.find(path);
     if (found == mEvents.end()) {
       auto it = mEvents.emplace(path, Event(path));
+      it.first->second.isDir = isDir;
       return &it.first->second;
     }
 
+    found->second.isDir = found->second.isDir || isDir;
     return &found->second;
   }
 };
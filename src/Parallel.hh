@@ -0,0 +1,116 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <system_error>
+#include <algorithm>
+#include <functional>
+#include "Abort.hh"
+#include "WorkerPool.hh"
+
+// Calls fn with each index below count. The calling thread works through the indices, helped by
+// tasks on the shared worker pool, so that the pool's size bounds the threads of every operation.
+// There are at most as many as the pool has threads or there are cores, with at least
+// minPerThread indices each so that small batches don't pay for queueing them. Helpers that only
+// start once every index was taken return right away, so the caller never waits for a thread of
+// the pool to become free. Calls made while a call is spread over several threads, e.g. hashing
+// the files of trees crawled in parallel, run inline. The first exception thrown is rethrown once
+// all helpers are done. They share the caller's abort flag, and stop once it is set.
+inline void parallelFor(size_t count, size_t minPerThread, const std::function<void(size_t)> &fn) {
+  static thread_local bool isNested = false;
+
+  WorkerPool &pool = WorkerPool::getShared();
+  size_t threadCount = isNested ? 1 : std::min<size_t>(
+    std::min<size_t>(pool.size(), std::max(std::thread::hardware_concurrency(), 1u)),
+    count / std::max<size_t>(minPerThread, 1)
+  );
+
+  if (threadCount <= 1) {
+    for (size_t i = 0; i < count; i++) {
+      AbortFlag::check();
+      fn(i);
+    }
+
+    return;
+  }
+
+  // Shared with the helpers, which may outlive the call when they start late.
+  struct State {
+    std::atomic<size_t> next;
+    std::mutex mutex;
+    std::condition_variable cond;
+    size_t active = 0;
+    bool isDone = false;
+    std::exception_ptr error;
+  };
+
+  std::shared_ptr<State> state = std::make_shared<State>();
+  state->next = 0;
+  auto work = [state, count, &fn] () {
+    bool wasNested = isNested;
+    isNested = true;
+    size_t i;
+    while ((i = state->next++) < count) {
+      try {
+        AbortFlag::check();
+        fn(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (!state->error) {
+          state->error = std::current_exception();
+        }
+
+        state->next = count;
+      }
+    }
+
+    isNested = wasNested;
+  };
+
+  std::shared_ptr<AbortFlag> abort = AbortFlag::current();
+  for (size_t i = 1; i < threadCount; i++) {
+    try {
+      pool.run([state, abort, work] () {
+        {
+          std::lock_guard<std::mutex> lock(state->mutex);
+          if (state->isDone) {
+            return;
+          }
+
+          state->active++;
+        }
+
+        {
+          AbortScope scope(abort);
+          work();
+        }
+
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->active--;
+        state->cond.notify_all();
+      });
+    } catch (std::system_error &err) {
+      // The caller does the work itself.
+      break;
+    }
+  }
+
+  work();
+
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->isDone = true;
+  state->cond.wait(lock, [&state] () {
+    return state->active == 0;
+  });
+
+  if (state->error) {
+    std::rethrow_exception(state->error);
+  }
+}
+
+#endif
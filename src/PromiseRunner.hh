@@ -3,19 +3,26 @@
 
 #include <napi.h>
 #include <node_api.h>
+#include "WorkerPool.hh"
+#include "Abort.hh"
 
 using namespace Napi;
 
+// Runs an operation on the worker pool, and settles a promise with its result. Completion is
+// signalled back to the JS thread through a threadsafe function, which also keeps the event loop
+// alive until then.
 class PromiseRunner {
 public:
   const Env env;
   Promise::Deferred deferred;
 
   PromiseRunner(Env env) : env(env), deferred(Promise::Deferred::New(env)) {
-    napi_status status = napi_create_async_work(env, nullptr, env.Undefined(), 
-                                                onExecute, onWorkComplete, this, &work);
+    napi_status status = napi_create_threadsafe_function(env, nullptr, nullptr,
+                                                         String::New(env, "PromiseRunner"),
+                                                         0, 1, nullptr, nullptr, this,
+                                                         onWorkComplete, &tsfn);
     if (status != napi_ok) {
-      work = nullptr;
+      tsfn = nullptr;
       const napi_extended_error_info *error_info = 0;
       napi_get_last_error_info(env, &error_info);
       if (error_info->error_message) {
@@ -28,56 +35,94 @@ public:
 
   virtual ~PromiseRunner() {}
 
+  // Aborts the operation once the AbortSignal passed as the signal option fires. The operation
+  // checks the flag as it goes, and rejects with an AbortError once it notices. The signal must
+  // have been validated already (see isValidAbortSignal).
+  void setAbortSignal(Value opts) {
+    if (!opts.IsObject()) {
+      return;
+    }
+
+    Value signal = opts.As<Object>().Get("signal");
+    if (!signal.IsObject()) {
+      return;
+    }
+
+    abortFlag = std::make_shared<AbortFlag>();
+    if (signal.As<Object>().Get("aborted").ToBoolean()) {
+      abortFlag->abort();
+      return;
+    }
+
+    std::shared_ptr<AbortFlag> flag = abortFlag;
+    Function listener = Function::New(env, [flag] (const CallbackInfo &info) {
+      flag->abort();
+    });
+
+    signal.As<Object>().Get("addEventListener").As<Function>().Call(signal, {String::New(env, "abort"), listener});
+    abortSignal = Persistent(signal.As<Object>());
+    abortListener = Persistent(listener);
+  }
+
   Value queue() {
-    if (work) {
-      napi_status status = napi_queue_async_work(env, work);
-      if (status != napi_ok) {
-        onError(Error::New(env));
+    Value promise = deferred.Promise();
+    if (tsfn) {
+      try {
+        WorkerPool::getShared().run([this] () {
+          onExecute();
+        });
+      } catch (std::exception &err) {
+        napi_release_threadsafe_function(tsfn, napi_tsfn_release);
+        onError(Error::New(env, err.what()));
+        delete this;
       }
     }
 
-    return deferred.Promise();
+    return promise;
   }
 
 private:
-  napi_async_work work;
+  napi_threadsafe_function tsfn;
   std::string error;
+  bool aborted = false;
+  std::shared_ptr<AbortFlag> abortFlag;
+  ObjectReference abortSignal;
+  FunctionReference abortListener;
 
-  static void onExecute(napi_env env, void *this_pointer) {
-    PromiseRunner* self = (PromiseRunner*) this_pointer;
+  void onExecute() {
+    AbortScope scope(abortFlag);
     try {
-      self->execute();
+      AbortFlag::check();
+      execute();
+    } catch (AbortError &err) {
+      error = err.what();
+      aborted = true;
     } catch (std::exception &err) {
-      self->error = err.what();
+      error = err.what();
     }
+
+    // The runner may be deleted on the JS thread as soon as it's called back.
+    napi_threadsafe_function fn = tsfn;
+    napi_call_threadsafe_function(fn, this, napi_tsfn_nonblocking);
+    napi_release_threadsafe_function(fn, napi_tsfn_release);
   }
 
-  static void onWorkComplete(napi_env env, napi_status status, void *this_pointer) {
-    PromiseRunner* self = (PromiseRunner*) this_pointer;
-    if (status != napi_cancelled) {
-      HandleScope scope(self->env);
-      if (status == napi_ok) {
-        status = napi_delete_async_work(self->env, self->work);
-        if (status == napi_ok) {
-          if (self->error.size() == 0) {
-            self->onOK();
-          } else {
-            self->onError(Error::New(self->env, self->error));
-          }
-          delete self;
-          return;
-        }
-      }
+  static void onWorkComplete(napi_env env, napi_value callback, void *context, void *data) {
+    // Without an environment, it is being torn down, and the runner is leaked rather than
+    // releasing its references into it.
+    if (env == nullptr) {
+      return;
     }
 
-    // fallthrough for error handling
-    const napi_extended_error_info *error_info = 0;
-    napi_get_last_error_info(env, &error_info);
-    if (error_info->error_message){
-      self->onError(Error::New(env, error_info->error_message));
+    PromiseRunner* self = (PromiseRunner*) data;
+    HandleScope scope(self->env);
+    self->removeAbortListener();
+    if (self->error.size() == 0) {
+      self->onOK();
     } else {
-      self->onError(Error::New(env));
+      self->onError(Error::New(self->env, self->error));
     }
+
     delete self;
   }
 
@@ -93,8 +138,25 @@ private:
   }
 
   void onError(const Error &e) {
+    if (aborted) {
+      e.Value().Set("name", "AbortError");
+      e.Value().Set("code", "ABORT_ERR");
+    }
+
     deferred.Reject(e.Value());
   }
+
+  void removeAbortListener() {
+    if (abortListener.IsEmpty()) {
+      return;
+    }
+
+    Object signal = abortSignal.Value();
+    Value remove = signal.Get("removeEventListener");
+    if (remove.IsFunction()) {
+      remove.As<Function>().Call(signal, {String::New(env, "abort"), abortListener.Value()});
+    }
+  }
 };
 
 #endif
@@ -0,0 +1,110 @@
+#include <fstream>
+#include "SnapshotHandle.hh"
+#include "PromiseRunner.hh"
+#include "AddonData.hh"
+
+class SnapshotDiffRunner : public PromiseRunner {
+public:
+  SnapshotDiffRunner(Env env, std::shared_ptr<DirTree> tree, std::shared_ptr<DirTree> since)
+    : PromiseRunner(env),
+      tree(tree),
+      since(since) {}
+
+private:
+  std::shared_ptr<DirTree> tree;
+  std::shared_ptr<DirTree> since;
+  EventList events;
+
+  void execute() override {
+    if (since->root != tree->root) {
+      throw std::runtime_error("The snapshot was captured from " + since->root + ", not " + tree->root);
+    }
+
+    tree->getChanges(since.get(), events);
+  }
+
+  Value getResult() override {
+    return events.toJS(env);
+  }
+};
+
+class SnapshotWriteRunner : public PromiseRunner {
+public:
+  SnapshotWriteRunner(Env env, std::shared_ptr<DirTree> tree, Value path)
+    : PromiseRunner(env),
+      tree(tree),
+      snapshotPath(std::string(path.As<String>().Utf8Value().c_str())) {}
+
+private:
+  std::shared_ptr<DirTree> tree;
+  std::string snapshotPath;
+
+  void execute() override {
+    std::ofstream ofs(snapshotPath, std::ios::binary);
+    if (ofs.fail()) {
+      throw std::runtime_error("Unable to open snapshot file: " + snapshotPath);
+    }
+
+    tree->write(ofs);
+  }
+};
+
+void SnapshotHandle::init(Napi::Env env, Object exports) {
+  Function func = DefineClass(env, "Snapshot", {
+    InstanceAccessor("dir", &SnapshotHandle::getDir, nullptr),
+    InstanceMethod("getEventsSince", &SnapshotHandle::getEventsSince),
+    InstanceMethod("write", &SnapshotHandle::write)
+  });
+
+  // Each environment has its own class.
+  AddonData::get(env)->snapshotConstructor = Persistent(func);
+  exports.Set(String::New(env, "Snapshot"), func);
+}
+
+// Snapshots are only created natively, by passing the tree to the constructor as an external.
+Object SnapshotHandle::create(Napi::Env env, std::shared_ptr<DirTree> tree) {
+  return AddonData::get(env)->snapshotConstructor.New({External<std::shared_ptr<DirTree>>::New(env, &tree)});
+}
+
+bool SnapshotHandle::isHandle(Napi::Value value) {
+  return value.IsObject() && value.As<Object>().InstanceOf(AddonData::get(value.Env())->snapshotConstructor.Value());
+}
+
+std::shared_ptr<DirTree> SnapshotHandle::getTree(Napi::Value value) {
+  return Unwrap(value.As<Object>())->mTree;
+}
+
+SnapshotHandle::SnapshotHandle(const CallbackInfo &info) : ObjectWrap<SnapshotHandle>(info) {
+  if (info.Length() < 1 || !info[0].IsExternal()) {
+    TypeError::New(info.Env(), "Snapshots cannot be constructed directly").ThrowAsJavaScriptException();
+    return;
+  }
+
+  mTree = *info[0].As<External<std::shared_ptr<DirTree>>>().Data();
+}
+
+Napi::Value SnapshotHandle::getDir(const CallbackInfo &info) {
+  return String::New(info.Env(), mTree->root.c_str());
+}
+
+Napi::Value SnapshotHandle::getEventsSince(const CallbackInfo &info) {
+  Napi::Env env = info.Env();
+  if (info.Length() < 1 || !isHandle(info[0])) {
+    TypeError::New(env, "Expected a snapshot").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  SnapshotDiffRunner *runner = new SnapshotDiffRunner(env, mTree, getTree(info[0]));
+  return runner->queue();
+}
+
+Napi::Value SnapshotHandle::write(const CallbackInfo &info) {
+  Napi::Env env = info.Env();
+  if (info.Length() < 1 || !info[0].IsString()) {
+    TypeError::New(env, "Expected a string").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  SnapshotWriteRunner *runner = new SnapshotWriteRunner(env, mTree, info[0]);
+  return runner->queue();
+}
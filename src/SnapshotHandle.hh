@@ -0,0 +1,28 @@
+#ifndef SNAPSHOT_HANDLE_H
+#define SNAPSHOT_HANDLE_H
+
+#include <napi.h>
+#include "DirTree.hh"
+
+using namespace Napi;
+
+// A JS object holding an in-memory snapshot of a directory, as a frozen DirTree.
+// Snapshots can be diffed against each other or the file system, and written to disk on demand.
+class SnapshotHandle : public ObjectWrap<SnapshotHandle> {
+public:
+  static void init(Napi::Env env, Object exports);
+  static Object create(Napi::Env env, std::shared_ptr<DirTree> tree);
+  static bool isHandle(Napi::Value value);
+  static std::shared_ptr<DirTree> getTree(Napi::Value value);
+
+  SnapshotHandle(const CallbackInfo &info);
+
+private:
+  std::shared_ptr<DirTree> mTree;
+
+  Napi::Value getDir(const CallbackInfo &info);
+  Napi::Value getEventsSince(const CallbackInfo &info);
+  Napi::Value write(const CallbackInfo &info);
+};
+
+#endif
@@ -1,37 +1,42 @@
 #include "Watcher.hh"
+#include "AddonData.hh"
 #include <unordered_set>
+#include <algorithm>
 
 using namespace Napi;
 
-struct WatcherHash {
-  std::size_t operator() (std::shared_ptr<Watcher> const &k) const {
-    return std::hash<std::string>()(k->mDir);
-  }
-};
-
-struct WatcherCompare {
-  size_t operator() (std::shared_ptr<Watcher> const &a, std::shared_ptr<Watcher> const &b) const {
-    return *a == *b;
-  }
+// The context of a watcher's threadsafe function. Calls may still be queued when the watcher
+// releases the function, so the handle outlives the watcher and is cleared to drop them.
+struct WatcherHandle {
+  Watcher *watcher;
 };
 
-static std::unordered_set<std::shared_ptr<Watcher>, WatcherHash, WatcherCompare> sharedWatchers;
-
-std::shared_ptr<Watcher> Watcher::getShared(std::string dir, std::unordered_set<std::string> ignorePaths, std::unordered_set<Glob> ignoreGlobs) {
+// Watchers are shared within the environment they're used in, as their callbacks are only valid
+// there. Each environment's watchers subscribe to the process-wide backends separately, which
+// share a single native watch and tree per root between them (see Backend::watch).
+std::shared_ptr<Watcher> Watcher::getShared(Env env, std::string dir, std::unordered_set<std::string> ignorePaths, std::unordered_set<Glob> ignoreGlobs, std::unordered_set<Glob> immediateGlobs) {
+  AddonData *data = AddonData::get(env);
   std::shared_ptr<Watcher> watcher = std::make_shared<Watcher>(dir, ignorePaths, ignoreGlobs);
-  auto found = sharedWatchers.find(watcher);
-  if (found != sharedWatchers.end()) {
+  watcher->mImmediateGlobs = immediateGlobs;
+  auto found = data->watchers.find(watcher);
+  if (found != data->watchers.end()) {
     return *found;
   }
 
-  sharedWatchers.insert(watcher);
+  watcher->mAddonData = data;
+  data->watchers.insert(watcher);
   return watcher;
 }
 
 void removeShared(Watcher *watcher) {
-  for (auto it = sharedWatchers.begin(); it != sharedWatchers.end(); it++) {
+  if (!watcher->mAddonData) {
+    return;
+  }
+
+  auto &watchers = watcher->mAddonData->watchers;
+  for (auto it = watchers.begin(); it != watchers.end(); it++) {
     if (it->get() == watcher) {
-      sharedWatchers.erase(it);
+      watchers.erase(it);
       break;
     }
   }
@@ -42,7 +47,11 @@ Watcher::Watcher(std::string dir, std::unordered_set<std::string> ignorePaths, s
     mIgnorePaths(ignorePaths),
     mIgnoreGlobs(ignoreGlobs),
     mWatched(false),
-    mAsync(NULL),
+    mLiveSourced(false),
+    mAddonData(nullptr),
+    mTsfn(nullptr),
+    mHandle(nullptr),
+    mOpened(0),
     mCallingCallbacks(false) {
       mDebounce = Debounce::getShared();
       mDebounce->add(this, [this] () {
@@ -63,12 +72,120 @@ void Watcher::notify() {
   std::unique_lock<std::mutex> lk(mMutex);
   mCond.notify_all();
 
-  if (mCallbacks.size() > 0 && mEvents.size() > 0) {
-    mDebounce->trigger();
+  // While every callback is paused, events only accumulate.
+  bool isActive = mCallbacks.size() > 0 && mEvents.size() > 0 && hasActiveCallbacks();
+  lk.unlock();
+
+  if (isActive) {
+    // The events matching the immediate globs skip the debounce, the others are batched.
+    if (!mImmediateGlobs.empty()) {
+      triggerImmediateCallbacks();
+    }
+
+    if (mEvents.size() > 0) {
+      mDebounce->trigger();
+    }
+  }
+
+  forwardEvents();
+}
+
+bool Watcher::hasActiveCallbacks() {
+  std::lock_guard<std::mutex> l(mCallbackEventsMutex);
+  return mCallbacks.size() > mPaused.size();
+}
+
+static bool isCookie(const std::string &path) {
+  size_t sep = path.rfind(DIR_SEP);
+  return sep != std::string::npos && path.compare(sep + 1, sizeof(COOKIE_PREFIX) - 1, COOKIE_PREFIX) == 0;
+}
+
+// Hands the events of a core watcher to its subscribers, each of which only gets the events
+// it doesn't ignore. Subscribers of a directory within the core's only get the events in it.
+// Cookies are never handed on. The ones being waited for are marked as seen once the events
+// that came with them were handed on.
+void Watcher::forwardEvents() {
+  std::lock_guard<std::mutex> lock(mSubscribersMutex);
+  if (mSubscribers.empty()) {
+    return;
+  }
+
+  std::vector<Event> events;
+  std::vector<std::string> cookies;
+  std::vector<Event> all = mEvents.take();
+  for (auto it = all.begin(); it != all.end(); it++) {
+    if (isCookie(it->path)) {
+      cookies.push_back(it->path);
+    } else {
+      events.push_back(*it);
+    }
+  }
+
+  for (auto sub = mSubscribers.begin(); sub != mSubscribers.end(); sub++) {
+    bool isNested = (*sub)->mDir != mDir;
+    std::string dirStart = (*sub)->mDir + DIR_SEP;
+    for (auto it = events.begin(); it != events.end(); it++) {
+      if (isNested && it->path != (*sub)->mDir && it->path.compare(0, dirStart.size(), dirStart) != 0) {
+        continue;
+      }
+
+      if (!(*sub)->isIgnored(it->path)) {
+        (*sub)->mEvents.add(*it);
+      }
+    }
+
+    (*sub)->notify();
+  }
+
+  if (!cookies.empty()) {
+    std::lock_guard<std::mutex> l(mCookiesMutex);
+    for (auto it = cookies.begin(); it != cookies.end(); it++) {
+      auto found = mCookies.find(*it);
+      if (found != mCookies.end()) {
+        found->second = true;
+      }
+    }
+
+    mCookiesCond.notify_all();
   }
 }
 
+void Watcher::addCookie(const std::string &path) {
+  std::lock_guard<std::mutex> l(mCookiesMutex);
+  mCookies[path] = false;
+}
+
+// Waits until the cookie was reported, and stops waiting for it. Returns false on timeout.
+bool Watcher::waitForCookie(const std::string &path, std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> l(mCookiesMutex);
+  bool isSeen = mCookiesCond.wait_for(l, timeout, [this, &path] () {
+    return mCookies[path];
+  });
+
+  mCookies.erase(path);
+  return isSeen;
+}
+
+// Calls the callbacks with the pending events right away rather than after the debounce, and
+// waits until they were called.
+void Watcher::flush() {
+  triggerCallbacks();
+
+  std::unique_lock<std::mutex> l(mFiredMutex);
+  uint64_t triggered = mTriggered;
+  mFiredCond.wait(l, [this, triggered] () {
+    return mFired >= triggered || !mTsfn;
+  });
+}
+
 void Watcher::notifyError(std::exception &err) {
+  {
+    std::lock_guard<std::mutex> lock(mSubscribersMutex);
+    for (auto sub = mSubscribers.begin(); sub != mSubscribers.end(); sub++) {
+      (*sub)->notifyError(err);
+    }
+  }
+
   std::unique_lock<std::mutex> lk(mMutex);
   if (mCallingCallbacks) {
     mCallbackSignal.wait();
@@ -81,25 +198,130 @@ void Watcher::notifyError(std::exception &err) {
 
 void Watcher::triggerCallbacks() {
   std::lock_guard<std::mutex> l(mCallbackEventsMutex);
-  if (mCallbacks.size() > 0 && (mEvents.size() > 0 || mError.size() > 0)) {
-    if (mCallingCallbacks) {
-      mCallbackSignal.wait();
-      mCallbackSignal.reset();
+  bool hasResumedEvents = false;
+  for (auto it = mResumed.begin(); it != mResumed.end(); it++) {
+    hasResumedEvents = hasResumedEvents || it->second->size() > 0;
+  }
+
+  bool isActive = mCallbacks.size() > mPaused.size();
+  if (mCallbacks.size() > 0 && (mError.size() > 0 || (isActive && (mEvents.size() > 0 || hasResumedEvents)))) {
+    sendCallbackEvents(mEvents.take());
+  }
+}
+
+// Whether the path, relative to the watcher's directory, matches any of the globs.
+bool Watcher::matchesGlobs(const std::string &path, const std::unordered_set<Glob> &globs) {
+  auto basePath = mDir + DIR_SEP;
+  if (path.rfind(basePath, 0) != 0) {
+    return false;
+  }
+
+  auto relativePath = path.substr(basePath.size());
+  for (auto it = globs.begin(); it != globs.end(); it++) {
+    if (it->isIgnored(relativePath)) {
+      return true;
     }
+  }
+
+  return false;
+}
+
+bool Watcher::matchesFilter(const EventFilter &filter, const Event &event) {
+  bool isTypeIncluded = event.isCreated ? filter.create : event.isDeleted ? filter.remove : filter.update;
+  if (!isTypeIncluded || (event.isDir && !filter.directories)) {
+    return false;
+  }
 
-    mCallbackEvents = mEvents.getEvents();
-    mEvents.clear();
+  return filter.includeGlobs.empty() || matchesGlobs(event.path, filter.includeGlobs);
+}
 
-    uv_async_send(mAsync);
+// Calls the callbacks with the pending events that match the immediate globs, without waiting
+// for the debounce. Returns whether there were any.
+bool Watcher::triggerImmediateCallbacks() {
+  std::lock_guard<std::mutex> l(mCallbackEventsMutex);
+  if (mCallbacks.size() == 0 || mError.size() > 0) {
+    return false;
   }
+
+  std::vector<Event> events = mEvents.take([this] (const Event &event) {
+    return matchesGlobs(event.path, mImmediateGlobs);
+  });
+
+  if (events.empty()) {
+    return false;
+  }
+
+  sendCallbackEvents(std::move(events));
+  return true;
 }
 
-Value Watcher::callbackEventsToJS(const Env& env) {
+// Hands a batch of events to fireCallbacks on the main thread. Batches sent before it picked up
+// the previous ones are queued after those, so that the immediate and debounced events stay
+// separate batches, and none are lost when they're sent in quick succession.
+// This function must be called with mCallbackEventsMutex held.
+void Watcher::sendCallbackEvents(std::vector<Event> events) {
+  // The function is released and cleared with mFiredMutex held, so it's never called after that.
+  std::lock_guard<std::mutex> lf(mFiredMutex);
+  if (!mTsfn) {
+    return;
+  }
+
+  mCallbackBatches.push_back(std::move(events));
+  mTriggered++;
+  napi_call_threadsafe_function(mTsfn, nullptr, napi_tsfn_nonblocking);
+}
+
+// Picks the events of a batch to call a callback with. Only the events that pass the callback's
+// filter are picked, so the others are never converted to JS values. A paused callback isn't
+// called, and the events are added to those held back for it instead. A resumed callback also
+// gets the events held back for it. Returns false if the callback isn't to be called.
+bool Watcher::holdEvents(const FunctionReference *callback, const std::vector<Event> &all, std::vector<Event> &events) {
   std::lock_guard<std::mutex> l(mCallbackEventsMutex);
+  std::vector<Event> filtered;
+  auto filter = mFilters.find(callback);
+  if (filter != mFilters.end()) {
+    for (auto it = all.begin(); it != all.end(); it++) {
+      if (matchesFilter(filter->second, *it)) {
+        filtered.push_back(*it);
+      }
+    }
+  }
+
+  const std::vector<Event> &batch = filter != mFilters.end() ? filtered : all;
+  if (mError.size() > 0) {
+    events = batch;
+    return true;
+  }
+
+  auto paused = mPaused.find(callback);
+  if (paused != mPaused.end()) {
+    for (auto it = batch.begin(); it != batch.end(); it++) {
+      paused->second->add(*it);
+    }
+
+    return false;
+  }
+
+  auto resumed = mResumed.find(callback);
+  if (resumed != mResumed.end()) {
+    for (auto it = batch.begin(); it != batch.end(); it++) {
+      resumed->second->add(*it);
+    }
+
+    events = resumed->second->getEvents();
+    mResumed.erase(resumed);
+  } else {
+    events = batch;
+  }
+
+  return events.size() > 0;
+}
+
+Value Watcher::callbackEventsToJS(const Env& env, std::vector<Event> &events) {
   EscapableHandleScope scope(env);
-  Array arr = Array::New(env, mCallbackEvents.size());
+  Array arr = Array::New(env, events.size());
   size_t currentEventIndex = 0;
-  for (auto eventIterator = mCallbackEvents.begin(); eventIterator != mCallbackEvents.end(); eventIterator++) {
+  for (auto eventIterator = events.begin(); eventIterator != events.end(); eventIterator++) {
     arr.Set(currentEventIndex++, eventIterator->toJS(env));
   }
   return scope.Escape(arr);
@@ -107,37 +329,77 @@ Value Watcher::callbackEventsToJS(const Env& env) {
 
 // TODO: Doesn't this need some kind of locking?
 void Watcher::clearCallbacks() {
+  {
+    std::lock_guard<std::mutex> l(mCallbackEventsMutex);
+    mPaused.clear();
+    mResumed.clear();
+    mFilters.clear();
+  }
+
   mCallbacks.clear();
 }
 
-void Watcher::fireCallbacks(uv_async_t *handle) {
-  Watcher *watcher = (Watcher *)handle->data;
-  watcher->mCallingCallbacks = true;
+void Watcher::fireCallbacks(napi_env env, napi_value callback, void *context, void *data) {
+  // Without an environment, it is being torn down, and the watcher is detached separately.
+  Watcher *watcher = ((WatcherHandle *)context)->watcher;
+  if (env == nullptr || !watcher) {
+    return;
+  }
 
-  watcher->mCallbacksIterator = watcher->mCallbacks.begin();
-  while (watcher->mCallbacksIterator != watcher->mCallbacks.end()) {
-    auto it = watcher->mCallbacksIterator;
-    HandleScope scope(it->Env());
-    auto err = watcher->mError.size() > 0 ? Error::New(it->Env(), watcher->mError).Value() : it->Env().Null();
-    auto events = watcher->callbackEventsToJS(it->Env());
+  std::vector<std::vector<Event>> batches;
+  uint64_t firing;
+  {
+    // Batches sent before this are handled by this call, those sent after by another.
+    std::lock_guard<std::mutex> l(watcher->mCallbackEventsMutex);
+    batches.swap(watcher->mCallbackBatches);
+    std::lock_guard<std::mutex> lf(watcher->mFiredMutex);
+    firing = watcher->mTriggered;
+  }
+
+  watcher->mCallingCallbacks = true;
 
-    it->MakeCallback(it->Env().Global(), std::initializer_list<napi_value>{err, events});
-    // Throw errors from the callback as fatal exceptions
-    // If we don't handle these node segfaults...
-    if (it->Env().IsExceptionPending()) {
-      Napi::Error err = it->Env().GetAndClearPendingException();
-      napi_fatal_exception(it->Env(), err.Value());
+  for (auto batch = batches.begin(); batch != batches.end(); batch++) {
+    watcher->mCallbacksIterator = watcher->mCallbacks.begin();
+    while (watcher->mCallbacksIterator != watcher->mCallbacks.end()) {
+      auto it = watcher->mCallbacksIterator;
+      std::vector<Event> callbackEvents;
+      if (!watcher->holdEvents(&*it, *batch, callbackEvents)) {
+        watcher->mCallbacksIterator++;
+        continue;
+      }
+
+      HandleScope scope(it->Env());
+      auto err = watcher->mError.size() > 0 ? Error::New(it->Env(), watcher->mError).Value() : it->Env().Null();
+      auto events = watcher->callbackEventsToJS(it->Env(), callbackEvents);
+
+      it->MakeCallback(it->Env().Global(), std::initializer_list<napi_value>{err, events});
+      // Throw errors from the callback as fatal exceptions
+      // If we don't handle these node segfaults...
+      if (it->Env().IsExceptionPending()) {
+        Napi::Error err = it->Env().GetAndClearPendingException();
+        napi_fatal_exception(it->Env(), err.Value());
+      }
+
+      // If the iterator was changed, then the callback trigged an unwatch.
+      // The iterator will have been set to the next valid callback.
+      // If it is the same as before, increment it.
+      if (watcher->mCallbacksIterator == it) {
+        watcher->mCallbacksIterator++;
+      }
     }
 
-    // If the iterator was changed, then the callback trigged an unwatch.
-    // The iterator will have been set to the next valid callback.
-    // If it is the same as before, increment it.
-    if (watcher->mCallbacksIterator == it) {
-      watcher->mCallbacksIterator++;
+    // An error is only reported once.
+    if (watcher->mError.size() > 0) {
+      break;
     }
   }
 
   watcher->mCallingCallbacks = false;
+  {
+    std::lock_guard<std::mutex> l(watcher->mFiredMutex);
+    watcher->mFired = firing;
+    watcher->mFiredCond.notify_all();
+  }
 
   if (watcher->mError.size() > 0) {
     watcher->clearCallbacks();
@@ -150,57 +412,264 @@ void Watcher::fireCallbacks(uv_async_t *handle) {
   }
 }
 
-bool Watcher::watch(FunctionReference callback) {
+// Creates the threadsafe function the callbacks are called through, on the thread of the
+// environment they belong to. Called before a subscription is made on the worker pool, and
+// balanced by close once it was made or failed.
+void Watcher::open(Env env) {
+  mOpened++;
+  if (mWatched) {
+    return;
+  }
+
+  mHandle = new WatcherHandle {this};
+  napi_threadsafe_function tsfn;
+  napi_status status = napi_create_threadsafe_function(env, nullptr, nullptr,
+                                                       String::New(env, "Watcher"),
+                                                       0, 1, mHandle, Watcher::onFinalize, mHandle,
+                                                       Watcher::fireCallbacks, &tsfn);
+  if (status != napi_ok) {
+    delete mHandle;
+    mHandle = nullptr;
+    return;
+  }
+
+  std::lock_guard<std::mutex> l(mFiredMutex);
+  mTsfn = tsfn;
+  mWatched = true;
+}
+
+void Watcher::close() {
+  mOpened--;
+}
+
+bool Watcher::watch(FunctionReference callback, EventFilter filter) {
   std::unique_lock<std::mutex> lk(mMutex);
   auto res = mCallbacks.insert(std::move(callback));
-  if (res.second && !mWatched) {
-    mAsync = new uv_async_t;
-    mAsync->data = (void *)this;
-    uv_async_init(uv_default_loop(), mAsync, Watcher::fireCallbacks);
-    mWatched = true;
-    return true;
+  if (res.second && !filter.isAll()) {
+    std::lock_guard<std::mutex> l(mCallbackEventsMutex);
+    mFilters.emplace(&*res.first, filter);
   }
 
-  return false;
+  return res.second && mCallbacks.size() == 1;
 }
 
-bool Watcher::unwatch(Function callback) {
+// Removes a callback. Returns whether it was subscribed, and sets isLast when it was the
+// watcher's last callback, in which case the backend should stop watching. The events the
+// callback wasn't called with yet are added to pending if given: those held back for it, those
+// queued for the callbacks, and those not handed to them yet.
+bool Watcher::unwatch(Function callback, bool *isLast, std::vector<Event> *pending) {
   std::unique_lock<std::mutex> lk(mMutex);
 
   bool removed = false;
   for (auto it = mCallbacks.begin(); it != mCallbacks.end(); it++) {
     if (it->Value() == callback) {
+      {
+        std::lock_guard<std::mutex> l(mCallbackEventsMutex);
+        if (pending) {
+          auto paused = mPaused.find(&*it);
+          auto resumed = mResumed.find(&*it);
+          std::shared_ptr<EventList> held = paused != mPaused.end() ? paused->second
+            : resumed != mResumed.end() ? resumed->second
+            : nullptr;
+          if (held) {
+            std::vector<Event> events = held->getEvents();
+            pending->insert(pending->end(), events.begin(), events.end());
+          }
+
+          for (auto batch = mCallbackBatches.begin(); batch != mCallbackBatches.end(); batch++) {
+            pending->insert(pending->end(), batch->begin(), batch->end());
+          }
+
+          std::vector<Event> events = mEvents.getEvents();
+          pending->insert(pending->end(), events.begin(), events.end());
+        }
+
+        mPaused.erase(&*it);
+        mResumed.erase(&*it);
+        mFilters.erase(&*it);
+      }
+
       mCallbacksIterator = mCallbacks.erase(it);
       removed = true;
       break;
     }
   }
 
-  if (removed && mCallbacks.size() == 0) {
+  *isLast = removed && mCallbacks.size() == 0;
+  if (*isLast) {
     unref();
-    return true;
+  }
+
+  return removed;
+}
+
+// Whether the callback is subscribed. Sets isOnly if given when it is the watcher's only callback.
+bool Watcher::hasCallback(Function callback, bool *isOnly) {
+  std::unique_lock<std::mutex> lk(mMutex);
+  for (auto it = mCallbacks.begin(); it != mCallbacks.end(); it++) {
+    if (it->Value() == callback) {
+      if (isOnly) {
+        *isOnly = mCallbacks.size() == 1;
+      }
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Pausing a callback stops it from being called, while the watcher keeps its watches and the
+// net changes are held back for it. If all of the watcher's callbacks are paused, the events
+// just accumulate, without waking the debounce thread or the event loop.
+// Sets wasPaused if given when the callback was paused already.
+bool Watcher::pause(Function callback, bool *wasPaused) {
+  std::unique_lock<std::mutex> lk(mMutex);
+  for (auto it = mCallbacks.begin(); it != mCallbacks.end(); it++) {
+    if (it->Value() == callback) {
+      std::lock_guard<std::mutex> l(mCallbackEventsMutex);
+      if (wasPaused) {
+        *wasPaused = mPaused.count(&*it) > 0;
+      }
+
+      if (mPaused.count(&*it) == 0) {
+        // Events held back since it was resumed, if it wasn't called since, stay held back.
+        auto resumed = mResumed.find(&*it);
+        if (resumed != mResumed.end()) {
+          mPaused.emplace(&*it, resumed->second);
+          mResumed.erase(resumed);
+        } else {
+          mPaused.emplace(&*it, std::make_shared<EventList>());
+        }
+      }
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Resuming a callback calls it with the net changes since it was paused in a single batch.
+bool Watcher::resume(Function callback) {
+  std::unique_lock<std::mutex> lk(mMutex);
+  for (auto it = mCallbacks.begin(); it != mCallbacks.end(); it++) {
+    if (it->Value() == callback) {
+      {
+        std::lock_guard<std::mutex> l(mCallbackEventsMutex);
+        auto paused = mPaused.find(&*it);
+        if (paused == mPaused.end()) {
+          return true;
+        }
+
+        mResumed.emplace(&*it, paused->second);
+        mPaused.erase(paused);
+      }
+
+      mDebounce->trigger();
+      return true;
+    }
   }
 
   return false;
 }
 
 void Watcher::unref() {
-  if (mCallbacks.size() == 0 && !mCallingCallbacks) {
+  if (mCallbacks.size() == 0 && !mCallingCallbacks && mOpened == 0) {
     if (mWatched) {
-      mWatched = false;
-      uv_close((uv_handle_t *)mAsync, Watcher::onClose);
+      napi_threadsafe_function tsfn;
+      {
+        std::lock_guard<std::mutex> l(mFiredMutex);
+        tsfn = mTsfn;
+        mTsfn = nullptr;
+        mWatched = false;
+        mFiredCond.notify_all();
+      }
+
+      // Calls that are still queued are dropped.
+      if (mHandle) {
+        mHandle->watcher = nullptr;
+        mHandle = nullptr;
+      }
+
+      if (tsfn) {
+        napi_release_threadsafe_function(tsfn, napi_tsfn_release);
+      }
     }
 
     removeShared(this);
   }
 }
 
-void Watcher::onClose(uv_handle_t *handle) {
-  delete (uv_async_t *)handle;
+// Drops the callbacks without calling them again, when the environment they belong to is torn
+// down.
+void Watcher::detach() {
+  std::unique_lock<std::mutex> lk(mMutex);
+  clearCallbacks();
+  mOpened = 0;
+  lk.unlock();
+  unref();
+}
+
+// Called on the environment's thread once the function was released, or when the environment is
+// torn down, in which case the watcher may still be alive and must stop calling it.
+void Watcher::onFinalize(napi_env env, void *data, void *hint) {
+  WatcherHandle *handle = (WatcherHandle *)data;
+  Watcher *watcher = handle->watcher;
+  if (watcher) {
+    std::lock_guard<std::mutex> l(watcher->mFiredMutex);
+    watcher->mTsfn = nullptr;
+    watcher->mHandle = nullptr;
+    watcher->mFiredCond.notify_all();
+  }
+
+  delete handle;
+}
+
+void Watcher::addSubscriber(Watcher *watcher) {
+  std::lock_guard<std::mutex> lock(mSubscribersMutex);
+  mSubscribers.push_back(watcher);
+}
+
+bool Watcher::removeSubscriber(Watcher *watcher) {
+  std::lock_guard<std::mutex> lock(mSubscribersMutex);
+  auto found = std::find(mSubscribers.begin(), mSubscribers.end(), watcher);
+  if (found == mSubscribers.end()) {
+    return false;
+  }
+
+  mSubscribers.erase(found);
+  return true;
+}
+
+bool Watcher::hasSubscriber(Watcher *watcher) {
+  std::lock_guard<std::mutex> lock(mSubscribersMutex);
+  return std::find(mSubscribers.begin(), mSubscribers.end(), watcher) != mSubscribers.end();
+}
+
+bool Watcher::hasSubscribers() {
+  std::lock_guard<std::mutex> lock(mSubscribersMutex);
+  return !mSubscribers.empty();
+}
+
+std::vector<Watcher *> Watcher::getSubscribers() {
+  std::lock_guard<std::mutex> lock(mSubscribersMutex);
+  return mSubscribers;
 }
 
 bool Watcher::isIgnored(std::string path) {
-  for (auto it = mIgnorePaths.begin(); it != mIgnorePaths.end(); it++) {
+  // Paths outside of the subpath a query is restricted to are skipped like ignored ones.
+  if (!mSubpath.empty() && path != mSubpath && path.compare(0, mSubpath.size() + 1, mSubpath + DIR_SEP) != 0) {
+    return true;
+  }
+
+  return isIgnored(path, mIgnorePaths, mIgnoreGlobs);
+}
+
+// Whether the path is ignored by the given ignore sets rather than the watcher's own, e.g. the
+// ones it had before they were updated. Globs are matched relative to the watcher's directory.
+bool Watcher::isIgnored(const std::string &path, const std::unordered_set<std::string> &ignorePaths, const std::unordered_set<Glob> &ignoreGlobs) {
+  for (auto it = ignorePaths.begin(); it != ignorePaths.end(); it++) {
     auto dir = *it + DIR_SEP;
     if (*it == path || path.compare(0, dir.size(), dir) == 0) {
       return true;
@@ -215,7 +684,7 @@ bool Watcher::isIgnored(std::string path) {
 
   auto relativePath = path.substr(basePath.size());
 
-  for (auto it = mIgnoreGlobs.begin(); it != mIgnoreGlobs.end(); it++) {
+  for (auto it = ignoreGlobs.begin(); it != ignoreGlobs.end(); it++) {
     if (it->isIgnored(relativePath)) {
       return true;
     }
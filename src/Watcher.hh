@@ -2,8 +2,10 @@
 #define WATCHER_H
 
 #include <condition_variable>
+#include <memory>
 #include <unordered_set>
 #include <set>
+#include <map>
 #include <uv.h>
 #include <node_api.h>
 #include "Glob.hh"
@@ -14,49 +16,142 @@
 
 using namespace Napi;
 
-struct Watcher {
+// The name of the cookie files written to flush a subscription start with this (see Backend::flush).
+#define COOKIE_PREFIX ".watcher-cookie-"
+
+// Which of a watcher's events a callback is called with. The default filter passes all of them.
+struct EventFilter {
+  bool create = true;
+  bool update = true;
+  bool remove = true;
+  bool directories = true;
+  // Matched against paths relative to the watcher's directory. Empty to include every path.
+  std::unordered_set<Glob> includeGlobs;
+
+  bool isAll() const {
+    return create && update && remove && directories && includeGlobs.empty();
+  }
+};
+
+struct AddonData;
+struct WatcherHandle;
+
+struct Watcher : public std::enable_shared_from_this<Watcher> {
   std::string mDir;
+  // The part of the directory a query is restricted to, or empty for all of it.
+  // Not part of the watcher's identity, so it must not be set on shared watchers.
+  std::string mSubpath;
   std::unordered_set<std::string> mIgnorePaths;
   std::unordered_set<Glob> mIgnoreGlobs;
+  // The events of the paths matching these are delivered right away, rather than batched
+  // with the others until the debounce fires.
+  std::unordered_set<Glob> mImmediateGlobs;
+  // The file the subscription's tree is persisted to, if any. Set by Backend::watch and read by
+  // the backend with the root's mutex held.
+  std::string mCachePath;
   EventList mEvents;
   void *state;
+  // Whether the watcher has a threadsafe function to call its callbacks through.
   bool mWatched;
+  bool mLiveSourced;
+  // The environment's watchers this one is shared in, if any. See Watcher::getShared.
+  AddonData *mAddonData;
 
   Watcher(std::string dir, std::unordered_set<std::string> ignorePaths, std::unordered_set<Glob> ignoreGlobs);
   ~Watcher();
 
   bool operator==(const Watcher &other) const {
-    return mDir == other.mDir && mIgnorePaths == other.mIgnorePaths && mIgnoreGlobs == other.mIgnoreGlobs;
+    return mDir == other.mDir && mIgnorePaths == other.mIgnorePaths && mIgnoreGlobs == other.mIgnoreGlobs && mImmediateGlobs == other.mImmediateGlobs;
   }
 
   void wait();
   void notify();
   void notifyError(std::exception &err);
-  bool watch(FunctionReference callback);
-  bool unwatch(Function callback);
+  bool watch(FunctionReference callback, EventFilter filter = EventFilter());
+  bool unwatch(Function callback, bool *isLast, std::vector<Event> *pending = nullptr);
+  bool hasCallback(Function callback, bool *isOnly = nullptr);
+  bool pause(Function callback, bool *wasPaused = nullptr);
+  bool resume(Function callback);
+  void open(Env env);
+  void close();
+  void detach();
   void unref();
   bool isIgnored(std::string path);
+  bool isIgnored(const std::string &path, const std::unordered_set<std::string> &ignorePaths, const std::unordered_set<Glob> &ignoreGlobs);
+  void addSubscriber(Watcher *watcher);
+  bool removeSubscriber(Watcher *watcher);
+  bool hasSubscriber(Watcher *watcher);
+  bool hasSubscribers();
+  std::vector<Watcher *> getSubscribers();
+  void addCookie(const std::string &path);
+  bool waitForCookie(const std::string &path, std::chrono::milliseconds timeout);
+  void flush();
 
-  static std::shared_ptr<Watcher> getShared(std::string dir, std::unordered_set<std::string> ignorePaths, std::unordered_set<Glob> ignoreGlobs);
+  static std::shared_ptr<Watcher> getShared(Env env, std::string dir, std::unordered_set<std::string> ignorePaths, std::unordered_set<Glob> ignoreGlobs, std::unordered_set<Glob> immediateGlobs = std::unordered_set<Glob>());
 
 private:
   std::mutex mMutex;
   std::mutex mCallbackEventsMutex;
   std::condition_variable mCond;
-  uv_async_t *mAsync;
+  // The callbacks are called through a threadsafe function of the environment they belong to,
+  // which is created on its thread by open. mOpened counts the subscriptions being made, which
+  // keep the function open until they have added their callback.
+  napi_threadsafe_function mTsfn;
+  WatcherHandle *mHandle;
+  int mOpened;
   std::set<FunctionReference> mCallbacks;
   std::set<FunctionReference>::iterator mCallbacksIterator;
   bool mCallingCallbacks;
-  std::vector<Event> mCallbackEvents;
+  std::vector<std::vector<Event>> mCallbackBatches;
+  // The net changes held back for paused callbacks, and for resumed ones until they're next
+  // called. Guarded by mCallbackEventsMutex.
+  std::map<const FunctionReference *, std::shared_ptr<EventList>> mPaused;
+  std::map<const FunctionReference *, std::shared_ptr<EventList>> mResumed;
+  // The filters of the callbacks that don't take every event. Guarded by mCallbackEventsMutex.
+  std::map<const FunctionReference *, EventFilter> mFilters;
   std::shared_ptr<Debounce> mDebounce;
   Signal mCallbackSignal;
   std::string mError;
+  // The watchers that receive the events of this one, when it is the core watcher of a root
+  // (see Backend::watch).
+  std::mutex mSubscribersMutex;
+  std::vector<Watcher *> mSubscribers;
+
+  // The cookies being waited for, and whether the backend reported them yet.
+  std::mutex mCookiesMutex;
+  std::condition_variable mCookiesCond;
+  std::unordered_map<std::string, bool> mCookies;
+  // How many times the callbacks were triggered, and up to which trigger they were called, so
+  // flush can wait for the callbacks to be called with the events it triggered them with.
+  std::mutex mFiredMutex;
+  std::condition_variable mFiredCond;
+  uint64_t mTriggered = 0;
+  uint64_t mFired = 0;
 
-  Value callbackEventsToJS(const Env& env);
+  void forwardEvents();
+  bool hasActiveCallbacks();
+  bool matchesGlobs(const std::string &path, const std::unordered_set<Glob> &globs);
+  bool matchesFilter(const EventFilter &filter, const Event &event);
+  bool triggerImmediateCallbacks();
+  void sendCallbackEvents(std::vector<Event> events);
+  bool holdEvents(const FunctionReference *callback, const std::vector<Event> &batch, std::vector<Event> &events);
+  Value callbackEventsToJS(const Env& env, std::vector<Event> &events);
   void clearCallbacks();
   void triggerCallbacks();
-  static void fireCallbacks(uv_async_t *handle);
-  static void onClose(uv_handle_t *handle);
+  static void fireCallbacks(napi_env env, napi_value callback, void *context, void *data);
+  static void onFinalize(napi_env env, void *data, void *hint);
+};
+
+struct WatcherHash {
+  std::size_t operator() (std::shared_ptr<Watcher> const &k) const {
+    return std::hash<std::string>()(k->mDir);
+  }
+};
+
+struct WatcherCompare {
+  size_t operator() (std::shared_ptr<Watcher> const &a, std::shared_ptr<Watcher> const &b) const {
+    return *a == *b;
+  }
 };
 
 class WatcherError : public std::runtime_error {
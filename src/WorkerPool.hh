@@ -0,0 +1,89 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+#define DEFAULT_WORKER_POOL_SIZE 4
+
+// The threads running the watcher's operations, e.g. crawls, snapshots and subscribing. These
+// can take seconds on large directories, so they don't run on libuv's thread pool, where they
+// would hold up the fs and dns operations of the rest of the process. Threads are started on
+// demand up to the pool's size, and are shared by all operations, including the parts of them
+// that run in parallel (see parallelFor).
+class WorkerPool {
+public:
+  static WorkerPool &getShared() {
+    // Never destroyed, as detached threads may still be waiting on it at exit.
+    static WorkerPool *pool = new WorkerPool(DEFAULT_WORKER_POOL_SIZE);
+    return *pool;
+  }
+
+  WorkerPool(size_t size) : mSize(size), mThreads(0), mIdle(0) {}
+
+  // Threads beyond a smaller size exit once they finish their current task.
+  void setSize(size_t size) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mSize = size;
+    mCond.notify_all();
+  }
+
+  size_t size() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    return mSize;
+  }
+
+  void run(std::function<void()> task) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mTasks.push_back(std::move(task));
+    if (mTasks.size() > mIdle && mThreads < mSize) {
+      try {
+        std::thread(&WorkerPool::work, this).detach();
+        mThreads++;
+        return;
+      } catch (std::system_error &err) {
+        // The existing threads will get to the task eventually, unless there are none.
+        if (mThreads == 0) {
+          mTasks.pop_back();
+          throw;
+        }
+      }
+    }
+
+    mCond.notify_one();
+  }
+
+private:
+  std::mutex mMutex;
+  std::condition_variable mCond;
+  std::deque<std::function<void()>> mTasks;
+  size_t mSize;
+  size_t mThreads;
+  size_t mIdle;
+
+  void work() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mThreads <= mSize) {
+      if (mTasks.empty()) {
+        mIdle++;
+        mCond.wait(lock);
+        mIdle--;
+        continue;
+      }
+
+      auto task = std::move(mTasks.front());
+      mTasks.pop_front();
+      lock.unlock();
+      task();
+      lock.lock();
+    }
+
+    mThreads--;
+  }
+};
+
+#endif
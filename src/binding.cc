@@ -1,5 +1,7 @@
 #include <unordered_set>
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <napi.h>
 #include <node_api.h>
 #include "Glob.hh"
@@ -7,9 +9,17 @@
 #include "Backend.hh"
 #include "Watcher.hh"
 #include "PromiseRunner.hh"
+#include "WorkerPool.hh"
+#include "SnapshotHandle.hh"
+#include "AddonData.hh"
+#include "AtomicFile.hh"
+#include "Parallel.hh"
+#include "shared/BruteForceBackend.hh"
 
 using namespace Napi;
 
+#define DEFAULT_COMPACTION_RATIO 0.5
+
 std::unordered_set<std::string> getIgnorePaths(Env env, Value opts) {
   std::unordered_set<std::string> result;
 
@@ -29,11 +39,11 @@ std::unordered_set<std::string> getIgnorePaths(Env env, Value opts) {
   return result;
 }
 
-std::unordered_set<Glob> getIgnoreGlobs(Env env, Value opts) {
+std::unordered_set<Glob> getGlobs(Env env, Value opts, const char *key) {
   std::unordered_set<Glob> result;
   
   if (opts.IsObject()) {
-    Value v = opts.As<Object>().Get(String::New(env, "ignoreGlobs"));
+    Value v = opts.As<Object>().Get(String::New(env, key));
     if (v.IsArray()) {
       Array items = v.As<Array>();
       for (size_t i = 0; i < items.Length(); i++) {
@@ -49,6 +59,104 @@ std::unordered_set<Glob> getIgnoreGlobs(Env env, Value opts) {
   return result;
 }
 
+std::unordered_set<Glob> getIgnoreGlobs(Env env, Value opts) {
+  return getGlobs(env, opts, "ignoreGlobs");
+}
+
+std::unordered_set<Glob> getImmediateGlobs(Env env, Value opts) {
+  return getGlobs(env, opts, "immediateGlobs");
+}
+
+EventFilter getEventFilter(Env env, Value opts) {
+  EventFilter result;
+  if (!opts.IsObject()) {
+    return result;
+  }
+
+  Object obj = opts.As<Object>();
+  Value types = obj.Get(String::New(env, "types"));
+  if (types.IsArray()) {
+    result.create = result.update = result.remove = false;
+    Array items = types.As<Array>();
+    for (size_t i = 0; i < items.Length(); i++) {
+      Value item = items.Get(Number::New(env, i));
+      if (!item.IsString()) {
+        continue;
+      }
+
+      std::string type = item.As<String>().Utf8Value();
+      result.create = result.create || type == "create";
+      result.update = result.update || type == "update";
+      result.remove = result.remove || type == "delete";
+    }
+  }
+
+  Value directories = obj.Get(String::New(env, "directories"));
+  result.directories = !directories.IsBoolean() || directories.As<Boolean>().Value();
+  result.includeGlobs = getGlobs(env, opts, "includeGlobs");
+  return result;
+}
+
+SnapshotOptions getSnapshotOptions(Env env, Value opts) {
+  SnapshotOptions result;
+  Object obj = opts.As<Object>();
+
+  Value compact = obj.Get(String::New(env, "compact"));
+  result.compact = compact.IsBoolean() && compact.As<Boolean>().Value();
+
+  Value hash = obj.Get(String::New(env, "hash"));
+  result.hash = hash.IsBoolean() && hash.As<Boolean>().Value();
+
+  // The size the journal may grow to relative to the snapshot itself before they are compacted.
+  Value journal = obj.Get(String::New(env, "journal"));
+  if (journal.IsNumber()) {
+    result.compactionRatio = journal.As<Number>().DoubleValue();
+  } else if (journal.IsBoolean() && journal.As<Boolean>().Value()) {
+    result.compactionRatio = DEFAULT_COMPACTION_RATIO;
+  }
+
+  return result;
+}
+
+// The part of the directory a query is restricted to, or an empty string for all of it.
+// Subpaths are resolved to absolute paths by the JS side.
+std::string getSubpath(Env env, const std::string &dir, Value opts) {
+  if (!opts.IsObject()) {
+    return std::string();
+  }
+
+  Value v = opts.As<Object>().Get(String::New(env, "subpath"));
+  if (!v.IsString()) {
+    return std::string();
+  }
+
+  std::string subpath = std::string(v.As<String>().Utf8Value().c_str());
+  return subpath == dir ? std::string() : subpath;
+}
+
+bool isValidSubpath(Env env, Value dir, Value opts) {
+  std::string d = std::string(dir.As<String>().Utf8Value().c_str());
+  std::string subpath = getSubpath(env, d, opts);
+  return subpath.empty() || subpath.compare(0, d.size() + 1, d + DIR_SEP) == 0;
+}
+
+// The signal option is optional, but must look like an AbortSignal when given. Only
+// `aborted` and `addEventListener` are required so that polyfills work on Node
+// versions without a global AbortController.
+bool isValidAbortSignal(Env env, Value opts) {
+  if (!opts.IsObject()) {
+    return true;
+  }
+
+  Value signal = opts.As<Object>().Get(String::New(env, "signal"));
+  if (signal.IsUndefined()) {
+    return true;
+  }
+
+  return signal.IsObject()
+    && signal.As<Object>().Get(String::New(env, "addEventListener")).IsFunction();
+}
+
 std::shared_ptr<Backend> getBackend(Env env, Value opts) {
   Value b = opts.As<Object>().Get(String::New(env, "backend"));
   std::string backendName;
@@ -59,16 +167,33 @@ std::shared_ptr<Backend> getBackend(Env env, Value opts) {
   return Backend::getShared(backendName);
 }
 
+Value eventsSinceToJS(Env env, Watcher &watcher) {
+  Array eventsArray = watcher.mEvents.toJS(env);
+
+  // Tag whether the events were computed from a live subscription's tree rather than a crawl.
+  // The property is not enumerable so the result still compares equal to a plain array.
+  eventsArray.DefineProperty(
+    PropertyDescriptor::Value("live", Boolean::New(env, watcher.mLiveSourced))
+  );
+  return eventsArray;
+}
+
 class WriteSnapshotRunner : public PromiseRunner {
 public:
   WriteSnapshotRunner(Env env, Value dir, Value snap, Value opts)
     : PromiseRunner(env),
-      snapshotPath(std::string(snap.As<String>().Utf8Value().c_str())) {
-    watcher = Watcher::getShared(
-      std::string(dir.As<String>().Utf8Value().c_str()),
-      getIgnorePaths(env, opts),
-      getIgnoreGlobs(env, opts)
-    );
+      snapshotPath(std::string(snap.As<String>().Utf8Value().c_str())),
+      options(getSnapshotOptions(env, opts)) {
+    std::string d = std::string(dir.As<String>().Utf8Value().c_str());
+    std::string subpath = getSubpath(env, d, opts);
+
+    // The subpath is specific to this query, so the watcher can't be shared then.
+    if (subpath.empty()) {
+      watcher = Watcher::getShared(env, d, getIgnorePaths(env, opts), getIgnoreGlobs(env, opts));
+    } else {
+      watcher = std::make_shared<Watcher>(d, getIgnorePaths(env, opts), getIgnoreGlobs(env, opts));
+      watcher->mSubpath = subpath;
+    }
 
     backend = getBackend(env, opts);
   }
@@ -81,9 +206,10 @@ private:
   std::shared_ptr<Backend> backend;
   std::shared_ptr<Watcher> watcher;
   std::string snapshotPath;
+  SnapshotOptions options;
 
   void execute() override {
-    backend->writeSnapshot(*watcher, &snapshotPath);
+    backend->writeSnapshotFile(*watcher, &snapshotPath, options);
   }
 };
 
@@ -98,6 +224,8 @@ public:
       getIgnoreGlobs(env, opts)
     );
 
+    watcher->mSubpath = getSubpath(env, watcher->mDir, opts);
+
     backend = getBackend(env, opts);
   }
 
@@ -115,16 +243,377 @@ private:
   }
 
   Value getResult() override {
-    std::vector<Event> events = watcher->mEvents.getEvents();
-    Array eventsArray = Array::New(env, events.size());
-    size_t i = 0;
-    for (auto it = events.begin(); it != events.end(); it++) {
-      eventsArray.Set(i++, it->toJS(env));
+    return eventsSinceToJS(env, *watcher);
+  }
+};
+
+class UpdateSnapshotRunner : public PromiseRunner {
+public:
+  UpdateSnapshotRunner(Env env, Value dir, Value snap, Value opts)
+    : PromiseRunner(env),
+      snapshotPath(std::string(snap.As<String>().Utf8Value().c_str())) {
+    watcher = std::make_shared<Watcher>(
+      std::string(dir.As<String>().Utf8Value().c_str()),
+      getIgnorePaths(env, opts),
+      getIgnoreGlobs(env, opts)
+    );
+
+    watcher->mSubpath = getSubpath(env, watcher->mDir, opts);
+
+    backend = getBackend(env, opts);
+  }
+
+  ~UpdateSnapshotRunner() {
+    watcher->unref();
+    backend->unref();
+  }
+private:
+  std::shared_ptr<Backend> backend;
+  std::shared_ptr<Watcher> watcher;
+  std::string snapshotPath;
+
+  void execute() override {
+    backend->updateSnapshot(*watcher, &snapshotPath);
+  }
+
+  Value getResult() override {
+    return eventsSinceToJS(env, *watcher);
+  }
+};
+
+class HasChangedRunner : public PromiseRunner {
+public:
+  HasChangedRunner(Env env, Value dir, Value snap, Value opts)
+    : PromiseRunner(env),
+      snapshotPath(std::string(snap.As<String>().Utf8Value().c_str())),
+      changed(false) {
+    watcher = std::make_shared<Watcher>(
+      std::string(dir.As<String>().Utf8Value().c_str()),
+      getIgnorePaths(env, opts),
+      getIgnoreGlobs(env, opts)
+    );
+
+    watcher->mSubpath = getSubpath(env, watcher->mDir, opts);
+
+    backend = getBackend(env, opts);
+  }
+
+  ~HasChangedRunner() {
+    watcher->unref();
+    backend->unref();
+  }
+private:
+  std::shared_ptr<Backend> backend;
+  std::shared_ptr<Watcher> watcher;
+  std::string snapshotPath;
+  bool changed;
+
+  void execute() override {
+    changed = backend->hasChanged(*watcher, &snapshotPath);
+  }
+
+  Value getResult() override {
+    return Boolean::New(env, changed);
+  }
+};
+
+class GetEventsSinceHandleRunner : public PromiseRunner {
+public:
+  GetEventsSinceHandleRunner(Env env, Value dir, Value snap, Value opts)
+    : PromiseRunner(env),
+      snapshot(SnapshotHandle::getTree(snap)) {
+    watcher = std::make_shared<Watcher>(
+      std::string(dir.As<String>().Utf8Value().c_str()),
+      getIgnorePaths(env, opts),
+      getIgnoreGlobs(env, opts)
+    );
+
+    backend = getBackend(env, opts);
+  }
+
+  ~GetEventsSinceHandleRunner() {
+    watcher->unref();
+    backend->unref();
+  }
+private:
+  std::shared_ptr<Backend> backend;
+  std::shared_ptr<Watcher> watcher;
+  std::shared_ptr<DirTree> snapshot;
+
+  void execute() override {
+    // Diffing a snapshot of another directory would report all of both as changed.
+    if (snapshot->root != watcher->mDir) {
+      throw std::runtime_error("The snapshot was captured from " + snapshot->root + ", not " + watcher->mDir);
+    }
+
+    auto now = backend->getSnapshotTree(*watcher);
+    now->getChanges(snapshot.get(), watcher->mEvents);
+  }
+
+  Value getResult() override {
+    return eventsSinceToJS(env, *watcher);
+  }
+};
+
+class CaptureSnapshotRunner : public PromiseRunner {
+public:
+  CaptureSnapshotRunner(Env env, Value dir, Value opts) : PromiseRunner(env) {
+    watcher = std::make_shared<Watcher>(
+      std::string(dir.As<String>().Utf8Value().c_str()),
+      getIgnorePaths(env, opts),
+      getIgnoreGlobs(env, opts)
+    );
+
+    backend = getBackend(env, opts);
+  }
+
+  ~CaptureSnapshotRunner() {
+    watcher->unref();
+    backend->unref();
+  }
+private:
+  std::shared_ptr<Backend> backend;
+  std::shared_ptr<Watcher> watcher;
+  std::shared_ptr<DirTree> tree;
+
+  void execute() override {
+    tree = backend->getSnapshotTree(*watcher);
+  }
+
+  Value getResult() override {
+    return SnapshotHandle::create(env, tree);
+  }
+};
+
+class DiffSnapshotsRunner : public PromiseRunner {
+public:
+  DiffSnapshotsRunner(Env env, Value before, Value after, Value opts)
+    : PromiseRunner(env),
+      beforePath(std::string(before.As<String>().Utf8Value().c_str())),
+      afterPath(std::string(after.As<String>().Utf8Value().c_str())) {
+    // The directory isn't known until the snapshots are read.
+    watcher = std::make_shared<Watcher>(
+      std::string(),
+      getIgnorePaths(env, opts),
+      getIgnoreGlobs(env, opts)
+    );
+  }
+
+  ~DiffSnapshotsRunner() {
+    watcher->unref();
+  }
+private:
+  std::shared_ptr<Watcher> watcher;
+  std::string beforePath;
+  std::string afterPath;
+
+  void execute() override {
+    std::ifstream beforeStream(beforePath, std::ios::binary);
+    if (beforeStream.fail()) {
+      throw std::runtime_error("Unable to open snapshot file: " + beforePath);
+    }
+
+    std::ifstream afterStream(afterPath, std::ios::binary);
+    if (afterStream.fail()) {
+      throw std::runtime_error("Unable to open snapshot file: " + afterPath);
+    }
+
+    SnapshotReader before(beforeStream);
+    std::ifstream beforeJournal(SnapshotReader::journalPath(beforePath), std::ios::binary);
+    before.applyJournal(beforeJournal);
+
+    SnapshotReader after(afterStream);
+    std::ifstream afterJournal(SnapshotReader::journalPath(afterPath), std::ios::binary);
+    after.applyJournal(afterJournal);
+
+    watcher->mDir = after.root.empty() ? before.root : after.root;
+
+    Watcher *w = watcher.get();
+    DirTree::getChanges(before, after, watcher->mEvents, [w] (const std::string &path) {
+      return w->isIgnored(path);
+    });
+  }
+
+  Value getResult() override {
+    return watcher->mEvents.toJS(env);
+  }
+};
+
+// Runners for several directories at once. The directories are read in parallel within a single
+// job, and their snapshots are kept together in a single container file. The ignore sets of each
+// directory come from its own options, if given, as relative paths resolve to different ones.
+class BatchRunner : public PromiseRunner {
+public:
+  BatchRunner(Env env, Value dirs, Value snap, Value opts, Value dirOpts)
+    : PromiseRunner(env),
+      snapshotPath(std::string(snap.As<String>().Utf8Value().c_str())) {
+    Array items = dirs.As<Array>();
+    for (uint32_t i = 0; i < items.Length(); i++) {
+      Value o = dirOpts.IsArray() ? dirOpts.As<Array>().Get(i) : opts;
+      watchers.push_back(std::make_shared<Watcher>(
+        std::string(items.Get(i).As<String>().Utf8Value().c_str()),
+        getIgnorePaths(env, o),
+        getIgnoreGlobs(env, o)
+      ));
+    }
+
+    backend = getBackend(env, opts);
+  }
+
+  ~BatchRunner() {
+    for (auto it = watchers.begin(); it != watchers.end(); it++) {
+      (*it)->unref();
+    }
+
+    backend->unref();
+  }
+protected:
+  std::shared_ptr<Backend> backend;
+  std::vector<std::shared_ptr<Watcher>> watchers;
+  std::string snapshotPath;
+};
+
+class BatchWriteSnapshotRunner : public BatchRunner {
+public:
+  BatchWriteSnapshotRunner(Env env, Value dirs, Value snap, Value opts, Value dirOpts)
+    : BatchRunner(env, dirs, snap, opts, dirOpts),
+      options(getSnapshotOptions(env, opts)) {}
+
+private:
+  SnapshotOptions options;
+
+  void execute() override {
+    auto trees = backend->getSnapshotTrees(watchers);
+
+    // Hashes are reused from the previous container, like for a single snapshot.
+    std::unique_ptr<SnapshotContainer> previous;
+    std::ifstream ifs(snapshotPath, std::ios::binary);
+    if (options.hash && !ifs.fail()) {
+      previous.reset(new SnapshotContainer(ifs));
+    }
+
+    std::vector<std::string> roots(trees.size());
+    std::vector<std::string> snapshots(trees.size());
+    parallelFor(trees.size(), 1, [&] (size_t i) {
+      uint64_t offset;
+      if (previous && previous->find(trees[i]->root, offset)) {
+        std::ifstream stream(snapshotPath, std::ios::binary);
+        stream.seekg(offset);
+        SnapshotReader snapshot(stream);
+        trees[i]->computeHashes(&snapshot);
+      } else if (options.hash) {
+        trees[i]->computeHashes(nullptr);
+      }
+
+      std::ostringstream os;
+      trees[i]->write(os, 0, options);
+      roots[i] = trees[i]->root;
+      snapshots[i] = os.str();
+    });
+
+    ifs.close();
+    writeFileAtomic(snapshotPath, [&roots, &snapshots](std::ostream &os) {
+      SnapshotContainer::write(os, roots, snapshots);
+    });
+  }
+};
+
+class BatchGetEventsSinceRunner : public BatchRunner {
+public:
+  BatchGetEventsSinceRunner(Env env, Value dirs, Value snap, Value opts, Value dirOpts)
+    : BatchRunner(env, dirs, snap, opts, dirOpts) {}
+
+private:
+  void execute() override {
+    std::ifstream ifs(snapshotPath, std::ios::binary);
+    if (ifs.fail()) {
+      return;
+    }
+
+    SnapshotContainer container(ifs);
+    auto trees = backend->getSnapshotTrees(watchers);
+
+    // Directories missing from the container have no events, like a missing snapshot file.
+    parallelFor(trees.size(), 1, [&] (size_t i) {
+      uint64_t offset;
+      if (container.find(trees[i]->root, offset)) {
+        std::ifstream stream(snapshotPath, std::ios::binary);
+        stream.seekg(offset);
+        SnapshotReader snapshot(stream);
+        trees[i]->getChanges(snapshot, watchers[i]->mEvents);
+      }
+    });
+  }
+
+  Value getResult() override {
+    Array result = Array::New(env, watchers.size());
+    for (size_t i = 0; i < watchers.size(); i++) {
+      result.Set(i, eventsSinceToJS(env, *watchers[i]));
     }
-    return eventsArray;
+
+    return result;
   }
 };
 
+template<class Runner>
+Value queueBatchWork(const CallbackInfo& info) {
+  Env env = info.Env();
+  bool isValid = info.Length() >= 1 && info[0].IsArray();
+  if (isValid) {
+    Array dirs = info[0].As<Array>();
+    for (uint32_t i = 0; i < dirs.Length() && isValid; i++) {
+      isValid = dirs.Get(i).IsString();
+    }
+  }
+
+  if (!isValid) {
+    TypeError::New(env, "Expected an array of strings").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  if (info.Length() < 2 || !info[1].IsString()) {
+    TypeError::New(env, "Expected a string").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  if (info.Length() >= 3 && !info[2].IsObject()) {
+    TypeError::New(env, "Expected an object").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  if (info.Length() >= 3 && !isValidAbortSignal(env, info[2])) {
+    TypeError::New(env, "Expected signal to be an AbortSignal").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  if (info.Length() >= 4 && !info[3].IsUndefined()) {
+    isValid = info[3].IsArray() && info[3].As<Array>().Length() == info[0].As<Array>().Length();
+    if (isValid) {
+      Array dirOpts = info[3].As<Array>();
+      for (uint32_t i = 0; i < dirOpts.Length() && isValid; i++) {
+        isValid = dirOpts.Get(i).IsObject();
+      }
+    }
+
+    if (!isValid) {
+      TypeError::New(env, "Expected an array of objects for each directory").ThrowAsJavaScriptException();
+      return env.Null();
+    }
+  }
+
+  Runner *runner = new Runner(info.Env(), info[0], info[1], info[2], info[3]);
+  runner->setAbortSignal(info[2]);
+  return runner->queue();
+}
+
+Value batchWriteSnapshot(const CallbackInfo& info) {
+  return queueBatchWork<BatchWriteSnapshotRunner>(info);
+}
+
+Value batchGetEventsSince(const CallbackInfo& info) {
+  return queueBatchWork<BatchGetEventsSinceRunner>(info);
+}
+
 template<class Runner>
 Value queueSnapshotWork(const CallbackInfo& info) {
   Env env = info.Env();
@@ -143,39 +632,141 @@ Value queueSnapshotWork(const CallbackInfo& info) {
     return env.Null();
   }
 
+  if (info.Length() >= 3 && !isValidAbortSignal(env, info[2])) {
+    TypeError::New(env, "Expected signal to be an AbortSignal").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
   Runner *runner = new Runner(info.Env(), info[0], info[1], info[2]);
+  runner->setAbortSignal(info[2]);
   return runner->queue();
 }
 
+template<class Runner>
+Value queueSubpathWork(const CallbackInfo& info) {
+  Env env = info.Env();
+  if (info.Length() >= 3 && info[0].IsString() && info[2].IsObject() && !isValidSubpath(env, info[0], info[2])) {
+    TypeError::New(env, "Expected subpath to be inside the directory").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  return queueSnapshotWork<Runner>(info);
+}
+
 Value writeSnapshot(const CallbackInfo& info) {
-  return queueSnapshotWork<WriteSnapshotRunner>(info);
+  return queueSubpathWork<WriteSnapshotRunner>(info);
 }
 
 Value getEventsSince(const CallbackInfo& info) {
-  return queueSnapshotWork<GetEventsSinceRunner>(info);
+  if (info.Length() >= 2 && SnapshotHandle::isHandle(info[1])) {
+    Env env = info.Env();
+    if (!info[0].IsString()) {
+      TypeError::New(env, "Expected a string").ThrowAsJavaScriptException();
+      return env.Null();
+    }
+
+    if (info.Length() >= 3 && !info[2].IsObject()) {
+      TypeError::New(env, "Expected an object").ThrowAsJavaScriptException();
+      return env.Null();
+    }
+
+    if (info.Length() >= 3 && !isValidAbortSignal(env, info[2])) {
+      TypeError::New(env, "Expected signal to be an AbortSignal").ThrowAsJavaScriptException();
+      return env.Null();
+    }
+
+    GetEventsSinceHandleRunner *runner = new GetEventsSinceHandleRunner(env, info[0], info[1], info[2]);
+    runner->setAbortSignal(info[2]);
+    return runner->queue();
+  }
+
+  return queueSubpathWork<GetEventsSinceRunner>(info);
+}
+
+Value updateSnapshot(const CallbackInfo& info) {
+  return queueSubpathWork<UpdateSnapshotRunner>(info);
+}
+
+Value hasChanged(const CallbackInfo& info) {
+  return queueSubpathWork<HasChangedRunner>(info);
+}
+
+Value diffSnapshots(const CallbackInfo& info) {
+  return queueSnapshotWork<DiffSnapshotsRunner>(info);
+}
+
+Value captureSnapshot(const CallbackInfo& info) {
+  Env env = info.Env();
+  if (info.Length() < 1 || !info[0].IsString()) {
+    TypeError::New(env, "Expected a string").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  if (info.Length() >= 2 && !info[1].IsObject()) {
+    TypeError::New(env, "Expected an object").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  if (info.Length() >= 2 && !isValidAbortSignal(env, info[1])) {
+    TypeError::New(env, "Expected signal to be an AbortSignal").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  CaptureSnapshotRunner *runner = new CaptureSnapshotRunner(env, info[0], info[1]);
+  runner->setAbortSignal(info[1]);
+  return runner->queue();
 }
 
 class SubscribeRunner : public PromiseRunner {
 public:
   SubscribeRunner(Env env, Value dir, Value fn, Value opts) : PromiseRunner(env) {
     watcher = Watcher::getShared(
+      env,
       std::string(dir.As<String>().Utf8Value().c_str()),
       getIgnorePaths(env, opts),
-      getIgnoreGlobs(env, opts)
+      getIgnoreGlobs(env, opts),
+      getImmediateGlobs(env, opts)
     );
 
     backend = getBackend(env, opts);
     callback = Persistent(fn.As<Function>());
+    filter = getEventFilter(env, opts);
+    watcher->open(env);
+
+    Value cache = opts.As<Object>().Get(String::New(env, "cache"));
+    if (cache.IsString()) {
+      cachePath = std::string(cache.As<String>().Utf8Value().c_str());
+    }
+
+    // Only the initial crawl can be aborted, not the subscription once it's established.
+    setAbortSignal(opts);
+  }
+
+  // The subscription keeps the watcher and backend, unless it was never made, e.g. when it
+  // was aborted before it started.
+  ~SubscribeRunner() {
+    watcher->close();
+    if (!subscribed) {
+      watcher->unref();
+      backend->unref();
+    }
   }
 
 private:
   std::shared_ptr<Watcher> watcher;
   std::shared_ptr<Backend> backend;
   FunctionReference callback;
+  EventFilter filter;
+  std::string cachePath;
+  bool subscribed = false;
 
   void execute() override {
-    backend->watch(*watcher);
-    watcher->watch(std::move(callback));
+    backend->watch(*watcher, cachePath.empty() ? nullptr : &cachePath);
+    watcher->watch(std::move(callback), filter);
+    subscribed = true;
+
+    // Deliver the changes found since the cache was written, now that there is a callback.
+    watcher->notify();
   }
 };
 
@@ -183,13 +774,15 @@ class UnsubscribeRunner : public PromiseRunner {
 public:
   UnsubscribeRunner(Env env, Value dir, Value fn, Value opts) : PromiseRunner(env) {
     watcher = Watcher::getShared(
+      env,
       std::string(dir.As<String>().Utf8Value().c_str()),
       getIgnorePaths(env, opts),
-      getIgnoreGlobs(env, opts)
+      getIgnoreGlobs(env, opts),
+      getImmediateGlobs(env, opts)
     );
 
     backend = getBackend(env, opts);
-    shouldUnwatch = watcher->unwatch(fn.As<Function>());
+    watcher->unwatch(fn.As<Function>(), &shouldUnwatch);
   }
 
 private:
@@ -204,6 +797,148 @@ private:
   }
 };
 
+// Moves a subscription's callback to the watcher of its new ignore sets, and reports the paths it
+// starts or stops seeing as created or deleted. The new watcher is subscribed before the old one
+// is released, so the core keeps watching what both of them need throughout. Meanwhile the
+// callback stays on the old watcher, paused so that it isn't called twice, and the events held
+// back for it are handed to the new watcher once the callback is removed from the old one. If
+// the new watcher can't be subscribed, the old subscription is left as it was. Updating a
+// callback that isn't subscribed with the old options is rejected.
+class UpdateRunner : public PromiseRunner {
+public:
+  UpdateRunner(Env env, Value dir, Value fn, Value opts, Value newOpts) : PromiseRunner(env) {
+    std::string d = std::string(dir.As<String>().Utf8Value().c_str());
+    from = Watcher::getShared(env, d, getIgnorePaths(env, opts), getIgnoreGlobs(env, opts), getImmediateGlobs(env, opts));
+    to = Watcher::getShared(env, d, getIgnorePaths(env, newOpts), getIgnoreGlobs(env, newOpts), getImmediateGlobs(env, newOpts));
+    backend = getBackend(env, opts);
+
+    isFound = from->hasCallback(fn.As<Function>(), &shouldUnwatch);
+    if (isFound && from != to) {
+      previous = Persistent(fn.As<Function>());
+      callback = Persistent(fn.As<Function>());
+      filter = getEventFilter(env, newOpts);
+      to->open(env);
+      from->pause(fn.As<Function>(), &wasPaused);
+    }
+  }
+
+  // Called on the JS thread, which the callbacks are called on, once the new watcher was
+  // subscribed or failed to be.
+  ~UpdateRunner() {
+    if (!isFound) {
+      // Don't keep the watchers made for a subscription that doesn't exist.
+      from->unref();
+      to->unref();
+      backend->unref();
+      return;
+    }
+
+    if (from == to) {
+      return;
+    }
+
+    to->close();
+    if (!subscribed) {
+      if (!wasPaused) {
+        from->resume(previous.Value());
+      }
+
+      to->unref();
+      backend->unref();
+      return;
+    }
+
+    bool isLast;
+    std::vector<Event> pending;
+    from->unwatch(previous.Value(), &isLast, &pending);
+    for (auto it = pending.begin(); it != pending.end(); it++) {
+      if (!to->isIgnored(it->path)) {
+        to->mEvents.add(*it);
+      }
+    }
+
+    to->notify();
+
+    // Other callbacks of the old watcher were removed meanwhile, without unsubscribing it as this
+    // one was still there.
+    if (isLast && !shouldUnwatch) {
+      std::shared_ptr<Backend> b = backend;
+      std::shared_ptr<Watcher> w = from;
+      try {
+        WorkerPool::getShared().run([b, w] () {
+          try {
+            b->unwatch(*w);
+          } catch (std::exception &err) {}
+        });
+      } catch (std::system_error &err) {}
+    }
+  }
+
+private:
+  std::shared_ptr<Watcher> from;
+  std::shared_ptr<Watcher> to;
+  std::shared_ptr<Backend> backend;
+  FunctionReference previous;
+  FunctionReference callback;
+  EventFilter filter;
+  bool isFound = false;
+  bool wasPaused = false;
+  bool shouldUnwatch = false;
+  bool subscribed = false;
+
+  void execute() override {
+    if (!isFound) {
+      throw std::runtime_error("Not subscribed to " + from->mDir);
+    }
+
+    if (from == to) {
+      return;
+    }
+
+    backend->watch(*to);
+    to->watch(std::move(callback), filter);
+    subscribed = true;
+    backend->getIgnoreChanges(*from, *to);
+
+    // The events the old watcher got until now stay held back for the callback.
+    if (shouldUnwatch) {
+      backend->unwatch(*from);
+    }
+
+    to->notify();
+  }
+};
+
+// Waits for the events of the changes made so far in a directory, and calls the callbacks of its
+// subscriptions with them.
+class FlushRunner : public PromiseRunner {
+public:
+  FlushRunner(Env env, Value dir, Value opts) : PromiseRunner(env) {
+    watcher = Watcher::getShared(
+      env,
+      std::string(dir.As<String>().Utf8Value().c_str()),
+      getIgnorePaths(env, opts),
+      getIgnoreGlobs(env, opts),
+      getImmediateGlobs(env, opts)
+    );
+
+    backend = getBackend(env, opts);
+  }
+
+  ~FlushRunner() {
+    watcher->unref();
+    backend->unref();
+  }
+
+private:
+  std::shared_ptr<Watcher> watcher;
+  std::shared_ptr<Backend> backend;
+
+  void execute() override {
+    backend->flush(*watcher);
+  }
+};
+
 template<class Runner>
 Value queueSubscriptionWork(const CallbackInfo& info) {
   Env env = info.Env();
@@ -222,6 +957,11 @@ Value queueSubscriptionWork(const CallbackInfo& info) {
     return env.Null();
   }
 
+  if (info.Length() >= 3 && !isValidAbortSignal(env, info[2])) {
+    TypeError::New(env, "Expected signal to be an AbortSignal").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
   Runner *runner = new Runner(info.Env(), info[0], info[1], info[2]);
   return runner->queue();
 }
@@ -234,7 +974,140 @@ Value unsubscribe(const CallbackInfo& info) {
   return queueSubscriptionWork<UnsubscribeRunner>(info);
 }
 
+// Pausing and resuming only touch the watcher's callbacks, so unlike subscribing they're done
+// synchronously rather than on the worker pool.
+Value setPaused(const CallbackInfo& info, bool isPaused) {
+  Env env = info.Env();
+  if (info.Length() < 1 || !info[0].IsString()) {
+    TypeError::New(env, "Expected a string").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  if (info.Length() < 2 || !info[1].IsFunction()) {
+    TypeError::New(env, "Expected a function").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  if (info.Length() < 3 || !info[2].IsObject()) {
+    TypeError::New(env, "Expected an object").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  auto watcher = Watcher::getShared(
+    env,
+    std::string(info[0].As<String>().Utf8Value().c_str()),
+    getIgnorePaths(env, info[2]),
+    getIgnoreGlobs(env, info[2]),
+    getImmediateGlobs(env, info[2])
+  );
+
+  Function fn = info[1].As<Function>();
+  bool found = isPaused ? watcher->pause(fn) : watcher->resume(fn);
+  if (!found) {
+    // Don't keep the watcher made for a subscription that doesn't exist.
+    watcher->unref();
+  }
+
+  return Boolean::New(env, found);
+}
+
+Value pause(const CallbackInfo& info) {
+  return setPaused(info, true);
+}
+
+Value resume(const CallbackInfo& info) {
+  return setPaused(info, false);
+}
+
+Value update(const CallbackInfo& info) {
+  Env env = info.Env();
+  if (info.Length() < 1 || !info[0].IsString()) {
+    TypeError::New(env, "Expected a string").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  if (info.Length() < 2 || !info[1].IsFunction()) {
+    TypeError::New(env, "Expected a function").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  if (info.Length() < 4 || !info[2].IsObject() || !info[3].IsObject()) {
+    TypeError::New(env, "Expected an object").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  UpdateRunner *runner = new UpdateRunner(env, info[0], info[1], info[2], info[3]);
+  return runner->queue();
+}
+
+Value flush(const CallbackInfo& info) {
+  Env env = info.Env();
+  if (info.Length() < 1 || !info[0].IsString()) {
+    TypeError::New(env, "Expected a string").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  if (info.Length() < 2 || !info[1].IsObject()) {
+    TypeError::New(env, "Expected an object").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  FlushRunner *runner = new FlushRunner(env, info[0], info[1]);
+  return runner->queue();
+}
+
+Value setWorkerPoolSize(const CallbackInfo& info) {
+  Env env = info.Env();
+  if (info.Length() < 1 || !info[0].IsNumber() || info[0].As<Number>().Int64Value() < 1) {
+    TypeError::New(env, "Expected a positive number").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  WorkerPool::getShared().setSize(info[0].As<Number>().Int64Value());
+  return env.Undefined();
+}
+
+Value setCrawlTTL(const CallbackInfo& info) {
+  Env env = info.Env();
+  if (info.Length() < 1 || !info[0].IsNumber() || info[0].As<Number>().DoubleValue() < 0) {
+    TypeError::New(env, "Expected a non-negative number").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  BruteForceBackend::setCrawlTTL(info[0].As<Number>().Int64Value());
+  return env.Undefined();
+}
+
+Value setTreeCacheSize(const CallbackInfo& info) {
+  Env env = info.Env();
+  if (info.Length() < 1 || !info[0].IsNumber() || info[0].As<Number>().DoubleValue() < 0) {
+    TypeError::New(env, "Expected a non-negative number").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  DirTree::setCacheSize(info[0].As<Number>().Int64Value());
+  return env.Undefined();
+}
+
+// Unsubscribes an environment's watchers when it's torn down, e.g. when a worker thread exits,
+// so that the backends shared with the other environments stop delivering events to them.
+void finalizeAddonData(Env env, AddonData *data) {
+  // Every watcher is detached before any is unsubscribed, as a flush on another thread may hold
+  // on to the root while it waits for the callbacks of one of them.
+  std::vector<std::shared_ptr<Watcher>> watchers(data->watchers.begin(), data->watchers.end());
+  for (auto it = watchers.begin(); it != watchers.end(); it++) {
+    (*it)->detach();
+  }
+
+  for (auto it = watchers.begin(); it != watchers.end(); it++) {
+    Backend::unwatchAll(**it);
+  }
+
+  delete data;
+}
+
 Object Init(Env env, Object exports) {
+  env.SetInstanceData<AddonData, finalizeAddonData>(new AddonData());
   exports.Set(
     String::New(env, "writeSnapshot"),
     Function::New(env, writeSnapshot)
@@ -243,6 +1116,30 @@ Object Init(Env env, Object exports) {
     String::New(env, "getEventsSince"),
     Function::New(env, getEventsSince)
   );
+  exports.Set(
+    String::New(env, "updateSnapshot"),
+    Function::New(env, updateSnapshot)
+  );
+  exports.Set(
+    String::New(env, "hasChanged"),
+    Function::New(env, hasChanged)
+  );
+  exports.Set(
+    String::New(env, "diffSnapshots"),
+    Function::New(env, diffSnapshots)
+  );
+  exports.Set(
+    String::New(env, "batchWriteSnapshot"),
+    Function::New(env, batchWriteSnapshot)
+  );
+  exports.Set(
+    String::New(env, "batchGetEventsSince"),
+    Function::New(env, batchGetEventsSince)
+  );
+  exports.Set(
+    String::New(env, "captureSnapshot"),
+    Function::New(env, captureSnapshot)
+  );
   exports.Set(
     String::New(env, "subscribe"),
     Function::New(env, subscribe)
@@ -251,6 +1148,35 @@ Object Init(Env env, Object exports) {
     String::New(env, "unsubscribe"),
     Function::New(env, unsubscribe)
   );
+  exports.Set(
+    String::New(env, "update"),
+    Function::New(env, update)
+  );
+  exports.Set(
+    String::New(env, "pause"),
+    Function::New(env, pause)
+  );
+  exports.Set(
+    String::New(env, "resume"),
+    Function::New(env, resume)
+  );
+  exports.Set(
+    String::New(env, "flush"),
+    Function::New(env, flush)
+  );
+  exports.Set(
+    String::New(env, "setWorkerPoolSize"),
+    Function::New(env, setWorkerPoolSize)
+  );
+  exports.Set(
+    String::New(env, "setCrawlTTL"),
+    Function::New(env, setCrawlTTL)
+  );
+  exports.Set(
+    String::New(env, "setTreeCacheSize"),
+    Function::New(env, setTreeCacheSize)
+  );
+  SnapshotHandle::init(env, exports);
   return exports;
 }
 
@@ -61,33 +61,110 @@ InotifyBackend::~InotifyBackend() {
   mEndedSignal.wait();
 }
 
-// This function is called by Backend::watch which takes a lock on mMutex
+// This function is called by Backend::watch which takes a lock on the root's mutex.
 void InotifyBackend::subscribe(Watcher &watcher) {
-  // Build a full directory tree recursively, and watch each directory.
-  std::shared_ptr<DirTree> tree = getTree(watcher);
+  // Build a full directory tree recursively, and watch each directory. When the tree is seeded
+  // from the subscription's cache file, each directory is watched as soon as the revalidation
+  // confirms it still exists, and the changes found are emitted as the first events. Neither
+  // touches the subscriptions of other roots, so mMutex is only taken to register each watch.
+  std::shared_ptr<DirTree> cached = loadTreeCache(watcher);
+  std::shared_ptr<DirTree> tree = DirTree::getCached(watcher.mDir);
+  auto addWatch = [this, &watcher, &tree] (const std::string &path) {
+    this->addWatch(watcher, path, tree);
+  };
+
+  try {
+    tree = getTree(watcher, true, addWatch);
+
+    // Watch the directories that were crawled rather than revalidated, or created meanwhile and
+    // watched by the event handler already.
+    std::unordered_set<std::string> watched;
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      for (auto it = mSubscriptions.begin(); it != mSubscriptions.end(); it++) {
+        if (it->second->watcher == &watcher) {
+          watched.insert(it->second->path);
+        }
+      }
+    }
 
-  for (auto it = tree->entries.begin(); it != tree->entries.end(); it++) {
-    if (it->second.isDir) {
-      bool success = watchDir(watcher, it->second.path, tree);
-      if (!success) {
-        throw WatcherError(std::string("inotify_add_watch on '") + it->second.path + std::string("' failed: ") + strerror(errno), &watcher);
+    auto frozen = tree->freeze();
+    for (auto it = frozen->entries->begin(); it != frozen->entries->end(); it++) {
+      if (it->second.isDir && watched.count(it->second.path) == 0) {
+        addWatch(it->second.path);
       }
     }
+
+    if (cached) {
+      tree->getChanges(cached.get(), watcher.mEvents);
+    }
+
+    // Unless the cache was up to date already.
+    if (!cached || watcher.mEvents.size() > 0) {
+      writeTreeCache(watcher, tree);
+    }
+  } catch (...) {
+    removeSubscriptions(watcher);
+    throw;
   }
 }
 
-bool InotifyBackend::watchDir(Watcher &watcher, std::string path, std::shared_ptr<DirTree> tree) {
+// Applies new ignore sets to a subscription without watching the whole directory again: only the
+// directories that become ignored stop being watched, and only those that no longer are are read
+// and watched. Events for them are left to the caller, as the subscription's events are those of
+// the paths that changed on disk.
+// This function is called by Backend::watch and unwatch which take a lock on the root's mutex.
+bool InotifyBackend::updateIgnores(Watcher &watcher, std::unordered_set<std::string> ignorePaths, std::unordered_set<Glob> ignoreGlobs) {
+  std::shared_ptr<DirTree> tree = DirTree::getCached(watcher.mDir);
+  std::unordered_set<std::string> previousPaths;
+  std::unordered_set<Glob> previousGlobs;
+  {
+    // The event handler checks the ignore sets with mMutex held.
+    std::unique_lock<std::mutex> lock(mMutex);
+    previousPaths.swap(watcher.mIgnorePaths);
+    previousGlobs.swap(watcher.mIgnoreGlobs);
+    watcher.mIgnorePaths = ignorePaths;
+    watcher.mIgnoreGlobs = ignoreGlobs;
+  }
+
+  auto onHidden = [this, &watcher] (const std::string &path) {
+    removeSubscriptions(watcher, path);
+  };
+
+  auto onDir = [this, &watcher, &tree] (const std::string &path) {
+    addWatch(watcher, path, tree);
+  };
+
+  updateTree(watcher, tree, previousPaths, previousGlobs, onHidden, onDir);
+  return true;
+}
+
+void InotifyBackend::addWatch(Watcher &watcher, const std::string &path, std::shared_ptr<DirTree> tree) {
   int wd = inotify_add_watch(mInotify, path.c_str(), INOTIFY_MASK);
   if (wd == -1) {
-    return false;
+    throw WatcherError(std::string("inotify_add_watch on '") + path + std::string("' failed: ") + strerror(errno), &watcher);
   }
 
+  std::unique_lock<std::mutex> lock(mMutex);
+  mSubscriptions.emplace(wd, createSubscription(watcher, path, tree));
+}
+
+std::shared_ptr<InotifySubscription> InotifyBackend::createSubscription(Watcher &watcher, const std::string &path, std::shared_ptr<DirTree> tree) {
   std::shared_ptr<InotifySubscription> sub = std::make_shared<InotifySubscription>();
   sub->tree = tree;
   sub->path = path;
   sub->watcher = &watcher;
-  mSubscriptions.emplace(wd, sub);
+  return sub;
+}
 
+// This function must be called with mMutex held.
+bool InotifyBackend::watchDir(Watcher &watcher, std::string path, std::shared_ptr<DirTree> tree) {
+  int wd = inotify_add_watch(mInotify, path.c_str(), INOTIFY_MASK);
+  if (wd == -1) {
+    return false;
+  }
+
+  mSubscriptions.emplace(wd, createSubscription(watcher, path, tree));
   return true;
 }
 
@@ -163,13 +240,13 @@ bool InotifyBackend::handleSubscription(struct inotify_event *event, std::shared
   // If this is a create, check if it's a directory and start watching if it is.
   // In any case, keep the directory tree up to date.
   if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
-    watcher->mEvents.create(path);
+    watcher->mEvents.create(path, isDir);
 
     struct stat st;
     // Use lstat to avoid resolving symbolic links that we cannot watch anyway
     // https://github.com/parcel-bundler/watcher/issues/76
     lstat(path.c_str(), &st);
-    DirEntry *entry = sub->tree->add(path, CONVERT_TIME(st.st_mtim), S_ISDIR(st.st_mode));
+    DirEntry *entry = sub->tree->add(path, CONVERT_TIME(st.st_mtim), S_ISDIR(st.st_mode), S_ISDIR(st.st_mode) ? 0 : st.st_size);
 
     if (entry->isDir) {
       bool success = watchDir(*watcher, path, sub->tree);
@@ -179,11 +256,11 @@ bool InotifyBackend::handleSubscription(struct inotify_event *event, std::shared
       }
     }
   } else if (event->mask & (IN_MODIFY | IN_ATTRIB)) {
-    watcher->mEvents.update(path);
+    watcher->mEvents.update(path, isDir);
 
     struct stat st;
     stat(path.c_str(), &st);
-    sub->tree->update(path, CONVERT_TIME(st.st_mtim));
+    sub->tree->update(path, CONVERT_TIME(st.st_mtim), st.st_size);
   } else if (event->mask & (IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM | IN_MOVE_SELF)) {
     bool isSelfEvent = (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF));
     // Ignore delete/move self events unless this is the recursive watch root
@@ -203,18 +280,28 @@ bool InotifyBackend::handleSubscription(struct inotify_event *event, std::shared
       }
     }
 
-    watcher->mEvents.remove(path);
+    watcher->mEvents.remove(path, isSelfEvent || isDir);
     sub->tree->remove(path);
   }
 
   return true;
 }
 
-// This function is called by Backend::unwatch which takes a lock on mMutex
+// This function is called by Backend::unwatch which takes a lock on the root's mutex.
 void InotifyBackend::unsubscribe(Watcher &watcher) {
+  removeSubscriptions(watcher);
+  writeTreeCache(watcher, DirTree::getCached(watcher.mDir));
+}
+
+// Removes the watcher's subscriptions of the directories within dir, or all of them.
+void InotifyBackend::removeSubscriptions(Watcher &watcher, const std::string &dir) {
+  std::unique_lock<std::mutex> lock(mMutex);
+  std::string dirStart = dir + DIR_SEP;
+
   // Find any subscriptions pointing to this watcher, and remove them.
   for (auto it = mSubscriptions.begin(); it != mSubscriptions.end();) {
-    if (it->second->watcher == &watcher) {
+    const std::string &path = it->second->path;
+    if (it->second->watcher == &watcher && (dir.empty() || path == dir || path.compare(0, dirStart.size(), dirStart) == 0)) {
       if (mSubscriptions.count(it->first) == 1) {
         int err = inotify_rm_watch(mInotify, it->first);
         if (err == -1) {
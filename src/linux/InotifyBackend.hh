@@ -19,13 +19,17 @@ public:
   ~InotifyBackend();
   void subscribe(Watcher &watcher) override;
   void unsubscribe(Watcher &watcher) override;
+  bool updateIgnores(Watcher &watcher, std::unordered_set<std::string> ignorePaths, std::unordered_set<Glob> ignoreGlobs) override;
 private:
   int mPipe[2];
   int mInotify;
   std::unordered_multimap<int, std::shared_ptr<InotifySubscription>> mSubscriptions;
   Signal mEndedSignal;
 
+  std::shared_ptr<InotifySubscription> createSubscription(Watcher &watcher, const std::string &path, std::shared_ptr<DirTree> tree);
   bool watchDir(Watcher &watcher, std::string path, std::shared_ptr<DirTree> tree);
+  void addWatch(Watcher &watcher, const std::string &path, std::shared_ptr<DirTree> tree);
+  void removeSubscriptions(Watcher &watcher, const std::string &dir = "");
   void handleEvents();
   void handleEvent(struct inotify_event *event, std::unordered_set<Watcher *> &watchers);
   bool handleSubscription(struct inotify_event *event, std::shared_ptr<InotifySubscription> sub);
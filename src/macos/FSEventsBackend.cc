@@ -7,6 +7,7 @@
 #include "../Backend.hh"
 #include "./FSEventsBackend.hh"
 #include "../Watcher.hh"
+#include "../AtomicFile.hh"
 
 #define CONVERT_TIME(ts) ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec)
 #define IGNORED_FLAGS (kFSEventStreamEventFlagItemIsHardlink | kFSEventStreamEventFlagItemIsLastHardlink | kFSEventStreamEventFlagItemIsSymlink | kFSEventStreamEventFlagItemIsDir | kFSEventStreamEventFlagItemIsFile)
@@ -42,6 +43,8 @@ struct State {
   FSEventStreamRef stream;
   std::shared_ptr<DirTree> tree;
   uint64_t since;
+  // The current event id when a subscription started, to restart it from before it saw any.
+  FSEventStreamEventId startId;
 };
 
 void FSEventsCallback(
@@ -72,6 +75,12 @@ void FSEventsCallback(
     bool isDir = (eventFlags[i] & kFSEventStreamEventFlagItemIsDir) == kFSEventStreamEventFlagItemIsDir;
 
     if (isDone) {
+      // A replay ends with the history, while a subscription restarted from an earlier event
+      // carries on with the events after it.
+      if (watcher->hasSubscribers()) {
+        continue;
+      }
+
       watcher->notify();
       break;
     }
@@ -94,10 +103,10 @@ void FSEventsCallback(
     // Handle unambiguous events first
     if (isCreated && !(isRemoved || isModified || isRenamed)) {
       state->tree->add(paths[i], 0, isDir);
-      list->create(paths[i]);
+      list->create(paths[i], isDir);
     } else if (isRemoved && !(isCreated || isModified || isRenamed)) {
       state->tree->remove(paths[i]);
-      list->remove(paths[i]);
+      list->remove(paths[i], isDir);
       if (paths[i] == watcher->mDir) {
         deletedRoot = true;
       }
@@ -125,7 +134,7 @@ void FSEventsCallback(
         state->tree->add(paths[i], mtime, S_ISDIR(file.st_mode));
       }
 
-      list->update(paths[i]);
+      list->update(paths[i], isDir);
     } else {
       // If multiple flags were set, then we need to call `stat` to determine if the file really exists.
       // This helps disambiguate creates, updates, and deletes.
@@ -137,7 +146,7 @@ void FSEventsCallback(
         // we'd rather ignore this event completely). This will result in some extra delete events
         // being emitted for files we don't know about, but that is the best we can do.
         state->tree->remove(paths[i]);
-        list->remove(paths[i]);
+        list->remove(paths[i], isDir);
         if (paths[i] == watcher->mDir) {
           deletedRoot = true;
         }
@@ -155,15 +164,16 @@ void FSEventsCallback(
       // Some mounted file systems report a creation time of 0/unix epoch which we special case.
       if (isModified && (entry || (ctime <= since && ctime != 0))) {
         state->tree->update(paths[i], mtime);
-        list->update(paths[i]);
+        list->update(paths[i], isDir);
       } else {
         state->tree->add(paths[i], mtime, S_ISDIR(file.st_mode));
-        list->create(paths[i]);
+        list->create(paths[i], isDir);
       }
     }
   }
 
-  if (watcher->mWatched) {
+  // Subscriptions are made with core watchers, which have subscribers rather than callbacks.
+  if (watcher->hasSubscribers()) {
     watcher->notify();
   }
 
@@ -287,7 +297,42 @@ void FSEventsBackend::getEventsSince(Watcher &watcher, std::string *snapshotPath
   uint64_t since;
   ifs >> id;
   ifs >> since;
+  replay(watcher, id, since);
+}
+
+// The new event id is read before replaying, so anything happening during the replay is
+// reported again next time rather than missed. The event id covers the whole directory, so the
+// snapshot can't be updated for only part of it.
+void FSEventsBackend::updateSnapshot(Watcher &watcher, std::string *snapshotPath) {
+  if (!watcher.mSubpath.empty()) {
+    throw WatcherError("The subpath option is not supported when updating snapshots with this backend", &watcher);
+  }
+
+  std::unique_lock<std::mutex> lock(mMutex);
+  checkWatcher(watcher);
+
+  FSEventStreamEventId newId = FSEventsGetCurrentEventId();
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  std::ifstream ifs(*snapshotPath);
+  if (!ifs.fail()) {
+    FSEventStreamEventId id;
+    uint64_t since;
+    ifs >> id;
+    ifs >> since;
+    replay(watcher, id, since);
+  }
+
+  ifs.close();
+  writeFileAtomic(*snapshotPath, [&](std::ostream &os) {
+    os << newId;
+    os << "\n";
+    os << CONVERT_TIME(now);
+  });
+}
 
+void FSEventsBackend::replay(Watcher &watcher, FSEventStreamEventId id, uint64_t since) {
   State *s = new State;
   s->since = since;
   watcher.state = (void *)s;
@@ -300,16 +345,20 @@ void FSEventsBackend::getEventsSince(Watcher &watcher, std::string *snapshotPath
   watcher.state = NULL;
 }
 
-// This function is called by Backend::watch which takes a lock on mMutex
+// This function is called by Backend::watch which takes a lock on the root's mutex. Streams
+// share the backend's run loop, so they are started and stopped with mMutex held.
 void FSEventsBackend::subscribe(Watcher &watcher) {
+  std::unique_lock<std::mutex> lock(mMutex);
   State *s = new State;
   s->since = 0;
+  s->startId = FSEventsGetCurrentEventId();
   watcher.state = (void *)s;
   startStream(watcher, kFSEventStreamEventIdSinceNow);
 }
 
-// This function is called by Backend::unwatch which takes a lock on mMutex
+// This function is called by Backend::unwatch which takes a lock on the root's mutex.
 void FSEventsBackend::unsubscribe(Watcher &watcher) {
+  std::unique_lock<std::mutex> lock(mMutex);
   State *s = (State *)watcher.state;
   if (s != NULL) {
     stopStream(s->stream, mRunLoop);
@@ -318,3 +367,36 @@ void FSEventsBackend::unsubscribe(Watcher &watcher) {
     watcher.state = NULL;
   }
 }
+
+// Exclusion paths are fixed when a stream is created, so the stream is started again with the
+// new ones. It starts from the last event the previous stream saw, so the events in between are
+// replayed rather than missed. The tree is kept, to keep telling updates from creations.
+// This function is called by Backend::watch and unwatch which take a lock on the root's mutex.
+bool FSEventsBackend::updateIgnores(Watcher &watcher, std::unordered_set<std::string> ignorePaths, std::unordered_set<Glob> ignoreGlobs) {
+  std::unique_lock<std::mutex> lock(mMutex);
+  State *s = (State *)watcher.state;
+  if (s == NULL) {
+    return false;
+  }
+
+  FSEventStreamEventId id = FSEventStreamGetLatestEventId(s->stream);
+  if (id == kFSEventStreamEventIdSinceNow) {
+    id = s->startId;
+  }
+
+  stopStream(s->stream, mRunLoop);
+  watcher.mIgnorePaths = ignorePaths;
+  watcher.mIgnoreGlobs = ignoreGlobs;
+
+  std::shared_ptr<DirTree> tree = s->tree;
+  try {
+    startStream(watcher, id);
+  } catch (...) {
+    delete s;
+    watcher.state = NULL;
+    throw;
+  }
+
+  s->tree = tree;
+  return true;
+}
@@ -10,10 +10,13 @@ public:
   ~FSEventsBackend();
   void writeSnapshot(Watcher &watcher, std::string *snapshotPath) override;
   void getEventsSince(Watcher &watcher, std::string *snapshotPath) override;
+  void updateSnapshot(Watcher &watcher, std::string *snapshotPath) override;
   void subscribe(Watcher &watcher) override;
   void unsubscribe(Watcher &watcher) override;
+  bool updateIgnores(Watcher &watcher, std::unordered_set<std::string> ignorePaths, std::unordered_set<Glob> ignoreGlobs) override;
 private:
   void startStream(Watcher &watcher, FSEventStreamEventId id);
+  void replay(Watcher &watcher, FSEventStreamEventId id, uint64_t since);
   CFRunLoopRef mRunLoop;
 };
 
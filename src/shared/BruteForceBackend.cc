@@ -1,36 +1,892 @@
 #include <string>
 #include <fstream>
+#include <sstream>
+#include <random>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <dirent.h>
+#endif
 #include "../DirTree.hh"
 #include "../Event.hh"
+#include "../AtomicFile.hh"
+#include "../Parallel.hh"
+#include "../Abort.hh"
 #include "./BruteForceBackend.hh"
 
-std::shared_ptr<DirTree> BruteForceBackend::getTree(Watcher &watcher, bool shouldRead) {
+// A crawl that queries of the same directory and ignore sets can wait for and share. It starts
+// once the previous crawl of the directory is done, so the queries made meanwhile share it.
+struct PendingCrawl {
+  bool isStarted = false;
+  bool isFinished = false;
+  std::chrono::steady_clock::time_point startedAt;
+  std::chrono::steady_clock::time_point finishedAt;
+  std::shared_ptr<DirTree> tree;
+  std::exception_ptr error;
+};
+
+// Kept across backend instances, as the brute force backend is released after every query.
+// Never destroyed, as the thread expiring finished crawls may still be waiting at exit.
+static std::mutex &crawlsMutex = *new std::mutex();
+static std::condition_variable &crawlsCond = *new std::condition_variable();
+static std::unordered_map<std::string, std::shared_ptr<PendingCrawl>> &crawls = *new std::unordered_map<std::string, std::shared_ptr<PendingCrawl>>();
+static bool isExpiringCrawls = false;
+
+// How long a crawl may be reused by later queries, in milliseconds.
+static std::atomic<uint64_t> crawlTTL(0);
+
+// Removes the finished crawls that are older than the TTL, and returns when the next one expires,
+// or the maximum time point if none will. Must be called with crawlsMutex held.
+static std::chrono::steady_clock::time_point removeExpiredCrawls() {
+  auto now = std::chrono::steady_clock::now();
+  auto ttl = std::chrono::milliseconds(crawlTTL);
+  auto next = std::chrono::steady_clock::time_point::max();
+  for (auto it = crawls.begin(); it != crawls.end();) {
+    if (it->second->isFinished && now - it->second->finishedAt > ttl) {
+      it = crawls.erase(it);
+    } else {
+      if (it->second->isFinished) {
+        next = std::min(next, it->second->finishedAt + ttl);
+      }
+
+      it++;
+    }
+  }
+
+  return next;
+}
+
+// Finished crawls are kept for the TTL when it's above zero. A thread removes them once they
+// expire, so that their trees are freed even if no other query comes. It runs while there are
+// any. Must be called with crawlsMutex held.
+static void expireCrawls() {
+  if (isExpiringCrawls) {
+    return;
+  }
+
+  try {
+    std::thread([] () {
+      std::unique_lock<std::mutex> lock(crawlsMutex);
+      while (true) {
+        auto next = removeExpiredCrawls();
+        if (next == std::chrono::steady_clock::time_point::max()) {
+          isExpiringCrawls = false;
+          return;
+        }
+
+        crawlsCond.wait_until(lock, next + std::chrono::milliseconds(1));
+      }
+    }).detach();
+    isExpiringCrawls = true;
+  } catch (std::system_error &err) {
+    // The next crawl removes the expired ones instead.
+  }
+}
+
+void BruteForceBackend::setCrawlTTL(uint64_t ms) {
+  std::unique_lock<std::mutex> lock(crawlsMutex);
+  crawlTTL = ms;
+  crawlsCond.notify_all();
+}
+
+// Identifies the crawls that can be shared: those of the same directory and ignore sets.
+static std::string crawlKey(Watcher &watcher) {
+  std::vector<std::string> paths(watcher.mIgnorePaths.begin(), watcher.mIgnorePaths.end());
+  std::sort(paths.begin(), paths.end());
+
+  std::vector<std::string> globs;
+  for (auto it = watcher.mIgnoreGlobs.begin(); it != watcher.mIgnoreGlobs.end(); it++) {
+    globs.push_back(it->mRaw);
+  }
+  std::sort(globs.begin(), globs.end());
+
+  std::string key = watcher.mDir;
+  key += '\0';
+  for (auto it = paths.begin(); it != paths.end(); it++) {
+    key += *it + '\0';
+  }
+
+  key += '\0';
+  for (auto it = globs.begin(); it != globs.end(); it++) {
+    key += *it + '\0';
+  }
+
+  return key;
+}
+
+std::shared_ptr<DirTree> BruteForceBackend::getTree(Watcher &watcher, bool shouldRead, const DirCallback &onDir) {
   auto tree = DirTree::getCached(watcher.mDir);
+  std::string key = crawlKey(watcher);
+
+  // A tree retained since it was last used is revalidated rather than read again, unless it was
+  // read with other ignore sets. A revalidation that fails is discarded like a failed crawl.
+  if (tree->isStale) {
+    tree->isStale = false;
+    bool isValid = false;
+    if (shouldRead && tree->crawlKey == key) {
+      try {
+        isValid = revalidateTree(watcher, tree, onDir);
+      } catch (...) {
+        tree->clear();
+        throw;
+      }
+    }
 
-  // If the tree is not complete, read it if needed.
+    if (!isValid) {
+      tree->clear();
+    }
+  }
+
+  // If the tree is not complete, read it if needed. A crawl that fails or is aborted part way
+  // is discarded, so the next one doesn't start from entries that may no longer exist.
   if (!tree->isComplete && shouldRead) {
-    readTree(watcher, tree);
+    try {
+      readTree(watcher, tree, watcher.mDir);
+    } catch (...) {
+      tree->clear();
+      throw;
+    }
+
     tree->isComplete = true;
+    tree->crawlKey = key;
+  }
+
+  if (tree->isComplete) {
+    tree->ensureDigests();
   }
 
   return tree;
 }
 
+#ifndef _WIN32
+#define CONVERT_TIME(ts) ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec)
+#if __APPLE__
+#define st_mtim st_mtimespec
+#endif
+#define ISDOT(a) (a[0] == '.' && (!a[1] || (a[1] == '.' && !a[2])))
+#endif
+
+// Brings a retained tree up to date without crawling the whole directory again. Every entry is
+// stat'ed, but only the directories whose mtime changed are listed, as adding, removing or
+// renaming a child changes the mtime of its directory. New subdirectories are crawled. Returns
+// false if the tree can't be revalidated, in which case it must be read from scratch.
+// Directories are passed to onDir before they are compared, so that a subscription can start
+// watching them before changes to them could be missed.
+bool BruteForceBackend::revalidateTree(Watcher &watcher, std::shared_ptr<DirTree> tree, const DirCallback &onDir) {
+#ifdef _WIN32
+  // The crawler reads mtimes from FindFirstFile, which stat doesn't match.
+  return false;
+#else
+  auto frozen = tree->freeze();
+  std::string removed;
+  for (auto it = frozen->entries->begin(); it != frozen->entries->end(); it++) {
+    AbortFlag::check();
+    const DirEntry &entry = it->second;
+    if (!removed.empty() && entry.path.compare(0, removed.size(), removed) == 0) {
+      continue;
+    }
+
+    struct stat st;
+    bool exists = lstat(entry.path.c_str(), &st) == 0;
+    if (!exists && entry.path == tree->root) {
+      return false;
+    }
+
+    if (!exists || S_ISDIR(st.st_mode) != entry.isDir) {
+      tree->remove(entry.path);
+      if (entry.isDir) {
+        removed = entry.path + DIR_SEP;
+      }
+
+      if (exists && S_ISDIR(st.st_mode)) {
+        readTree(watcher, tree, entry.path);
+      } else if (exists) {
+        tree->add(entry.path, CONVERT_TIME(st.st_mtim), false, st.st_size);
+      }
+
+      continue;
+    }
+
+    // The directory is stat'ed again once it's watched, so changes in between aren't missed.
+    if (entry.isDir && onDir) {
+      onDir(entry.path);
+      if (lstat(entry.path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        continue;
+      }
+    }
+
+    uint64_t mtime = CONVERT_TIME(st.st_mtim);
+    if (!entry.isDir) {
+      if (mtime != entry.mtime || (uint64_t)st.st_size != entry.size) {
+        tree->update(entry.path, mtime, st.st_size);
+      }
+
+      continue;
+    }
+
+    if (mtime == entry.mtime) {
+      continue;
+    }
+
+    tree->update(entry.path, mtime);
+
+    // Removed children are found as the loop gets to them, so only new ones are looked for here.
+    std::vector<std::string> added;
+    DIR *dir = opendir(entry.path.c_str());
+    if (!dir) {
+      if (errno == EACCES) {
+        continue;
+      }
+
+      throw WatcherError(strerror(errno), &watcher);
+    }
+
+    while (struct dirent *ent = readdir(dir)) {
+      if (ISDOT(ent->d_name)) {
+        continue;
+      }
+
+      std::string path = entry.path + DIR_SEP + ent->d_name;
+      if (frozen->entries->count(path) == 0 && !watcher.isIgnored(path)) {
+        added.push_back(path);
+      }
+    }
+
+    closedir(dir);
+
+    for (auto path = added.begin(); path != added.end(); path++) {
+      struct stat child;
+      if (lstat(path->c_str(), &child) != 0) {
+        continue;
+      }
+
+      if (S_ISDIR(child.st_mode)) {
+        readTree(watcher, tree, *path);
+      } else {
+        tree->add(*path, CONVERT_TIME(child.st_mtim), false, child.st_size);
+      }
+    }
+  }
+
+  return true;
+#endif
+}
+
+// Brings a tree in line with the watcher's ignore sets after they were changed from the previous
+// ones: the entries they now ignore are removed, and those only the previous sets ignored are
+// read. Only the directories that may hold such entries are listed, i.e. the parents of the
+// ignore paths that were dropped, or every directory if an ignore glob was. The top of each
+// removed subtree is passed to onHidden, and each directory read to onDir once it has been, so
+// that a subscription can update its watches.
+// This function must be called with the root's mutex held.
+void BruteForceBackend::updateTree(Watcher &watcher, std::shared_ptr<DirTree> tree, const std::unordered_set<std::string> &previousPaths, const std::unordered_set<Glob> &previousGlobs, const DirCallback &onHidden, const DirCallback &onDir) {
+  auto frozen = tree->freeze();
+  std::string hidden;
+  for (auto it = frozen->entries->begin(); it != frozen->entries->end(); it++) {
+    const DirEntry &entry = it->second;
+    if (!hidden.empty() && entry.path.compare(0, hidden.size(), hidden) == 0) {
+      continue;
+    }
+
+    if (entry.path != tree->root && watcher.isIgnored(entry.path)) {
+      if (onHidden) {
+        onHidden(entry.path);
+      }
+
+      tree->remove(entry.path);
+      if (entry.isDir) {
+        hidden = entry.path + DIR_SEP;
+      }
+    }
+  }
+
+  bool isGlobDropped = false;
+  for (auto it = previousGlobs.begin(); it != previousGlobs.end(); it++) {
+    if (watcher.mIgnoreGlobs.count(*it) == 0) {
+      isGlobDropped = true;
+    }
+  }
+
+  std::set<std::string> dirs;
+  frozen = tree->freeze();
+  if (isGlobDropped) {
+    for (auto it = frozen->entries->begin(); it != frozen->entries->end(); it++) {
+      if (it->second.isDir) {
+        dirs.insert(it->first);
+      }
+    }
+  } else {
+    for (auto it = previousPaths.begin(); it != previousPaths.end(); it++) {
+      auto sep = it->rfind(DIR_SEP);
+      if (watcher.mIgnorePaths.count(*it) == 0 && sep != std::string::npos) {
+        auto found = frozen->entries->find(it->substr(0, sep));
+        if (found != frozen->entries->end() && found->second.isDir) {
+          dirs.insert(found->first);
+        }
+      }
+    }
+  }
+
+#ifdef _WIN32
+  // The entries only the previous sets ignored are read by crawling the directory again.
+  if (!dirs.empty()) {
+    tree->clear();
+    readTree(watcher, tree, watcher.mDir);
+    tree->isComplete = true;
+    frozen = tree->freeze();
+    for (auto it = frozen->entries->begin(); it != frozen->entries->end(); it++) {
+      if (it->second.isDir && onDir) {
+        onDir(it->first);
+      }
+    }
+  }
+#else
+  for (auto dir = dirs.begin(); dir != dirs.end(); dir++) {
+    std::vector<std::string> exposed;
+    DIR *d = opendir(dir->c_str());
+    if (!d) {
+      continue;
+    }
+
+    // Entries that are new rather than exposed are left to the subscription's events.
+    while (struct dirent *ent = readdir(d)) {
+      if (ISDOT(ent->d_name)) {
+        continue;
+      }
+
+      std::string path = *dir + DIR_SEP + ent->d_name;
+      if (frozen->entries->count(path) == 0 && watcher.isIgnored(path, previousPaths, previousGlobs) && !watcher.isIgnored(path)) {
+        exposed.push_back(path);
+      }
+    }
+
+    closedir(d);
+
+    for (auto path = exposed.begin(); path != exposed.end(); path++) {
+      struct stat st;
+      if (lstat(path->c_str(), &st) != 0) {
+        continue;
+      }
+
+      if (!S_ISDIR(st.st_mode)) {
+        tree->add(*path, CONVERT_TIME(st.st_mtim), false, st.st_size);
+        continue;
+      }
+
+      readTree(watcher, tree, *path);
+      if (onDir) {
+        auto read = tree->freeze();
+        std::string pathStart = *path + DIR_SEP;
+        for (auto it = read->entries->lower_bound(*path); it != read->entries->end(); it++) {
+          if (it->first != *path && it->first.compare(0, pathStart.size(), pathStart) != 0) {
+            if (it->first > pathStart) {
+              break;
+            }
+
+            continue;
+          }
+
+          if (it->second.isDir) {
+            onDir(it->first);
+          }
+        }
+      }
+    }
+  }
+#endif
+
+  tree->crawlKey = crawlKey(watcher);
+  tree->ensureDigests();
+}
+
+// Seeds the watcher's cached tree from its cache file, unless the tree is in memory already.
+// The file is a snapshot container holding a single snapshot, which is stored under the key of
+// the ignore sets rather than the root, so a cache written with other ignore sets isn't used.
+// The tree is marked stale, so getTree revalidates it rather than crawling the directory, and
+// a frozen copy of it is returned to compare the revalidated tree with. Returns null if the cache
+// doesn't exist or can't be read.
+std::shared_ptr<DirTree> BruteForceBackend::loadTreeCache(Watcher &watcher) {
+  auto tree = DirTree::getCached(watcher.mDir);
+  if (watcher.mCachePath.empty() || tree->isComplete || tree->isStale) {
+    return nullptr;
+  }
+
+  std::ifstream ifs(watcher.mCachePath, std::ios::binary);
+  if (ifs.fail()) {
+    return nullptr;
+  }
+
+  std::string key = crawlKey(watcher);
+  std::shared_ptr<DirTree> cached;
+  try {
+    SnapshotContainer container(ifs);
+    uint64_t offset;
+    if (!container.find(key, offset)) {
+      return nullptr;
+    }
+
+    ifs.seekg(offset);
+    SnapshotReader reader(ifs);
+    if (reader.root != watcher.mDir) {
+      return nullptr;
+    }
+
+    cached = std::make_shared<DirTree>(watcher.mDir, reader);
+  } catch (AbortError &err) {
+    throw;
+  } catch (std::exception &err) {
+    // A cache that can't be read is the same as none.
+    return nullptr;
+  }
+
+  cached->ensureDigests();
+  tree->replace(*cached);
+  tree->isStale = true;
+  tree->crawlKey = key;
+  return cached;
+}
+
+// Persists a subscription's tree to its cache file, so that subscribing again after the process
+// restarts doesn't need a full crawl. The cache only speeds up subscribing, so failing to write it
+// doesn't fail the subscription.
+void BruteForceBackend::writeTreeCache(Watcher &watcher, std::shared_ptr<DirTree> tree) {
+  if (watcher.mCachePath.empty() || !tree->isComplete) {
+    return;
+  }
+
+  auto frozen = tree->freeze();
+  SnapshotOptions options;
+  options.compact = true;
+
+  try {
+    std::ostringstream snapshot;
+    frozen->write(snapshot, 0, options);
+    writeFileAtomic(watcher.mCachePath, [&watcher, &snapshot](std::ostream &os) {
+      SnapshotContainer::write(os, {crawlKey(watcher)}, {snapshot.str()});
+    });
+  } catch (std::exception &err) {}
+}
+
+// Returns the tree of a live subscription to the same directory and ignore sets, if there
+// is one. Such a tree is kept up to date by the subscription, so it can be diffed and
+// serialized without touching the file system. Backends that only fill the tree on demand
+// have it read here the first time. Failing that, the part of a live subscription's tree
+// of an ancestor directory is used, if it has the same entries.
+// This function must be called with the root's mutex held.
+std::shared_ptr<DirTree> BruteForceBackend::getLiveTree(Watcher &watcher) {
+  std::shared_ptr<Watcher> ancestor;
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    auto it = mSubscriptions.begin();
+    while (it != mSubscriptions.end() && !(**it == watcher)) {
+      it++;
+    }
+
+    if (it == mSubscriptions.end()) {
+      ancestor = getAncestorCore(watcher, true);
+      if (!ancestor) {
+        return nullptr;
+      }
+    }
+  }
+
+  if (ancestor) {
+    return getAncestorTree(watcher, ancestor);
+  }
+
+  return getTree(watcher);
+}
+
+// Copies the entries of the watcher's directory out of the live tree of an ancestor's core.
+// The ancestor's root mutex is taken while the watcher's is held, so roots are always locked
+// from the innermost out.
+std::shared_ptr<DirTree> BruteForceBackend::getAncestorTree(Watcher &watcher, std::shared_ptr<Watcher> core) {
+  auto rootMutex = getRootMutex(core->mDir);
+  std::unique_lock<std::mutex> rootLock(*rootMutex);
+  {
+    // The core may have been unwatched or widened while waiting for its root.
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (getAncestorCore(watcher, true) != core) {
+      return nullptr;
+    }
+  }
+
+  auto live = getTree(*core)->freeze();
+  auto tree = std::make_shared<DirTree>(watcher.mDir);
+  tree->isComplete = true;
+
+  std::string pathStart = watcher.mDir + DIR_SEP;
+  for (auto it = live->entries->lower_bound(watcher.mDir); it != live->entries->end(); it++) {
+    if (it->first != watcher.mDir && it->first.compare(0, pathStart.size(), pathStart) != 0) {
+      if (it->first > pathStart) {
+        break;
+      }
+
+      continue;
+    }
+
+    tree->add(it->first, it->second.mtime, it->second.isDir, it->second.size);
+  }
+
+  tree->ensureDigests();
+  return tree;
+}
+
+static bool isAbortError(std::exception_ptr error) {
+  try {
+    std::rethrow_exception(error);
+  } catch (AbortError &err) {
+    return true;
+  } catch (...) {
+    return false;
+  }
+}
+
+// Crawls the watcher's directory into a new frozen tree, without holding the root's mutex.
+// Queries of the same directory and ignore sets share crawls, rather than each crawling in turn.
+// Waits until a crawl is finished. Crawls signal crawlsCond when they finish. The query's abort
+// flag is checked every so often meanwhile, so that an aborted query doesn't wait for a crawl
+// it didn't start.
+static void waitForCrawl(PendingCrawl &crawl) {
+  std::unique_lock<std::mutex> lock(crawlsMutex);
+  while (!crawl.isFinished) {
+    AbortFlag::check();
+    crawlsCond.wait_for(lock, std::chrono::milliseconds(50));
+  }
+}
+
+// A query made while a crawl is in flight waits for the next one, which starts once that one is
+// done and is shared by all the queries made meanwhile. With the crawl TTL, which is zero by
+// default, a query may also use a crawl that started, or finished, less than the TTL before it.
+// Otherwise, each query sees the file system as of a crawl that started after it did.
+std::shared_ptr<DirTree> BruteForceBackend::crawlTree(Watcher &watcher) {
+  std::string key = crawlKey(watcher);
+  while (true) {
+    std::shared_ptr<PendingCrawl> crawl;
+    std::shared_ptr<PendingCrawl> previous;
+    bool isOwner = false;
+    {
+      std::unique_lock<std::mutex> lock(crawlsMutex);
+      removeExpiredCrawls();
+
+      auto now = std::chrono::steady_clock::now();
+      auto ttl = std::chrono::milliseconds(crawlTTL);
+      auto found = crawls.find(key);
+      if (found != crawls.end() && (!found->second->isStarted || found->second->isFinished || now - found->second->startedAt <= ttl)) {
+        crawl = found->second;
+      } else {
+        if (found != crawls.end()) {
+          previous = found->second;
+        }
+
+        crawl = std::make_shared<PendingCrawl>();
+        crawls[key] = crawl;
+        isOwner = true;
+      }
+    }
+
+    if (isOwner) {
+      auto tree = std::make_shared<DirTree>(watcher.mDir);
+      try {
+        if (previous) {
+          waitForCrawl(*previous);
+        }
+
+        {
+          std::unique_lock<std::mutex> lock(crawlsMutex);
+          crawl->isStarted = true;
+          crawl->startedAt = std::chrono::steady_clock::now();
+        }
+
+        readTree(watcher, tree, watcher.mDir);
+        tree->isComplete = true;
+        tree->ensureDigests();
+        crawl->tree = tree;
+      } catch (...) {
+        crawl->error = std::current_exception();
+      }
+
+      {
+        // The next crawl may have replaced it already.
+        std::unique_lock<std::mutex> lock(crawlsMutex);
+        crawl->isFinished = true;
+        crawl->finishedAt = std::chrono::steady_clock::now();
+        auto found = crawls.find(key);
+        if (found != crawls.end() && found->second == crawl) {
+          if (crawl->error || crawlTTL == 0) {
+            crawls.erase(found);
+          } else {
+            expireCrawls();
+          }
+        }
+
+        crawlsCond.notify_all();
+      }
+    } else {
+      waitForCrawl(*crawl);
+    }
+
+    if (crawl->error) {
+      // A crawl aborted by the query that started it is done again for the others.
+      if (!isOwner && isAbortError(crawl->error)) {
+        AbortFlag::check();
+        continue;
+      }
+
+      std::rethrow_exception(crawl->error);
+    }
+
+    return crawl->tree->freeze();
+  }
+}
+
+// Returns a tree with the current state of the watcher's subpath, from a live subscription's
+// tree if there is one, or by crawling only the subpath otherwise. When a snapshot path is given,
+// the entries of the snapshot outside of the subpath are kept, so the tree can replace the
+// snapshot without losing the changes that happened elsewhere since it was written. The tree is
+// not cached, as it doesn't reflect the rest of the directory.
+// This function must be called with the root's mutex held.
+std::shared_ptr<DirTree> BruteForceBackend::getSubtree(Watcher &watcher, std::string *snapshotPath) {
+  auto tree = std::make_shared<DirTree>(watcher.mDir);
+  tree->isComplete = true;
+  if (snapshotPath) {
+    std::ifstream ifs(*snapshotPath, std::ios::binary);
+    if (!ifs.fail()) {
+      SnapshotReader snapshot(ifs);
+      std::ifstream journal(SnapshotReader::journalPath(*snapshotPath), std::ios::binary);
+      snapshot.applyJournal(journal);
+      if (snapshot.root == watcher.mDir) {
+        tree = std::make_shared<DirTree>(watcher.mDir, snapshot);
+        tree->remove(watcher.mSubpath);
+      }
+    }
+  }
+
+  auto live = getLiveTree(watcher);
+  watcher.mLiveSourced = live != nullptr;
+  if (live) {
+    auto frozen = live->freeze();
+    std::string pathStart = watcher.mSubpath + DIR_SEP;
+    for (auto it = frozen->entries->lower_bound(watcher.mSubpath); it != frozen->entries->end(); it++) {
+      if (it->first != watcher.mSubpath && it->first.compare(0, pathStart.size(), pathStart) != 0) {
+        if (it->first > pathStart) {
+          break;
+        }
+
+        continue;
+      }
+
+      tree->add(it->first, it->second.mtime, it->second.isDir, it->second.size);
+    }
+  } else {
+    // A subpath that doesn't exist (anymore) is read as empty.
+    struct stat st;
+    if (stat(watcher.mSubpath.c_str(), &st) == 0) {
+      if ((st.st_mode & S_IFMT) != S_IFDIR) {
+        throw WatcherError(strerror(ENOTDIR), &watcher);
+      }
+
+      readTree(watcher, tree, watcher.mSubpath);
+    }
+  }
+
+  tree->ensureDigests();
+  return tree;
+}
+
+// Returns a frozen tree to compare a snapshot with: a live subscription's tree if there is one,
+// or a crawl of the directory otherwise, or of only the subpath if the query is restricted to
+// one. When the tree replaces the snapshot at snapshotPath, a subpath is spliced into the
+// snapshot. The tree is frozen before the root's mutex is released, so callers can take their
+// time with it while other operations on the root proceed.
+std::shared_ptr<DirTree> BruteForceBackend::getCurrentTree(Watcher &watcher, std::string *snapshotPath) {
+  {
+    auto rootMutex = getRootMutex(watcher.mDir);
+    std::unique_lock<std::mutex> lock(*rootMutex);
+    if (!watcher.mSubpath.empty() && snapshotPath) {
+      return getSubtree(watcher, snapshotPath);
+    }
+
+    auto tree = getLiveTree(watcher);
+    watcher.mLiveSourced = tree != nullptr;
+    if (tree) {
+      return tree->freeze();
+    }
+
+    if (!watcher.mSubpath.empty()) {
+      return getSubtree(watcher, nullptr);
+    }
+  }
+
+  return crawlTree(watcher);
+}
+
+// Hashes the files of the tree for a hashed snapshot. Files that haven't changed since the
+// previous snapshot at the same path keep the hash recorded there.
+static void computeHashes(std::shared_ptr<DirTree> tree, const std::string &snapshotPath) {
+  std::ifstream ifs(snapshotPath, std::ios::binary);
+  if (ifs.fail()) {
+    tree->computeHashes(nullptr);
+    return;
+  }
+
+  SnapshotReader previous(ifs);
+  std::ifstream journal(SnapshotReader::journalPath(snapshotPath), std::ios::binary);
+  previous.applyJournal(journal);
+  tree->computeHashes(&previous);
+}
+
 void BruteForceBackend::writeSnapshot(Watcher &watcher, std::string *snapshotPath) {
-  std::unique_lock<std::mutex> lock(mMutex);
-  auto tree = getTree(watcher);
-  std::ofstream ofs(*snapshotPath);
-  tree->write(ofs);
+  writeSnapshotFile(watcher, snapshotPath, SnapshotOptions());
 }
 
 void BruteForceBackend::getEventsSince(Watcher &watcher, std::string *snapshotPath) {
-  std::unique_lock<std::mutex> lock(mMutex);
-  std::ifstream ifs(*snapshotPath);
+  std::ifstream ifs(*snapshotPath, std::ios::binary);
   if (ifs.fail()) {
     return;
   }
 
-  DirTree snapshot{watcher.mDir, ifs};
-  auto now = getTree(watcher);
-  now->getChanges(&snapshot, watcher.mEvents);
+  SnapshotReader snapshot(ifs);
+  std::ifstream journal(SnapshotReader::journalPath(*snapshotPath), std::ios::binary);
+  snapshot.applyJournal(journal);
+
+  auto now = getCurrentTree(watcher);
+  now->getChanges(snapshot, watcher.mEvents, watcher.mSubpath);
+}
+
+// Diffs the current state against the snapshot and replaces it in a single crawl. The tree
+// is frozen first, so the snapshot written is exactly the state the events were computed from.
+// With a subpath, only that part of the snapshot is diffed and replaced.
+void BruteForceBackend::updateSnapshot(Watcher &watcher, std::string *snapshotPath) {
+  auto tree = getCurrentTree(watcher, snapshotPath);
+
+  // The snapshot is replaced in the same encoding as before.
+  SnapshotOptions options;
+  std::ifstream ifs(*snapshotPath, std::ios::binary);
+  if (!ifs.fail()) {
+    SnapshotReader snapshot(ifs);
+    std::ifstream journal(SnapshotReader::journalPath(*snapshotPath), std::ios::binary);
+    snapshot.applyJournal(journal);
+    options.compact = snapshot.isCompact;
+    options.hash = snapshot.isHashed;
+    if (options.hash) {
+      computeHashes(tree, *snapshotPath);
+    }
+
+    tree->getChanges(snapshot, watcher.mEvents, watcher.mSubpath);
+  }
+
+  ifs.close();
+  writeFileAtomic(*snapshotPath, [&tree, &options](std::ostream &os) {
+    tree->write(os, 0, options);
+  });
+}
+
+static uint64_t fileSize(const std::string &path) {
+  std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+  return ifs.fail() ? 0 : (uint64_t)ifs.tellg();
+}
+
+// Writes a snapshot of the tree. When a compaction ratio is given, the changes since the last
+// checkpoint are appended to the snapshot's journal instead of rewriting the whole snapshot.
+// Once the journal grows past that ratio of the snapshot's size, both are rewritten from scratch
+// (compacted). The snapshot is always rewritten before its journal is reset, and a journal only
+// applies to the snapshot whose id it names, so an interrupted compaction can't apply a stale
+// journal to a new snapshot. With a subpath, only that part of the snapshot is replaced.
+// The tree is frozen before it is hashed and written, so the root isn't locked meanwhile.
+void BruteForceBackend::writeSnapshotFile(Watcher &watcher, std::string *snapshotPath, const SnapshotOptions &options) {
+  auto tree = getCurrentTree(watcher, snapshotPath);
+
+  if (options.hash) {
+    computeHashes(tree, *snapshotPath);
+  }
+
+  if (options.compactionRatio <= 0) {
+    std::ofstream ofs(*snapshotPath, std::ios::binary);
+    tree->write(ofs, 0, options);
+    return;
+  }
+
+  std::string journalPath = SnapshotReader::journalPath(*snapshotPath);
+  std::string delta;
+  bool shouldCompact = true;
+
+  {
+    std::ifstream ifs(*snapshotPath, std::ios::binary);
+    std::ifstream journal(journalPath, std::ios::binary);
+    if (!ifs.fail() && !journal.fail()) {
+      SnapshotReader snapshot(ifs);
+      if (
+        snapshot.root == tree->root &&
+        snapshot.isCompact == options.compact &&
+        snapshot.isHashed == options.hash &&
+        snapshot.applyJournal(journal)
+      ) {
+        delta = tree->getDelta(snapshot);
+        uint64_t journalSize = fileSize(journalPath) + delta.size();
+        shouldCompact = journalSize > options.compactionRatio * fileSize(*snapshotPath);
+      }
+    }
+  }
+
+  if (shouldCompact) {
+    std::random_device random;
+    uint64_t id = ((uint64_t)random() << 32 | random()) + 1;
+    writeFileAtomic(*snapshotPath, [&tree, id, &options](std::ostream &os) {
+      tree->write(os, id, options);
+    });
+
+    writeFileAtomic(journalPath, [id](std::ostream &os) {
+      DirTree::writeJournalHeader(os, id);
+    });
+    return;
+  }
+
+  if (delta.empty()) {
+    return;
+  }
+
+  std::ofstream ofs(journalPath, std::ios::binary | std::ios::app);
+  ofs << delta;
+  ofs.close();
+  if (ofs.fail()) {
+    throw std::runtime_error("Unable to write snapshot journal: " + journalPath);
+  }
+
+  syncFile(journalPath);
+}
+
+bool BruteForceBackend::hasChanged(Watcher &watcher, std::string *snapshotPath) {
+  std::ifstream ifs(*snapshotPath, std::ios::binary);
+  if (ifs.fail()) {
+    throw std::runtime_error("Unable to open snapshot file: " + *snapshotPath);
+  }
+
+  SnapshotReader snapshot(ifs);
+  std::ifstream journal(SnapshotReader::journalPath(*snapshotPath), std::ios::binary);
+  snapshot.applyJournal(journal);
+
+  auto now = getCurrentTree(watcher);
+  return now->hasChanged(snapshot, watcher.mSubpath.empty() ? watcher.mDir : watcher.mSubpath);
+}
+
+std::shared_ptr<DirTree> BruteForceBackend::getSnapshotTree(Watcher &watcher) {
+  return getCurrentTree(watcher);
+}
+
+// Returns frozen trees of several directories at once. The directories are crawled in parallel,
+// so the crawls don't wait on each other.
+std::vector<std::shared_ptr<DirTree>> BruteForceBackend::getSnapshotTrees(std::vector<std::shared_ptr<Watcher>> &watchers) {
+  std::vector<std::shared_ptr<DirTree>> trees(watchers.size());
+  parallelFor(watchers.size(), 1, [this, &watchers, &trees] (size_t i) {
+    trees[i] = getCurrentTree(*watchers[i]);
+  });
+
+  return trees;
 }
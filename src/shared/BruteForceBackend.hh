@@ -5,10 +5,18 @@
 #include "../DirTree.hh"
 #include "../Watcher.hh"
 
+// Called with each directory of a tree that is confirmed to still exist while it is revalidated.
+typedef std::function<void(const std::string &dir)> DirCallback;
+
 class BruteForceBackend : public Backend {
 public:
   void writeSnapshot(Watcher &watcher, std::string *snapshotPath) override;
   void getEventsSince(Watcher &watcher, std::string *snapshotPath) override;
+  void updateSnapshot(Watcher &watcher, std::string *snapshotPath) override;
+  void writeSnapshotFile(Watcher &watcher, std::string *snapshotPath, const SnapshotOptions &options) override;
+  bool hasChanged(Watcher &watcher, std::string *snapshotPath) override;
+  std::shared_ptr<DirTree> getSnapshotTree(Watcher &watcher) override;
+  std::vector<std::shared_ptr<DirTree>> getSnapshotTrees(std::vector<std::shared_ptr<Watcher>> &watchers) override;
   void subscribe(Watcher &watcher) override {
     throw "Brute force backend doesn't support subscriptions.";
   }
@@ -17,9 +25,20 @@ public:
     throw "Brute force backend doesn't support subscriptions.";
   }
 
-  std::shared_ptr<DirTree> getTree(Watcher &watcher, bool shouldRead = true);
+  std::shared_ptr<DirTree> getTree(Watcher &watcher, bool shouldRead = true, const DirCallback &onDir = nullptr);
+  std::shared_ptr<DirTree> getLiveTree(Watcher &watcher);
+  static void setCrawlTTL(uint64_t ms);
+protected:
+  std::shared_ptr<DirTree> loadTreeCache(Watcher &watcher);
+  void writeTreeCache(Watcher &watcher, std::shared_ptr<DirTree> tree);
+  void updateTree(Watcher &watcher, std::shared_ptr<DirTree> tree, const std::unordered_set<std::string> &previousPaths, const std::unordered_set<Glob> &previousGlobs, const DirCallback &onHidden, const DirCallback &onDir);
 private:
-  void readTree(Watcher &watcher, std::shared_ptr<DirTree> tree);
+  bool revalidateTree(Watcher &watcher, std::shared_ptr<DirTree> tree, const DirCallback &onDir);
+  std::shared_ptr<DirTree> getAncestorTree(Watcher &watcher, std::shared_ptr<Watcher> core);
+  std::shared_ptr<DirTree> crawlTree(Watcher &watcher);
+  void readTree(Watcher &watcher, std::shared_ptr<DirTree> tree, const std::string &dir);
+  std::shared_ptr<DirTree> getSubtree(Watcher &watcher, std::string *snapshotPath);
+  std::shared_ptr<DirTree> getCurrentTree(Watcher &watcher, std::string *snapshotPath = nullptr);
 };
 
 #endif
@@ -8,6 +8,7 @@
 
 #include <fts.h>
 #include "../DirTree.hh"
+#include "../Abort.hh"
 #include "../shared/BruteForceBackend.hh"
 
 #define CONVERT_TIME(ts) ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec)
@@ -15,8 +16,8 @@
 #define st_mtim st_mtimespec
 #endif
 
-void BruteForceBackend::readTree(Watcher &watcher, std::shared_ptr<DirTree> tree) {
-  char *paths[2] {(char *)watcher.mDir.c_str(), NULL};
+void BruteForceBackend::readTree(Watcher &watcher, std::shared_ptr<DirTree> tree, const std::string &dir) {
+  char *paths[2] {(char *)dir.c_str(), NULL};
   FTS *fts = fts_open(paths, FTS_NOCHDIR | FTS_PHYSICAL, NULL);
   if (!fts) {
     throw WatcherError(strerror(errno), &watcher);
@@ -26,6 +27,11 @@ void BruteForceBackend::readTree(Watcher &watcher, std::shared_ptr<DirTree> tree
   bool isRoot = true;
 
   while ((node = fts_read(fts)) != NULL) {
+    if (AbortFlag::aborted()) {
+      fts_close(fts);
+      throw AbortError();
+    }
+
     if (node->fts_errno) {
       fts_close(fts);
       throw WatcherError(strerror(node->fts_errno), &watcher);
@@ -41,7 +47,8 @@ void BruteForceBackend::readTree(Watcher &watcher, std::shared_ptr<DirTree> tree
       continue;
     }
 
-    tree->add(node->fts_path, CONVERT_TIME(node->fts_statp->st_mtim), (node->fts_info & FTS_D) == FTS_D);
+    bool isDir = (node->fts_info & FTS_D) == FTS_D;
+    tree->add(node->fts_path, CONVERT_TIME(node->fts_statp->st_mtim), isDir, isDir ? 0 : node->fts_statp->st_size);
     isRoot = false;
   }
 
@@ -15,6 +15,7 @@
 #include <unistd.h>
 
 #include "../DirTree.hh"
+#include "../Abort.hh"
 #include "../shared/BruteForceBackend.hh"
 
 #define CONVERT_TIME(ts) ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec)
@@ -39,7 +40,10 @@ void iterateDir(Watcher &watcher, const std::shared_ptr <DirTree> tree, const ch
     tree->add(dirname, CONVERT_TIME(rootAttributes.st_mtim), true);
 
     if (DIR *dir = fdopendir(new_fd)) {
+        // An aborted crawl stops here rather than throwing, so that every directory it has open
+        // is closed on the way out. readTree throws once the whole crawl has unwound.
         while (struct dirent *ent = (errno = 0, readdir(dir))) {
+            if (AbortFlag::aborted()) break;
             if (ISDOT(ent->d_name)) continue;
 
             std::string fullPath = dirname + "/" + ent->d_name;
@@ -52,7 +56,7 @@ void iterateDir(Watcher &watcher, const std::shared_ptr <DirTree> tree, const ch
                 if (isDir) {
                     iterateDir(watcher, tree, ent->d_name, new_fd, fullPath);
                 } else {
-                    tree->add(fullPath, CONVERT_TIME(attrib.st_mtim), isDir);
+                    tree->add(fullPath, CONVERT_TIME(attrib.st_mtim), isDir, attrib.st_size);
                 }
             }
         }
@@ -62,15 +66,21 @@ void iterateDir(Watcher &watcher, const std::shared_ptr <DirTree> tree, const ch
         close(new_fd);
     }
 
+    if (AbortFlag::aborted()) {
+        return;
+    }
+
     if (errno) {
         throw WatcherError(strerror(errno), &watcher);
     }
 }
 
-void BruteForceBackend::readTree(Watcher &watcher, std::shared_ptr <DirTree> tree) {
-    int fd = open(watcher.mDir.c_str(), O_RDONLY);
+void BruteForceBackend::readTree(Watcher &watcher, std::shared_ptr <DirTree> tree, const std::string &dir) {
+    int fd = open(dir.c_str(), O_RDONLY);
     if (fd) {
-        iterateDir(watcher, tree, ".", fd, watcher.mDir);
+        iterateDir(watcher, tree, ".", fd, dir);
         close(fd);
     }
+
+    AbortFlag::check();
 }
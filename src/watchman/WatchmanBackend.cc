@@ -4,6 +4,7 @@
 #include <algorithm>
 #include "../DirTree.hh"
 #include "../Event.hh"
+#include "../AtomicFile.hh"
 #include "./BSER.hh"
 #include "./WatchmanBackend.hh"
 
@@ -108,7 +109,9 @@ bool WatchmanBackend::checkAvailable() {
   }
 }
 
-void handleFiles(Watcher &watcher, BSER::Object obj) {
+// File names are relative to dir, which is the watched directory unless a query was restricted
+// to a part of it.
+void handleFiles(Watcher &watcher, BSER::Object obj, const std::string &dir) {
   auto found = obj.find("files");
   if (found == obj.end()) {
     throw WatcherError("Error reading changes from watchman", &watcher);
@@ -124,17 +127,17 @@ void handleFiles(Watcher &watcher, BSER::Object obj) {
     auto mode = file.find("mode")->second.intValue();
     auto isNew = file.find("new")->second.boolValue();
     auto exists = file.find("exists")->second.boolValue();
-    auto path = watcher.mDir + DIR_SEP + name;
+    auto path = dir + DIR_SEP + name;
     if (watcher.isIgnored(path)) {
       continue;
     }
 
     if (isNew && exists) {
-      watcher.mEvents.create(path);
+      watcher.mEvents.create(path, S_ISDIR(mode));
     } else if (exists && !S_ISDIR(mode)) {
       watcher.mEvents.update(path);
     } else if (!isNew && !exists) {
-      watcher.mEvents.remove(path);
+      watcher.mEvents.remove(path, S_ISDIR(mode));
     }
   }
 }
@@ -148,8 +151,13 @@ void WatchmanBackend::handleSubscription(BSER::Object obj) {
   }
 
   auto watcher = it->second;
+  auto clock = obj.find("clock");
+  if (clock != obj.end()) {
+    mClocks[subscription] = clock->second.stringValue();
+  }
+
   try {
-    handleFiles(*watcher, obj);
+    handleFiles(*watcher, obj, watcher->mDir);
     watcher->notify();
   } catch (WatcherError &err) {
     handleWatcherError(err);
@@ -255,14 +263,75 @@ void WatchmanBackend::getEventsSince(Watcher &watcher, std::string *snapshotPath
 
   std::string clock;
   ifs >> clock;
+  since(watcher, clock);
+}
+
+// Reports the changes since the clock in the snapshot and replaces it with the clock returned
+// alongside them, so no change can fall between the query and the new snapshot. The clock covers
+// the whole directory, so the snapshot can't be updated for only part of it.
+void WatchmanBackend::updateSnapshot(Watcher &watcher, std::string *snapshotPath) {
+  if (!watcher.mSubpath.empty()) {
+    throw WatcherError("The subpath option is not supported when updating snapshots with this backend", &watcher);
+  }
+
+  std::unique_lock<std::mutex> lock(mMutex);
+  watchmanWatch(watcher.mDir);
+
+  std::string newClock;
+  std::ifstream ifs(*snapshotPath);
+  if (ifs.fail()) {
+    newClock = clock(watcher);
+  } else {
+    std::string clock;
+    ifs >> clock;
+    newClock = since(watcher, clock);
+  }
+
+  ifs.close();
+  writeFileAtomic(*snapshotPath, [&newClock](std::ostream &os) {
+    os << newClock;
+  });
+}
 
+// Queries the changes since the given clock, and returns the clock they were computed up to.
+// Queries restricted to a subpath use watchman's relative_root, so only that part is looked at.
+std::string WatchmanBackend::since(Watcher &watcher, std::string &clock) {
   BSER::Array cmd;
-  cmd.push_back("since");
-  cmd.push_back(normalizePath(watcher.mDir));
-  cmd.push_back(clock);
+  if (watcher.mSubpath.empty()) {
+    cmd.push_back("since");
+    cmd.push_back(normalizePath(watcher.mDir));
+    cmd.push_back(clock);
+  } else {
+    std::string relative = watcher.mSubpath.substr(watcher.mDir.size() + 1);
+    #ifdef _WIN32
+      std::replace(relative.begin(), relative.end(), '\\', '/');
+    #endif
+
+    BSER::Array fields;
+    fields.push_back("name");
+    fields.push_back("mode");
+    fields.push_back("exists");
+    fields.push_back("new");
+
+    BSER::Object opts;
+    opts.emplace("since", clock);
+    opts.emplace("fields", fields);
+    opts.emplace("relative_root", relative);
+
+    cmd.push_back("query");
+    cmd.push_back(normalizePath(watcher.mDir));
+    cmd.push_back(opts);
+  }
 
   BSER::Object obj = watchmanRequest(cmd);
-  handleFiles(watcher, obj);
+  handleFiles(watcher, obj, watcher.mSubpath.empty() ? watcher.mDir : watcher.mSubpath);
+
+  auto found = obj.find("clock");
+  if (found == obj.end()) {
+    throw WatcherError("Error reading clock from watchman", &watcher);
+  }
+
+  return found->second.stringValue();
 }
 
 std::string getId(Watcher &watcher) {
@@ -272,10 +341,16 @@ std::string getId(Watcher &watcher) {
   return id.str();
 }
 
-// This function is called by Backend::watch which takes a lock on mMutex
+// This function is called by Backend::watch which takes a lock on the root's mutex. Requests
+// share a single connection to watchman, so mMutex is held as well.
 void WatchmanBackend::subscribe(Watcher &watcher) {
+  std::unique_lock<std::mutex> lock(mMutex);
   watchmanWatch(watcher.mDir);
+  watchmanSubscribe(watcher, clock(watcher));
+}
 
+// Subscribes to the changes since the given clock. This function must be called with mMutex held.
+void WatchmanBackend::watchmanSubscribe(Watcher &watcher, const std::string &since) {
   std::string id = getId(watcher);
   BSER::Array cmd;
   cmd.push_back("subscribe");
@@ -290,7 +365,7 @@ void WatchmanBackend::subscribe(Watcher &watcher) {
 
   BSER::Object opts;
   opts.emplace("fields", fields);
-  opts.emplace("since", clock(watcher));
+  opts.emplace("since", since);
 
   if (watcher.mIgnorePaths.size() > 0) {
     BSER::Array ignore;
@@ -318,14 +393,22 @@ void WatchmanBackend::subscribe(Watcher &watcher) {
   watchmanRequest(cmd);
 
   mSubscriptions.emplace(id, &watcher);
+  mClocks[id] = since;
   mRequestSignal.notify();
 }
 
-// This function is called by Backend::unwatch which takes a lock on mMutex
+// This function is called by Backend::unwatch which takes a lock on the root's mutex.
 void WatchmanBackend::unsubscribe(Watcher &watcher) {
+  std::unique_lock<std::mutex> lock(mMutex);
+  watchmanUnsubscribe(watcher);
+}
+
+// This function must be called with mMutex held.
+void WatchmanBackend::watchmanUnsubscribe(Watcher &watcher) {
   std::string id = getId(watcher);
   auto erased = mSubscriptions.erase(id);
-  
+  mClocks.erase(id);
+
   if (erased) {
     BSER::Array cmd;
     cmd.push_back("unsubscribe");
@@ -335,3 +418,22 @@ void WatchmanBackend::unsubscribe(Watcher &watcher) {
     watchmanRequest(cmd);
   }
 }
+
+// Watchman filters the ignored paths itself, so the subscription is made again with the new
+// ones. It starts from the clock the previous one delivered the changes up to, so the changes
+// made in between are delivered rather than missed.
+// This function is called by Backend::watch and unwatch which take a lock on the root's mutex.
+bool WatchmanBackend::updateIgnores(Watcher &watcher, std::unordered_set<std::string> ignorePaths, std::unordered_set<Glob> ignoreGlobs) {
+  std::unique_lock<std::mutex> lock(mMutex);
+  auto found = mClocks.find(getId(watcher));
+  if (found == mClocks.end()) {
+    return false;
+  }
+
+  std::string since = found->second;
+  watchmanUnsubscribe(watcher);
+  watcher.mIgnorePaths = ignorePaths;
+  watcher.mIgnoreGlobs = ignoreGlobs;
+  watchmanSubscribe(watcher, since);
+  return true;
+}
@@ -14,8 +14,10 @@ public:
   ~WatchmanBackend();
   void writeSnapshot(Watcher &watcher, std::string *snapshotPath) override;
   void getEventsSince(Watcher &watcher, std::string *snapshotPath) override;
+  void updateSnapshot(Watcher &watcher, std::string *snapshotPath) override;
   void subscribe(Watcher &watcher) override;
   void unsubscribe(Watcher &watcher) override;
+  bool updateIgnores(Watcher &watcher, std::unordered_set<std::string> ignorePaths, std::unordered_set<Glob> ignoreGlobs) override;
 private:
   std::unique_ptr<IPC> mIPC;
   Signal mRequestSignal;
@@ -23,11 +25,16 @@ private:
   BSER::Object mResponse;
   std::string mError;
   std::unordered_map<std::string, Watcher *> mSubscriptions;
+  // The clock each subscription has delivered the changes up to.
+  std::unordered_map<std::string, std::string> mClocks;
   bool mStopped;
   Signal mEndedSignal;
 
   std::string clock(Watcher &watcher);
+  std::string since(Watcher &watcher, std::string &clock);
   void watchmanWatch(std::string dir);
+  void watchmanSubscribe(Watcher &watcher, const std::string &since);
+  void watchmanUnsubscribe(Watcher &watcher);
   BSER::Object watchmanRequest(BSER cmd);
   void handleSubscription(BSER::Object obj);
 };
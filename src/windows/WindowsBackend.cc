@@ -1,6 +1,7 @@
 #include <string>
 #include <stack>
 #include "../DirTree.hh"
+#include "../Abort.hh"
 #include "../shared/BruteForceBackend.hh"
 #include "./WindowsBackend.hh"
 #include "./win_utils.hh"
@@ -8,13 +9,23 @@
 #define DEFAULT_BUF_SIZE 1024 * 1024
 #define NETWORK_BUF_SIZE 64 * 1024
 #define CONVERT_TIME(ft) ULARGE_INTEGER{ft.dwLowDateTime, ft.dwHighDateTime}.QuadPart
+#define CONVERT_SIZE(data) ULARGE_INTEGER{data.nFileSizeLow, data.nFileSizeHigh}.QuadPart
 
-void BruteForceBackend::readTree(Watcher &watcher, std::shared_ptr<DirTree> tree) {
+void BruteForceBackend::readTree(Watcher &watcher, std::shared_ptr<DirTree> tree, const std::string &dir) {
   std::stack<std::string> directories;
 
-  directories.push(watcher.mDir);
+  directories.push(dir);
+
+  // The directory itself is added by its parent, unless only part of the watched directory is read.
+  if (dir != watcher.mDir) {
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (GetFileAttributesEx(dir.c_str(), GetFileExInfoStandard, &data)) {
+      tree->add(dir, CONVERT_TIME(data.ftLastWriteTime), true);
+    }
+  }
 
   while (!directories.empty()) {
+    AbortFlag::check();
     HANDLE hFind = INVALID_HANDLE_VALUE;
 
     std::string path = directories.top();
@@ -25,7 +36,7 @@ void BruteForceBackend::readTree(Watcher &watcher, std::shared_ptr<DirTree> tree
     hFind = FindFirstFile(spec.c_str(), &ffd);
 
     if (hFind == INVALID_HANDLE_VALUE)  {
-      if (path == watcher.mDir) {
+      if (path == dir) {
         FindClose(hFind);
         throw WatcherError("Error opening directory", &watcher);
       }
@@ -41,7 +52,7 @@ void BruteForceBackend::readTree(Watcher &watcher, std::shared_ptr<DirTree> tree
           continue;
         }
 
-        tree->add(fullPath, CONVERT_TIME(ffd.ftLastWriteTime), ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+        tree->add(fullPath, CONVERT_TIME(ffd.ftLastWriteTime), ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY, CONVERT_SIZE(ffd));
         if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
           directories.push(fullPath);
         }
@@ -181,7 +192,7 @@ public:
         DWORD attrs = GetFileAttributesW(utf8ToUtf16(mWatcher->mDir).data());
         bool isDir = attrs != INVALID_FILE_ATTRIBUTES && (attrs & FILE_ATTRIBUTE_DIRECTORY);
         if (!isDir) {
-          mWatcher->mEvents.remove(mWatcher->mDir);
+          mWatcher->mEvents.remove(mWatcher->mDir, true);
           mTree->remove(mWatcher->mDir);
           mWatcher->notify();
           stop();
@@ -198,17 +209,20 @@ public:
     std::swap(mWriteBuffer, mReadBuffer);
     poll();
 
-    // Read change events
-    BYTE *base = mReadBuffer.data();
-    while (true) {
-      PFILE_NOTIFY_INFORMATION info = (PFILE_NOTIFY_INFORMATION)base;
-      processEvent(info);
+    // Read change events. The ignore sets they are checked with may be swapped by updateIgnores.
+    {
+      std::unique_lock<std::mutex> lock(mBackend->mMutex);
+      BYTE *base = mReadBuffer.data();
+      while (true) {
+        PFILE_NOTIFY_INFORMATION info = (PFILE_NOTIFY_INFORMATION)base;
+        processEvent(info);
 
-      if (info->NextEntryOffset == 0) {
-        break;
-      }
+        if (info->NextEntryOffset == 0) {
+          break;
+        }
 
-      base += info->NextEntryOffset;
+        base += info->NextEntryOffset;
+      }
     }
 
     mWatcher->notify();
@@ -225,15 +239,15 @@ public:
       case FILE_ACTION_RENAMED_NEW_NAME: {
         WIN32_FILE_ATTRIBUTE_DATA data;
         if (GetFileAttributesExW(utf8ToUtf16(path).data(), GetFileExInfoStandard, &data)) {
-          mWatcher->mEvents.create(path);
-          mTree->add(path, CONVERT_TIME(data.ftLastWriteTime), data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+          mWatcher->mEvents.create(path, data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+          mTree->add(path, CONVERT_TIME(data.ftLastWriteTime), data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY, CONVERT_SIZE(data));
         }
         break;
       }
       case FILE_ACTION_MODIFIED: {
         WIN32_FILE_ATTRIBUTE_DATA data;
         if (GetFileAttributesExW(utf8ToUtf16(path).data(), GetFileExInfoStandard, &data)) {
-          mTree->update(path, CONVERT_TIME(data.ftLastWriteTime));
+          mTree->update(path, CONVERT_TIME(data.ftLastWriteTime), CONVERT_SIZE(data));
           if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
             mWatcher->mEvents.update(path);
           }
@@ -241,10 +255,12 @@ public:
         break;
       }
       case FILE_ACTION_REMOVED:
-      case FILE_ACTION_RENAMED_OLD_NAME:
-        mWatcher->mEvents.remove(path);
+      case FILE_ACTION_RENAMED_OLD_NAME: {
+        DirEntry *entry = mTree->find(path);
+        mWatcher->mEvents.remove(path, entry && entry->isDir);
         mTree->remove(path);
         break;
+      }
     }
   }
 
@@ -259,7 +275,7 @@ private:
   OVERLAPPED mOverlapped;
 };
 
-// This function is called by Backend::watch which takes a lock on mMutex
+// This function is called by Backend::watch which takes a lock on the root's mutex.
 void WindowsBackend::subscribe(Watcher &watcher) {
   // Create a subscription for this watcher
   Subscription *sub = new Subscription(this, &watcher, getTree(watcher, false));
@@ -276,8 +292,31 @@ void WindowsBackend::subscribe(Watcher &watcher) {
   }
 }
 
-// This function is called by Backend::unwatch which takes a lock on mMutex
+// This function is called by Backend::unwatch which takes a lock on the root's mutex.
 void WindowsBackend::unsubscribe(Watcher &watcher) {
   Subscription *sub = (Subscription *)watcher.state;
   delete sub;
 }
+
+// The whole directory is watched and ignored paths are filtered out as events arrive, so new
+// ignore sets only need to be swapped in. A tree that was read already is brought in line with
+// them.
+// This function is called by Backend::watch and unwatch which take a lock on the root's mutex.
+bool WindowsBackend::updateIgnores(Watcher &watcher, std::unordered_set<std::string> ignorePaths, std::unordered_set<Glob> ignoreGlobs) {
+  std::unordered_set<std::string> previousPaths;
+  std::unordered_set<Glob> previousGlobs;
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    previousPaths.swap(watcher.mIgnorePaths);
+    previousGlobs.swap(watcher.mIgnoreGlobs);
+    watcher.mIgnorePaths = ignorePaths;
+    watcher.mIgnoreGlobs = ignoreGlobs;
+  }
+
+  std::shared_ptr<DirTree> tree = getTree(watcher, false);
+  if (tree->isComplete) {
+    updateTree(watcher, tree, previousPaths, previousGlobs, nullptr, nullptr);
+  }
+
+  return true;
+}
@@ -11,6 +11,7 @@ public:
   ~WindowsBackend();
   void subscribe(Watcher &watcher) override;
   void unsubscribe(Watcher &watcher) override;
+  bool updateIgnores(Watcher &watcher, std::unordered_set<std::string> ignorePaths, std::unordered_set<Glob> ignoreGlobs) override;
 private:
   bool mRunning;
 };
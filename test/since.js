@@ -23,6 +23,19 @@ let c = 0;
 const getFilename = (...dir) =>
   path.join(tmpDir, ...dir, `test${c++}${Math.random().toString(31).slice(2)}`);
 
+// Creates a directory with the given number of subdirectories, holding empty files.
+const createTree = async (dir, dirs, filesPerDir) => {
+  for (let i = 0; i < dirs; i++) {
+    let d = path.join(dir, `dir${i}`);
+    await fs.mkdirp(d);
+    await Promise.all(
+      Array.from({length: filesPerDir}, (_, j) =>
+        fs.writeFile(path.join(d, `file${j}`), ''),
+      ),
+    );
+  }
+};
+
 function testPrecision() {
   let f = getFilename();
   fs.writeFileSync(f, '.');
@@ -507,6 +520,139 @@ describe('since', () => {
         });
       });
 
+      describe('live', () => {
+        it('should answer from a live subscription', async () => {
+          let f = getFilename();
+          let sub = await watcher.subscribe(tmpDir, () => {}, {backend});
+          try {
+            await watcher.writeSnapshot(tmpDir, snapshotPath, {backend});
+            if (isSecondPrecision) {
+              await sleep(1000);
+            }
+
+            await fs.writeFile(f, 'hello world');
+            await sleep(100);
+
+            let res = await watcher.getEventsSince(tmpDir, snapshotPath, {
+              backend,
+            });
+            assert.deepEqual(res, [{type: 'create', path: f}]);
+            assert.equal(res.live, ['inotify', 'windows'].includes(backend));
+          } finally {
+            await sub.unsubscribe();
+          }
+        });
+
+        it('should not be live without a subscription', async () => {
+          await watcher.writeSnapshot(tmpDir, snapshotPath, {backend});
+          let res = await watcher.getEventsSince(tmpDir, snapshotPath, {
+            backend,
+          });
+          assert.equal(res.live, false);
+        });
+      });
+
+      describe('in-memory snapshots', () => {
+        it('should diff a snapshot against the file system', async () => {
+          let f = getFilename();
+          let snapshot = await watcher.captureSnapshot(tmpDir, {backend});
+          assert.equal(snapshot.dir, tmpDir);
+          if (isSecondPrecision) {
+            await sleep(1000);
+          }
+
+          await fs.writeFile(f, 'hello world');
+          await sleep();
+
+          let res = await watcher.getEventsSince(tmpDir, snapshot, {backend});
+          assert.deepEqual(res, [{type: 'create', path: f}]);
+        });
+
+        it('should diff two snapshots', async () => {
+          let f1 = getFilename();
+          let f2 = getFilename();
+          await fs.writeFile(f1, 'hello world');
+          await sleep();
+          let a = await watcher.captureSnapshot(tmpDir, {backend});
+
+          await fs.unlink(f1);
+          await fs.writeFile(f2, 'hello world');
+          await sleep();
+          let b = await watcher.captureSnapshot(tmpDir, {backend});
+
+          assert.deepEqual(await b.getEventsSince(a), [
+            {type: 'delete', path: f1},
+            {type: 'create', path: f2},
+          ]);
+          assert.deepEqual(await a.getEventsSince(a), []);
+        });
+
+        it('should reject a snapshot of another directory', async () => {
+          let dir = getFilename();
+          await fs.mkdir(dir);
+          let snapshot = await watcher.captureSnapshot(dir, {backend});
+          let other = await watcher.captureSnapshot(tmpDir, {backend});
+
+          await assert.rejects(
+            watcher.getEventsSince(tmpDir, snapshot, {backend}),
+            /was captured from/,
+          );
+          await assert.rejects(other.getEventsSince(snapshot), /was captured from/);
+        });
+
+        it('should write a snapshot to a file', async () => {
+          let f = getFilename();
+          let snapshot = await watcher.captureSnapshot(tmpDir, {backend});
+          await snapshot.write(snapshotPath);
+          if (isSecondPrecision) {
+            await sleep(1000);
+          }
+
+          await fs.writeFile(f, 'hello world');
+          await sleep();
+
+          let res = await watcher.getEventsSince(tmpDir, snapshotPath, {
+            backend: 'brute-force',
+          });
+          assert.deepEqual(res, [{type: 'create', path: f}]);
+        });
+      });
+
+      describe('updateSnapshot', () => {
+        it('should return changes and replace the snapshot', async function () {
+          this.timeout(5000);
+          let f1 = getFilename();
+          let f2 = getFilename();
+          await watcher.writeSnapshot(tmpDir, snapshotPath, {backend});
+          if (isSecondPrecision) {
+            await sleep(1000);
+          }
+
+          await fs.writeFile(f1, 'hello world');
+          await sleep();
+
+          let res = await watcher.updateSnapshot(tmpDir, snapshotPath, {
+            backend,
+          });
+          assert.deepEqual(res, [{type: 'create', path: f1}]);
+
+          await fs.writeFile(f2, 'hello world');
+          await sleep();
+
+          res = await watcher.getEventsSince(tmpDir, snapshotPath, {backend});
+          assert.deepEqual(res, [{type: 'create', path: f2}]);
+        });
+
+        it('should create a missing snapshot', async () => {
+          await fs.remove(snapshotPath);
+          let res = await watcher.updateSnapshot(tmpDir, snapshotPath, {
+            backend,
+          });
+          assert.deepEqual(res, []);
+          assert(await fs.pathExists(snapshotPath));
+        });
+      });
+
       describe('errors', () => {
         it('should error if the watched directory does not exist', async () => {
           let dir = path.join(
@@ -548,4 +694,484 @@ describe('since', () => {
       });
     });
   });
+
+  describe('compact', () => {
+    const backend = 'brute-force';
+
+    it('should write and read compact snapshots', async () => {
+      let f1 = getFilename();
+      let f2 = getFilename();
+      await fs.writeFile(f1, 'hello world');
+      await sleep();
+
+      await watcher.writeSnapshot(tmpDir, snapshotPath, {backend});
+      let size = (await fs.stat(snapshotPath)).size;
+      await watcher.writeSnapshot(tmpDir, snapshotPath, {backend, compact: true});
+      assert((await fs.stat(snapshotPath)).size < size);
+      if (isSecondPrecision) {
+        await sleep(1000);
+      }
+
+      await fs.unlink(f1);
+      await fs.writeFile(f2, 'hello world');
+      await sleep();
+
+      let res = await watcher.updateSnapshot(tmpDir, snapshotPath, {backend});
+      assert.deepEqual(res, [
+        {type: 'delete', path: f1},
+        {type: 'create', path: f2},
+      ]);
+      assert((await fs.stat(snapshotPath)).size < size);
+    });
+  });
+
+  describe('hash', () => {
+    const backend = 'brute-force';
+
+    it('should not report files whose contents did not change', async () => {
+      let f1 = getFilename();
+      let f2 = getFilename();
+      await fs.writeFile(f1, 'hello world');
+      await fs.writeFile(f2, 'hello world');
+      await sleep();
+      await watcher.writeSnapshot(tmpDir, snapshotPath, {backend, hash: true});
+      if (isSecondPrecision) {
+        await sleep(1000);
+      }
+
+      let now = new Date();
+      await fs.utimes(f1, now, now);
+      await fs.writeFile(f2, 'hello there');
+      await sleep();
+
+      let res = await watcher.getEventsSince(tmpDir, snapshotPath, {backend});
+      assert.deepEqual(res, [{type: 'update', path: f2}]);
+    });
+  });
+
+  describe('subpath', () => {
+    const backend = 'brute-force';
+
+    it('should only query and update the subpath', async () => {
+      let d1 = getFilename();
+      let d2 = getFilename();
+      await fs.mkdir(d1);
+      await fs.mkdir(d2);
+      await sleep();
+      await watcher.writeSnapshot(tmpDir, snapshotPath, {backend});
+      if (isSecondPrecision) {
+        await sleep(1000);
+      }
+
+      let f1 = path.join(d1, 'a');
+      let f2 = path.join(d2, 'b');
+      await fs.writeFile(f1, 'hello world');
+      await fs.writeFile(f2, 'hello world');
+      await sleep();
+
+      let res = await watcher.getEventsSince(tmpDir, snapshotPath, {backend, subpath: path.basename(d1)});
+      assert.deepEqual(res, [{type: 'create', path: f1}]);
+
+      res = await watcher.updateSnapshot(tmpDir, snapshotPath, {backend, subpath: path.basename(d1)});
+      assert.deepEqual(res, [{type: 'create', path: f1}]);
+
+      res = await watcher.getEventsSince(tmpDir, snapshotPath, {backend});
+      assert.deepEqual(res, [{type: 'create', path: f2}]);
+    });
+  });
+
+  describe('hasChanged', () => {
+    const backend = 'brute-force';
+
+    it('should only report changes below the subpath', async () => {
+      let d1 = getFilename();
+      let d2 = getFilename();
+      await fs.mkdir(d1);
+      await fs.mkdir(d2);
+      await fs.writeFile(path.join(d1, 'a'), 'hello world');
+      await sleep();
+      await watcher.writeSnapshot(tmpDir, snapshotPath, {backend});
+      if (isSecondPrecision) {
+        await sleep(1000);
+      }
+
+      assert.equal(await watcher.hasChanged(tmpDir, snapshotPath, {backend}), false);
+
+      await fs.writeFile(path.join(d1, 'a'), 'hello there');
+      await sleep();
+
+      assert.equal(await watcher.hasChanged(tmpDir, snapshotPath, {backend}), true);
+      assert.equal(await watcher.hasChanged(tmpDir, snapshotPath, {backend, subpath: path.basename(d1)}), true);
+      assert.equal(await watcher.hasChanged(tmpDir, snapshotPath, {backend, subpath: path.basename(d2)}), false);
+    });
+  });
+
+  describe('batch', () => {
+    const backend = 'brute-force';
+
+    it('should return the events of each directory', async () => {
+      let d1 = getFilename();
+      let d2 = getFilename();
+      await fs.mkdir(d1);
+      await fs.mkdir(d2);
+      await sleep();
+      await watcher.batchWriteSnapshot([d1, d2], snapshotPath, {backend});
+      if (isSecondPrecision) {
+        await sleep(1000);
+      }
+
+      let f1 = path.join(d1, 'a');
+      await fs.writeFile(f1, 'hello world');
+      await sleep();
+
+      let res = await watcher.batchGetEventsSince([d1, d2, tmpDir], snapshotPath, {backend});
+      assert.deepEqual(res, [[{type: 'create', path: f1}], [], []]);
+    });
+
+    it('should resolve relative ignore paths against each directory', async () => {
+      let d1 = getFilename();
+      let d2 = getFilename();
+      await fs.mkdirp(path.join(d1, 'node_modules'));
+      await fs.mkdirp(path.join(d2, 'node_modules'));
+      await sleep();
+      assert.notEqual(path.dirname(d1), process.cwd());
+
+      let opts = {backend, ignore: ['node_modules']};
+      await watcher.batchWriteSnapshot([d1, d2], snapshotPath, opts);
+      if (isSecondPrecision) {
+        await sleep(1000);
+      }
+
+      let f1 = path.join(d1, 'a');
+      await fs.writeFile(f1, 'hello world');
+      await fs.writeFile(path.join(d1, 'node_modules', 'b'), 'hello world');
+      await fs.writeFile(path.join(d2, 'node_modules', 'b'), 'hello world');
+      await sleep();
+
+      let res = await watcher.batchGetEventsSince([d1, d2], snapshotPath, opts);
+      assert.deepEqual(res, [[{type: 'create', path: f1}], []]);
+    });
+  });
+
+  describe('worker pool', () => {
+    const backend = 'brute-force';
+
+    after(() => {
+      watcher.setWorkerPoolSize(4);
+    });
+
+    it('should not run more operations at once than the size of the pool', async () => {
+      let large = getFilename();
+      let small = getFilename();
+      await createTree(large, 20, 250);
+      await fs.mkdir(small);
+      await sleep();
+
+      // The small directory is only crawled once the large one is done.
+      watcher.setWorkerPoolSize(1);
+      let order = [];
+      await Promise.all([
+        watcher
+          .writeSnapshot(large, getFilename(), {backend})
+          .then(() => order.push(large)),
+        watcher
+          .writeSnapshot(small, getFilename(), {backend})
+          .then(() => order.push(small)),
+      ]);
+      assert.deepEqual(order, [large, small]);
+    });
+
+    it('should throw for an invalid size', () => {
+      assert.throws(() => watcher.setWorkerPoolSize(0));
+    });
+  });
+
+  describe('crawl sharing', () => {
+    const backend = 'brute-force';
+
+    after(() => {
+      watcher.setCrawlTTL(0);
+    });
+
+    it('should share a crawl between concurrent queries', async () => {
+      let s1 = getFilename();
+      let s2 = getFilename();
+      await watcher.writeSnapshot(tmpDir, s1, {backend});
+      if (isSecondPrecision) {
+        await sleep(1000);
+      }
+
+      let f1 = getFilename();
+      await fs.writeFile(f1, 'hello world');
+      await sleep();
+      await watcher.writeSnapshot(tmpDir, s2, {backend});
+
+      let res = await Promise.all([
+        watcher.getEventsSince(tmpDir, s1, {backend}),
+        watcher.getEventsSince(tmpDir, s2, {backend}),
+      ]);
+      assert.deepEqual(res, [[{type: 'create', path: f1}], []]);
+    });
+
+    it('should reuse a recent crawl within the TTL', async () => {
+      let s = getFilename();
+      await watcher.writeSnapshot(tmpDir, s, {backend});
+      watcher.setCrawlTTL(60000);
+      let res = await watcher.getEventsSince(tmpDir, s, {backend});
+      assert.deepEqual(res, []);
+
+      let f1 = getFilename();
+      await fs.writeFile(f1, 'hello world');
+      await sleep();
+
+      res = await watcher.getEventsSince(tmpDir, s, {backend});
+      assert.deepEqual(res, []);
+
+      watcher.setCrawlTTL(0);
+      res = await watcher.getEventsSince(tmpDir, s, {backend});
+      assert.deepEqual(res, [{type: 'create', path: f1}]);
+    });
+  });
+
+  describe('abort', () => {
+    const backend = 'brute-force';
+    // AbortController is only global from Node 15 onwards.
+    const itWithController = typeof AbortController === 'undefined' ? it.skip : it;
+
+    function createSignal() {
+      let listeners = [];
+      let signal = {
+        aborted: false,
+        addEventListener(type, listener) {
+          listeners.push(listener);
+        },
+      };
+
+      return {
+        signal,
+        abort() {
+          signal.aborted = true;
+          listeners.forEach((listener) => listener());
+        },
+      };
+    }
+
+    itWithController('should reject when the signal is already aborted', async () => {
+      let controller = new AbortController();
+      controller.abort();
+
+      await assert.rejects(
+        watcher.getEventsSince(tmpDir, snapshotPath, {backend, signal: controller.signal}),
+        {name: 'AbortError'},
+      );
+
+      await assert.rejects(
+        watcher.writeSnapshot(tmpDir, getFilename(), {backend, signal: controller.signal}),
+        {name: 'AbortError'},
+      );
+    });
+
+    itWithController('should complete when the signal does not fire', async () => {
+      let controller = new AbortController();
+      let s = getFilename();
+      await watcher.writeSnapshot(tmpDir, s, {backend, signal: controller.signal});
+      let res = await watcher.getEventsSince(tmpDir, s, {backend, signal: controller.signal});
+      assert.deepEqual(res, []);
+
+      // The operations no longer listen to the signal once they are done.
+      controller.abort();
+    });
+
+    itWithController('should stop a crawl that is already running', async () => {
+      let dir = getFilename();
+      await createTree(dir, 50, 400);
+      let s = getFilename();
+      await watcher.writeSnapshot(dir, s, {backend});
+
+      let controller = new AbortController();
+      let promise = watcher.getEventsSince(dir, s, {backend, signal: controller.signal});
+      setTimeout(() => controller.abort(), 5);
+      await assert.rejects(promise, {name: 'AbortError'});
+
+      await fs.remove(dir);
+    });
+
+    itWithController('should stop waiting for a crawl started by another query', async () => {
+      let dir = getFilename();
+      await createTree(dir, 50, 400);
+      let s = getFilename();
+      await watcher.writeSnapshot(dir, s, {backend});
+
+      let controller = new AbortController();
+      let first = watcher.getEventsSince(dir, s, {backend});
+      let second = watcher.getEventsSince(dir, s, {backend, signal: controller.signal});
+      setTimeout(() => controller.abort(), 5);
+      await assert.rejects(second, {name: 'AbortError'});
+      assert.deepEqual(await first, []);
+
+      await fs.remove(dir);
+    });
+
+    it('should accept a signal without removeEventListener', async () => {
+      let s = getFilename();
+      await watcher.writeSnapshot(tmpDir, s, {backend, signal: createSignal().signal});
+      let res = await watcher.getEventsSince(tmpDir, s, {backend, signal: createSignal().signal});
+      assert.deepEqual(res, []);
+
+      let controller = createSignal();
+      controller.abort();
+      await assert.rejects(
+        watcher.getEventsSince(tmpDir, s, {backend, signal: controller.signal}),
+        {name: 'AbortError'},
+      );
+    });
+
+    it('should stop a crawl when a signal-like object fires', async () => {
+      let dir = getFilename();
+      await createTree(dir, 50, 400);
+      let s = getFilename();
+      await watcher.writeSnapshot(dir, s, {backend});
+
+      let controller = createSignal();
+      let promise = watcher.getEventsSince(dir, s, {backend, signal: controller.signal});
+      setTimeout(() => controller.abort(), 5);
+      await assert.rejects(promise, {name: 'AbortError'});
+
+      await fs.remove(dir);
+    });
+
+    it('should throw when the signal is not an AbortSignal', () => {
+      assert.throws(
+        () => watcher.getEventsSince(tmpDir, snapshotPath, {backend, signal: {}}),
+        TypeError,
+      );
+
+      assert.throws(
+        () => watcher.writeSnapshot(tmpDir, getFilename(), {backend, signal: 'abort'}),
+        TypeError,
+      );
+    });
+  });
+
+  describe('journal', () => {
+    const backend = 'brute-force';
+    const journalPath = snapshotPath + '.journal';
+
+    after(async () => {
+      try {
+        await fs.unlink(journalPath);
+      } catch (err) {}
+    });
+
+    it('should append changes to the journal', async () => {
+      let f1 = getFilename();
+      let f2 = getFilename();
+      await fs.remove(journalPath);
+      await watcher.writeSnapshot(tmpDir, snapshotPath, {backend, journal: true});
+      let size = (await fs.stat(snapshotPath)).size;
+      if (isSecondPrecision) {
+        await sleep(1000);
+      }
+
+      await fs.writeFile(f1, 'hello world');
+      await sleep();
+      await watcher.writeSnapshot(tmpDir, snapshotPath, {backend, journal: true});
+      assert.equal((await fs.stat(snapshotPath)).size, size);
+      assert((await fs.readFile(journalPath, 'utf8')).includes(f1));
+
+      await fs.writeFile(f2, 'hello world');
+      await sleep();
+
+      let res = await watcher.getEventsSince(tmpDir, snapshotPath, {backend});
+      assert.deepEqual(res, [{type: 'create', path: f2}]);
+    });
+
+    it('should compact the journal', async () => {
+      let f = getFilename();
+      await watcher.writeSnapshot(tmpDir, snapshotPath, {backend, journal: true});
+      await fs.writeFile(f, 'hello world');
+      await sleep();
+
+      await watcher.writeSnapshot(tmpDir, snapshotPath, {
+        backend,
+        journal: 0.0001,
+      });
+      assert(!(await fs.readFile(journalPath, 'utf8')).includes(f));
+
+      let res = await watcher.getEventsSince(tmpDir, snapshotPath, {backend});
+      assert.deepEqual(res, []);
+    });
+  });
+
+  describe('diffSnapshots', () => {
+    const backend = 'brute-force';
+    const otherSnapshotPath = path.join(__dirname, 'snapshot2.txt');
+
+    after(async () => {
+      try {
+        await fs.unlink(otherSnapshotPath);
+      } catch (err) {}
+    });
+
+    it('should diff two snapshot files', async () => {
+      let f1 = getFilename();
+      let f2 = getFilename();
+      let f3 = getFilename();
+      await fs.writeFile(f1, 'hello world');
+      await fs.writeFile(f2, 'hello world');
+      await sleep();
+      await watcher.writeSnapshot(tmpDir, snapshotPath, {backend});
+      if (isSecondPrecision) {
+        await sleep(1000);
+      }
+
+      await fs.unlink(f1);
+      await fs.writeFile(f2, 'hi');
+      await fs.writeFile(f3, 'hello world');
+      await sleep();
+      await watcher.writeSnapshot(tmpDir, otherSnapshotPath, {backend});
+
+      let res = await watcher.diffSnapshots(snapshotPath, otherSnapshotPath);
+      assert.deepEqual(res, [
+        {type: 'delete', path: f1},
+        {type: 'update', path: f2},
+        {type: 'create', path: f3},
+      ]);
+    });
+
+    it('should apply ignore options', async () => {
+      let dir = getFilename();
+      let f1 = getFilename(path.basename(dir));
+      let f2 = getFilename();
+      await fs.mkdir(dir);
+      await sleep();
+      await watcher.writeSnapshot(tmpDir, snapshotPath, {backend});
+
+      await fs.writeFile(f1, 'hello world');
+      await fs.writeFile(f2, 'hello world');
+      await sleep();
+      await watcher.writeSnapshot(tmpDir, otherSnapshotPath, {backend});
+
+      let res = await watcher.diffSnapshots(snapshotPath, otherSnapshotPath, {
+        ignore: [dir],
+      });
+      assert.deepEqual(res, [{type: 'create', path: f2}]);
+
+      res = await watcher.diffSnapshots(snapshotPath, otherSnapshotPath, {
+        ignore: [`${path.basename(dir)}/**`],
+      });
+      assert.deepEqual(res, [{type: 'create', path: f2}]);
+    });
+
+    it('should error if a snapshot does not exist', async () => {
+      let threw = false;
+      try {
+        await watcher.diffSnapshots(snapshotPath, getFilename());
+      } catch (err) {
+        threw = true;
+      }
+
+      assert(threw, 'did not throw');
+    });
+  });
 });
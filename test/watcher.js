@@ -569,6 +569,332 @@ describe('watcher', () => {
         });
       });
 
+      describe('update', () => {
+        it('should report the paths exposed and hidden by new ignore options', async () => {
+          let dir = path.join(
+            fs.realpathSync(require('os').tmpdir()),
+            Math.random().toString(31).slice(2),
+          );
+          fs.mkdirpSync(path.join(dir, 'a'));
+          fs.mkdirpSync(path.join(dir, 'b'));
+          fs.writeFileSync(path.join(dir, 'a', 'test.txt'), 'hello');
+          fs.writeFileSync(path.join(dir, 'b', 'test.txt'), 'hello');
+          await new Promise((resolve) => setTimeout(resolve, 100));
+
+          let events = [];
+          let sub = await watcher.subscribe(
+            dir,
+            (err, e) => {
+              events.push(...e);
+            },
+            {backend, ignore: ['a']},
+          );
+
+          await sub.update({ignore: ['b']});
+          await new Promise((resolve) => setTimeout(resolve, 500));
+          events.sort((a, b) => a.path.localeCompare(b.path));
+          assert.deepEqual(events, [
+            {type: 'create', path: path.join(dir, 'a')},
+            {type: 'create', path: path.join(dir, 'a', 'test.txt')},
+            {type: 'delete', path: path.join(dir, 'b')},
+            {type: 'delete', path: path.join(dir, 'b', 'test.txt')},
+          ]);
+
+          events = [];
+          fs.writeFile(path.join(dir, 'a', 'test2.txt'), 'hello');
+          fs.writeFile(path.join(dir, 'b', 'test2.txt'), 'hello');
+          await new Promise((resolve) => setTimeout(resolve, 500));
+          assert.deepEqual(events, [
+            {type: 'create', path: path.join(dir, 'a', 'test2.txt')},
+          ]);
+
+          await sub.unsubscribe();
+        });
+
+        it('should not miss events while the callback is moved', async () => {
+          let dir = path.join(
+            fs.realpathSync(require('os').tmpdir()),
+            Math.random().toString(31).slice(2),
+          );
+          fs.mkdirpSync(path.join(dir, 'a'));
+          fs.mkdirpSync(path.join(dir, 'b'));
+          await new Promise((resolve) => setTimeout(resolve, 100));
+
+          let events = [];
+          let sub = await watcher.subscribe(
+            dir,
+            (err, e) => {
+              events.push(...e);
+            },
+            {backend, ignore: ['a']},
+          );
+
+          // Another callback keeps the old watcher subscribed.
+          let other = await watcher.subscribe(dir, () => {}, {backend, ignore: ['a']});
+
+          let updating = sub.update({ignore: ['b']});
+          let files = [];
+          for (let i = 0; i < 10; i++) {
+            let f = path.join(dir, `test${i}.txt`);
+            files.push(f);
+            await fs.writeFile(f, 'hello');
+          }
+
+          await updating;
+          await new Promise((resolve) => setTimeout(resolve, 500));
+
+          let created = new Set(
+            events.filter((e) => e.type === 'create').map((e) => e.path),
+          );
+          for (let f of files) {
+            assert(created.has(f), `missed ${f}`);
+          }
+
+          await sub.unsubscribe();
+          await other.unsubscribe();
+        });
+
+        it('should reject once unsubscribed', async () => {
+          let dir = path.join(
+            fs.realpathSync(require('os').tmpdir()),
+            Math.random().toString(31).slice(2),
+          );
+          fs.mkdirpSync(path.join(dir, 'a'));
+          await new Promise((resolve) => setTimeout(resolve, 100));
+
+          let events = [];
+          let sub = await watcher.subscribe(
+            dir,
+            (err, e) => {
+              events.push(...e);
+            },
+            {backend},
+          );
+
+          await sub.unsubscribe();
+          await assert.rejects(sub.update({ignore: ['a']}), /Not subscribed/);
+          await assert.rejects(sub.update({}), /Not subscribed/);
+
+          // The callback was not subscribed with the new options either.
+          fs.writeFile(path.join(dir, 'test.txt'), 'hello');
+          await new Promise((resolve) => setTimeout(resolve, 500));
+          assert.deepEqual(events, []);
+        });
+      });
+
+      describe('pause', () => {
+        it('should deliver the net changes made while paused on resume', async () => {
+          let dir = path.join(
+            fs.realpathSync(require('os').tmpdir()),
+            Math.random().toString(31).slice(2),
+          );
+          fs.mkdirpSync(dir);
+          fs.writeFileSync(path.join(dir, 'test1.txt'), 'hello');
+          await new Promise((resolve) => setTimeout(resolve, 100));
+
+          let calls = [];
+          let sub = await watcher.subscribe(
+            dir,
+            (err, events) => {
+              calls.push(events);
+            },
+            {backend},
+          );
+
+          sub.pause();
+          await fs.writeFile(path.join(dir, 'test2.txt'), 'hello');
+          await fs.writeFile(path.join(dir, 'test3.txt'), 'hello');
+          await fs.unlink(path.join(dir, 'test3.txt'));
+          await fs.unlink(path.join(dir, 'test1.txt'));
+          await new Promise((resolve) => setTimeout(resolve, 500));
+          assert.deepEqual(calls, []);
+
+          sub.resume();
+          await new Promise((resolve) => setTimeout(resolve, 500));
+          assert.equal(calls.length, 1);
+          assert.deepEqual(
+            calls[0].sort((a, b) => a.path.localeCompare(b.path)),
+            [
+              {type: 'delete', path: path.join(dir, 'test1.txt')},
+              {type: 'create', path: path.join(dir, 'test2.txt')},
+            ],
+          );
+
+          await sub.unsubscribe();
+        });
+      });
+
+      describe('immediate', () => {
+        it('should deliver the events matching the immediate globs separately', async () => {
+          let dir = path.join(
+            fs.realpathSync(require('os').tmpdir()),
+            Math.random().toString(31).slice(2),
+          );
+          fs.mkdirpSync(dir);
+          await new Promise((resolve) => setTimeout(resolve, 100));
+
+          let calls = [];
+          let sub = await watcher.subscribe(
+            dir,
+            (err, events) => {
+              calls.push(events);
+            },
+            {backend, immediate: ['**/*.css']},
+          );
+
+          await fs.writeFile(path.join(dir, 'test.js'), 'hello');
+          await fs.writeFile(path.join(dir, 'test.css'), 'hello');
+          await new Promise((resolve) => setTimeout(resolve, 500));
+
+          // The immediate events never wait to be batched with the others.
+          let css = calls.find((events) =>
+            events.some((event) => event.path.endsWith('.css')),
+          );
+          assert.deepEqual(css, [
+            {type: 'create', path: path.join(dir, 'test.css')},
+          ]);
+          assert.deepEqual(
+            calls.flat().filter((event) => event.path.endsWith('.js')),
+            [{type: 'create', path: path.join(dir, 'test.js')}],
+          );
+
+          await sub.unsubscribe();
+        });
+      });
+
+      describe('filters', () => {
+        it('should only call the callback with the events passing its filter', async () => {
+          let dir = path.join(
+            fs.realpathSync(require('os').tmpdir()),
+            Math.random().toString(31).slice(2),
+          );
+          fs.mkdirpSync(dir);
+          fs.writeFileSync(path.join(dir, 'test1.ts'), 'hello');
+          await new Promise((resolve) => setTimeout(resolve, 100));
+
+          let events = [];
+          let sub = await watcher.subscribe(
+            dir,
+            (err, e) => {
+              events.push(...e);
+            },
+            {
+              backend,
+              types: ['create', 'delete'],
+              include: ['**/*.ts'],
+              directories: false,
+            },
+          );
+
+          await fs.writeFile(path.join(dir, 'test1.ts'), 'hello world');
+          await fs.writeFile(path.join(dir, 'test2.ts'), 'hello');
+          await fs.writeFile(path.join(dir, 'test3.js'), 'hello');
+          await fs.mkdir(path.join(dir, 'dir.ts'));
+          await new Promise((resolve) => setTimeout(resolve, 500));
+          assert.deepEqual(events, [
+            {type: 'create', path: path.join(dir, 'test2.ts')},
+          ]);
+
+          await sub.unsubscribe();
+        });
+      });
+
+      describe('flush', () => {
+        it('should deliver the pending events before resolving', async () => {
+          let dir = path.join(
+            fs.realpathSync(require('os').tmpdir()),
+            Math.random().toString(31).slice(2),
+          );
+          fs.mkdirpSync(dir);
+          await new Promise((resolve) => setTimeout(resolve, 100));
+
+          let calls = [];
+          let sub = await watcher.subscribe(
+            dir,
+            (err, events) => {
+              calls.push(events);
+            },
+            {backend},
+          );
+
+          await fs.writeFile(path.join(dir, 'test.txt'), 'hello');
+          await sub.flush();
+          assert.deepEqual(calls, [
+            [{type: 'create', path: path.join(dir, 'test.txt')}],
+          ]);
+
+          await fs.writeFile(path.join(dir, 'test.txt'), 'hello world');
+          await watcher.flush(dir, {backend});
+          assert.equal(calls.length, 2);
+          assert.deepEqual(calls[1], [
+            {type: 'update', path: path.join(dir, 'test.txt')},
+          ]);
+
+          await sub.unsubscribe();
+        });
+      });
+
+      describe('worker threads', () => {
+        it('should deliver events to subscriptions made in a worker thread', async () => {
+          let dir = path.join(
+            fs.realpathSync(require('os').tmpdir()),
+            Math.random().toString(31).slice(2),
+          );
+          fs.mkdirpSync(dir);
+          await new Promise((resolve) => setTimeout(resolve, 100));
+
+          let {Worker} = require('worker_threads');
+          let worker = new Worker(
+            `
+            const {parentPort, workerData} = require('worker_threads');
+            const watcher = require(workerData.watcher);
+            watcher
+              .subscribe(workerData.dir, (err, events) => parentPort.postMessage(events), {
+                backend: workerData.backend,
+              })
+              .then(() => parentPort.postMessage('ready'));
+            `,
+            {
+              eval: true,
+              workerData: {watcher: require.resolve('../'), dir, backend},
+            },
+          );
+
+          let messages = [];
+          let nextMessage = () =>
+            new Promise((resolve) => worker.once('message', resolve));
+          assert.equal(await nextMessage(), 'ready');
+
+          // The main thread shares the worker's native watches of the directory.
+          let sub = await watcher.subscribe(
+            dir,
+            (err, events) => {
+              messages.push(events);
+            },
+            {backend},
+          );
+
+          fs.writeFile(path.join(dir, 'test.txt'), 'hello');
+          assert.deepEqual(await nextMessage(), [
+            {type: 'create', path: path.join(dir, 'test.txt')},
+          ]);
+          await new Promise((resolve) => setTimeout(resolve, 100));
+          assert.deepEqual(messages, [
+            [{type: 'create', path: path.join(dir, 'test.txt')}],
+          ]);
+
+          // Terminating the worker unsubscribes it, while the main thread keeps watching.
+          await worker.terminate();
+          fs.writeFile(path.join(dir, 'test2.txt'), 'hello');
+          await new Promise((resolve) => setTimeout(resolve, 500));
+          assert.deepEqual(messages[1], [
+            {type: 'create', path: path.join(dir, 'test2.txt')},
+          ]);
+
+          await sub.unsubscribe();
+        });
+      });
+
       describe('multiple', () => {
         it('should support multiple watchers for the same directory', async () => {
           let dir = path.join(
@@ -645,6 +971,127 @@ describe('watcher', () => {
           ]);
         });
 
+        it('should not miss events while a wider watcher joins', async () => {
+          let dir = path.join(
+            fs.realpathSync(require('os').tmpdir()),
+            Math.random().toString(31).slice(2),
+          );
+          fs.mkdirpSync(path.join(dir, 'ignored'));
+          await new Promise((resolve) => setTimeout(resolve, 100));
+
+          let events = [];
+          let sub1 = await watcher.subscribe(
+            dir,
+            (err, e) => {
+              events.push(...e);
+            },
+            {backend, ignore: [path.join(dir, 'ignored')]},
+          );
+
+          // The second watcher needs the ignored directory, so the shared watch is widened while
+          // the files are written.
+          let joining = watcher.subscribe(dir, () => {}, {backend});
+          let files = [];
+          for (let i = 0; i < 10; i++) {
+            let f = path.join(dir, `test${i}.txt`);
+            files.push(f);
+            await fs.writeFile(f, 'hello');
+          }
+
+          let sub2 = await joining;
+          await new Promise((resolve) => setTimeout(resolve, 500));
+
+          // Replaying the events since the previous watch may report some of them twice.
+          let created = new Set(
+            events.filter((e) => e.type === 'create').map((e) => e.path),
+          );
+          assert.deepEqual([...created].sort(), files.sort());
+
+          await sub1.unsubscribe();
+          await sub2.unsubscribe();
+        });
+
+        it('should keep watching a directory after one of its watchers unsubscribes', async () => {
+          let dir = path.join(
+            fs.realpathSync(require('os').tmpdir()),
+            Math.random().toString(31).slice(2),
+          );
+          fs.mkdirpSync(dir);
+          await new Promise((resolve) => setTimeout(resolve, 100));
+
+          let sub1 = await watcher.subscribe(dir, () => {}, {
+            backend,
+            ignore: [path.join(dir, 'test1.txt')],
+          });
+          let l = new Promise(async (resolve) => {
+            let sub = await watcher.subscribe(
+              dir,
+              async (err, events) => {
+                setImmediate(async () => {
+                  await sub.unsubscribe();
+
+                  resolve(events);
+                });
+              },
+              {backend},
+            );
+          });
+          await new Promise((resolve) => setTimeout(resolve, 100));
+
+          await sub1.unsubscribe();
+          fs.writeFile(path.join(dir, 'test1.txt'), 'test1');
+
+          let res = await l;
+          assert.deepEqual(res, [
+            {type: 'create', path: path.join(dir, 'test1.txt')},
+          ]);
+        });
+
+        it('should support watchers for a directory and one of its sub-directories', async () => {
+          let dir = path.join(
+            fs.realpathSync(require('os').tmpdir()),
+            Math.random().toString(31).slice(2),
+          );
+          let subdir = path.join(dir, 'sub');
+          fs.mkdirpSync(subdir);
+          await new Promise((resolve) => setTimeout(resolve, 100));
+
+          function listen(dir) {
+            return new Promise(async (resolve) => {
+              let sub = await watcher.subscribe(
+                dir,
+                async (err, events) => {
+                  setImmediate(async () => {
+                    await sub.unsubscribe();
+
+                    resolve(events);
+                  });
+                },
+                {backend},
+              );
+            });
+          }
+
+          let l1 = listen(dir);
+          let l2 = listen(subdir);
+          await new Promise((resolve) => setTimeout(resolve, 100));
+
+          fs.writeFile(path.join(dir, 'test1.txt'), 'test1');
+          fs.writeFile(path.join(subdir, 'test2.txt'), 'test2');
+
+          let [res1, res2] = await Promise.all([l1, l2]);
+          assert.deepEqual(
+            res1.sort((a, b) => a.path.localeCompare(b.path)),
+            [
+              {type: 'create', path: path.join(subdir, 'test2.txt')},
+              {type: 'create', path: path.join(dir, 'test1.txt')},
+            ].sort((a, b) => a.path.localeCompare(b.path)),
+          );
+          assert.deepEqual(res2, [
+            {type: 'create', path: path.join(subdir, 'test2.txt')},
+          ]);
+        });
+
         it('should support multiple watchers for different directories', async () => {
           let dir1 = path.join(
             fs.realpathSync(require('os').tmpdir()),
@@ -738,6 +1185,166 @@ describe('watcher', () => {
         });
       });
 
+      describe('resubscribing', () => {
+        it('should see the changes made between subscriptions', async () => {
+          let dir = path.join(
+            fs.realpathSync(require('os').tmpdir()),
+            Math.random().toString(31).slice(2),
+          );
+          let snapshot = path.join(
+            fs.realpathSync(require('os').tmpdir()),
+            Math.random().toString(31).slice(2),
+          );
+          fs.mkdirpSync(path.join(dir, 'sub'));
+          await fs.writeFile(path.join(dir, 'a.txt'), 'a');
+          await fs.writeFile(path.join(dir, 'sub', 'b.txt'), 'b');
+          await new Promise((resolve) => setTimeout(resolve, 100));
+
+          let sub = await watcher.subscribe(dir, () => {}, {backend});
+          await sub.unsubscribe();
+
+          await fs.writeFile(path.join(dir, 'a.txt'), 'changed');
+          await fs.unlink(path.join(dir, 'sub', 'b.txt'));
+          fs.mkdirpSync(path.join(dir, 'new'));
+          await fs.writeFile(path.join(dir, 'new', 'c.txt'), 'c');
+          await new Promise((resolve) => setTimeout(resolve, 100));
+
+          // The snapshot is written from the subscription's tree, and should match a fresh crawl.
+          sub = await watcher.subscribe(dir, () => {}, {backend});
+          await watcher.writeSnapshot(dir, snapshot, {backend});
+          await sub.unsubscribe();
+
+          let since = await watcher.getEventsSince(dir, snapshot, {backend});
+          assert.deepEqual(since, []);
+        });
+
+        if (backend === 'inotify') {
+          it('should revalidate a retained tree until it is evicted', async () => {
+            let dir = path.join(
+              fs.realpathSync(require('os').tmpdir()),
+              Math.random().toString(31).slice(2),
+            );
+            let snapshot = path.join(
+              fs.realpathSync(require('os').tmpdir()),
+              Math.random().toString(31).slice(2),
+            );
+            fs.mkdirpSync(path.join(dir, 'sub'));
+            await fs.utimes(path.join(dir, 'sub'), 1000000, 1000000);
+
+            // Adds a file without changing the mtime of its directory. Revalidating a retained
+            // tree only lists the directories whose mtime changed, so it misses the file, while
+            // crawling from scratch finds it.
+            let addHidden = async (name) => {
+              await fs.writeFile(path.join(dir, 'sub', name), name);
+              await fs.utimes(path.join(dir, 'sub'), 1000000, 1000000);
+            };
+
+            let resubscribe = async () => {
+              let sub = await watcher.subscribe(dir, () => {}, {backend});
+              await watcher.writeSnapshot(dir, snapshot, {backend});
+              await sub.unsubscribe();
+              return watcher.getEventsSince(dir, snapshot, {backend});
+            };
+
+            try {
+              watcher.setTreeCacheSize(64 * 1024 * 1024);
+              let sub = await watcher.subscribe(dir, () => {}, {backend});
+              await sub.unsubscribe();
+
+              await addHidden('a.txt');
+              assert.deepEqual(await resubscribe(), [
+                {type: 'create', path: path.join(dir, 'sub', 'a.txt')},
+              ]);
+
+              // Shrinking the cache evicts the retained tree, so the next subscription crawls.
+              watcher.setTreeCacheSize(0);
+              await addHidden('b.txt');
+              assert.deepEqual(await resubscribe(), []);
+            } finally {
+              watcher.setTreeCacheSize(64 * 1024 * 1024);
+            }
+          });
+
+          it('should emit the changes made since the cache was written', async () => {
+            let dir = path.join(
+              fs.realpathSync(require('os').tmpdir()),
+              Math.random().toString(31).slice(2),
+            );
+            let cache = path.join(
+              fs.realpathSync(require('os').tmpdir()),
+              Math.random().toString(31).slice(2),
+            );
+            fs.mkdirpSync(path.join(dir, 'sub'));
+            await fs.writeFile(path.join(dir, 'a.txt'), 'a');
+            await fs.writeFile(path.join(dir, 'sub', 'b.txt'), 'b');
+            await new Promise((resolve) => setTimeout(resolve, 100));
+
+            let sub = await watcher.subscribe(dir, () => {}, {backend, cache});
+            await sub.unsubscribe();
+            assert(fs.existsSync(cache));
+
+            // Drop the tree kept in memory, as if the process had restarted.
+            watcher.setTreeCacheSize(0);
+            watcher.setTreeCacheSize(64 * 1024 * 1024);
+
+            await fs.writeFile(path.join(dir, 'a.txt'), 'changed');
+            await fs.unlink(path.join(dir, 'sub', 'b.txt'));
+            fs.mkdirpSync(path.join(dir, 'new'));
+            await fs.writeFile(path.join(dir, 'new', 'c.txt'), 'c');
+            await new Promise((resolve) => setTimeout(resolve, 100));
+
+            let events = await new Promise(async (resolve) => {
+              sub = await watcher.subscribe(dir, (err, events) => resolve(events), {backend, cache});
+            });
+            await sub.unsubscribe();
+
+            events.sort((a, b) => a.path.localeCompare(b.path));
+            assert.deepEqual(events, [
+              {type: 'update', path: path.join(dir, 'a.txt')},
+              {type: 'create', path: path.join(dir, 'new')},
+              {type: 'create', path: path.join(dir, 'new', 'c.txt')},
+              {type: 'delete', path: path.join(dir, 'sub', 'b.txt')},
+            ]);
+          });
+
+          it('should not emit the directories changed since the cache was written when filtered', async () => {
+            let dir = path.join(
+              fs.realpathSync(require('os').tmpdir()),
+              Math.random().toString(31).slice(2),
+            );
+            let cache = path.join(
+              fs.realpathSync(require('os').tmpdir()),
+              Math.random().toString(31).slice(2),
+            );
+            fs.mkdirpSync(path.join(dir, 'old'));
+            await new Promise((resolve) => setTimeout(resolve, 100));
+
+            let sub = await watcher.subscribe(dir, () => {}, {backend, cache});
+            await sub.unsubscribe();
+            watcher.setTreeCacheSize(0);
+            watcher.setTreeCacheSize(64 * 1024 * 1024);
+
+            await fs.remove(path.join(dir, 'old'));
+            fs.mkdirpSync(path.join(dir, 'new'));
+            await fs.writeFile(path.join(dir, 'new', 'c.txt'), 'c');
+            await new Promise((resolve) => setTimeout(resolve, 100));
+
+            let events = await new Promise(async (resolve) => {
+              sub = await watcher.subscribe(dir, (err, events) => resolve(events), {
+                backend,
+                cache,
+                directories: false,
+              });
+            });
+            await sub.unsubscribe();
+
+            assert.deepEqual(events, [
+              {type: 'create', path: path.join(dir, 'new', 'c.txt')},
+            ]);
+          });
+        }
+      });
+
       describe('errors', () => {
         it('should error if the watched directory does not exist', async () => {
           let dir = path.join(
@@ -788,6 +1395,32 @@ describe('watcher', () => {
 
           assert(threw, 'did not throw');
         });
+
+        it('should error if the signal is already aborted', async function () {
+          if (typeof AbortController === 'undefined') {
+            this.skip();
+          }
+
+          let dir = path.join(
+            fs.realpathSync(require('os').tmpdir()),
+            Math.random().toString(31).slice(2),
+          );
+          fs.mkdirpSync(dir);
+
+          let controller = new AbortController();
+          controller.abort();
+
+          await assert.rejects(
+            watcher.subscribe(
+              dir,
+              (err, events) => {
+                assert(false, 'Should not get here');
+              },
+              {backend, signal: controller.signal},
+            ),
+            {name: 'AbortError'},
+          );
+        });
       });
     });
   });